@@ -1,4 +1,6 @@
 
+#include <memory>
+
 #include "metalan_prime.h"
 
 
@@ -7,16 +9,19 @@ namespace macrolan {
 
 struct Macrolan {
 
-    metalan::Symlist code;
+    // The macro grammar and the macros defined; copies share them.
+    std::shared_ptr<const metalan::Symlist> code;
 
-    std::unordered_map<metalan::Sym,metalan::Symlist> macros;
+    std::unordered_map< metalan::Sym, std::shared_ptr<const metalan::Symlist> > macros;
 
     Macrolan(const Macrolan& ml) : code(ml.code), macros(ml.macros) {}
 
-    Macrolan(Macrolan&& ml) : code(ml.code), macros(ml.macros) {}
+    Macrolan(Macrolan&& ml) : code(std::move(ml.code)), macros(std::move(ml.macros)) {}
 
     Macrolan(const std::string& c) {
-        code.parse(c);
+        std::shared_ptr<metalan::Symlist> sl = std::make_shared<metalan::Symlist>();
+        sl->parse(c);
+        code = sl;
     }
 
     std::string apply(metalan::Symlist::list_t::iterator& b, 
@@ -66,7 +71,7 @@ struct Macrolan {
             } else if (op == end) {
 
                 metalan::MetalanPrime map;
-                metalan::Symlist sl = tmp->second;
+                metalan::Symlist sl = *tmp->second;
 
                 try {
                     std::string ret = map.parse(sl, argtext, false, rulename).print_raw();
@@ -96,7 +101,7 @@ struct Macrolan {
 
         metalan::MetalanPrime mlp;
         
-        metalan::Symlist code_ = code;
+        metalan::Symlist code_ = *code;
         metalan::Symlist o = mlp.parse(code_, inp);
 
         std::string ret;
@@ -131,7 +136,8 @@ struct Macrolan {
                 if (tmp != macros.end())
                     throw std::runtime_error("Macro defined twice: " + metalan::symtab().get(b->sym));
 
-                metalan::Symlist& newmacro = macros[b->sym];
+                std::shared_ptr<metalan::Symlist> newmacro = std::make_shared<metalan::Symlist>();
+                macros[b->sym] = newmacro;
 
                 ++b;
                 if (b == e)
@@ -146,7 +152,7 @@ struct Macrolan {
                     if (tmp == macros.end())
                         throw std::runtime_error("Unknown macro in definition: " + metalan::symtab().get(b->sym));
 
-                    newmacro.syms.insert(newmacro.syms.end(), tmp->second.syms.begin(), tmp->second.syms.end());
+                    newmacro->syms.insert(newmacro->syms.end(), tmp->second->syms.begin(), tmp->second->syms.end());
 
                     ++b;
                     if (b == e)
@@ -160,7 +166,7 @@ struct Macrolan {
                 metalan::Symlist newcode;
                 newcode.parse(metalan::symtab().get(b->sym));
 
-                newmacro.syms.splice(newmacro.syms.end(), newcode.syms);
+                newmacro->syms.splice(newmacro->syms.end(), newcode.syms);
             }
 
 
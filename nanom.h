@@ -4,13 +4,19 @@
 #include <ctype.h>
 
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <stdexcept>
 
 #include <string>
 #include <vector>
 #include <unordered_map>
+#include <algorithm>
+#include <iterator>
 
 #include <functional>
+#include <memory>
+#include <chrono>
 
 #include "metalan.h"
 
@@ -138,14 +144,42 @@ struct Shape {
     bool is_real(size_t n) const { return is_type(n, REAL); }
 };
 
+
+// A copy-on-write value: copies share it until one of them calls edit().
+// Shapes and function bodies are kept this way, so that copies of a VmCode
+// share everything but what was added or changed after the copy.
+
+template <typename T>
+struct Cow {
+    std::shared_ptr<T> p;
+
+    Cow() : p(std::make_shared<T>()) {}
+    Cow(const T& v) : p(std::make_shared<T>(v)) {}
+    Cow(T&& v) : p(std::make_shared<T>(std::move(v))) {}
+
+    const T& get() const { return *p; }
+    operator const T&() const { return *p; }
+
+    T& edit() {
+        if (p.use_count() > 1) {
+            p = std::make_shared<T>(*p);
+        }
+        return *p;
+    }
+};
+
+
 struct Shapes {
-    std::unordered_map<Sym,Shape> shapes;
+    std::unordered_map< Sym, Cow<Shape> > shapes;
 
-    Shapes() {}
+    // Set by VmCode::freeze(); add() throws from then on. Copies are not frozen.
+    bool frozen;
 
-    Shapes(const Shapes& s) : shapes(s.shapes) {}
+    Shapes() : frozen(false) {}
 
-    Shapes(Shapes&& s) : shapes(s.shapes) {}
+    Shapes(const Shapes& s) : shapes(s.shapes), frozen(false) {}
+
+    Shapes(Shapes&& s) : shapes(std::move(s.shapes)), frozen(s.frozen) {}
 
     const Shape& get(Sym shapeid) const {
         auto i = shapes.find(shapeid);
@@ -153,7 +187,7 @@ struct Shapes {
         if (i == shapes.end())
             throw std::runtime_error("Unknown shape name: " + symtab().get(shapeid));
 
-        return i->second;
+        return i->second.get();
     }
 
     bool has_shape(Sym shapeid) const {
@@ -162,6 +196,9 @@ struct Shapes {
 
     void add(Sym shapeid, const Shape& sh) {
 
+        if (frozen)
+            throw std::runtime_error("Cannot define shape in frozen code: " + symtab().get(shapeid));
+
         auto i = shapes.find(shapeid);
 
         if (i != shapes.end())
@@ -169,7 +206,7 @@ struct Shapes {
 
         serialize(const_cast<Shape&>(sh));
 
-        shapes.insert(i, std::make_pair(shapeid, sh));
+        shapes.insert(i, std::make_pair(shapeid, Cow<Shape>(sh)));
     }
 
     const Shape& get(const std::string& s) const {
@@ -307,6 +344,10 @@ enum op_t {
     CALL_LIGHT,
     EXIT,
 
+    CALL_DIRECT,
+    TAILCALL_DIRECT,
+    CALL_LIGHT_DIRECT,
+
     NEW_SHAPE,
     DEF_FIELD,
     DEF_STRUCT_FIELD,
@@ -319,6 +360,7 @@ enum op_t {
 
     /***/
 
+    // Int addition, subtraction, multiplication and negation wrap around.
     ADD_INT,
     SUB_INT,
     MUL_INT,
@@ -368,18 +410,169 @@ enum op_t {
     INT_TO_REAL,
     REAL_TO_INT,
     UINT_TO_REAL,
-    REAL_TO_UINT
+    REAL_TO_UINT,
+
+    // Superinstructions, made by VmCode::link() out of common sequences.
+    // The assembler emits the field and syscall ones itself.
+
+    GET_FRAMEHEAD_FIELDS_I,   // PUSH b; PUSH e; GET_FRAMEHEAD_FIELDS
+    GET_FIELDS_I,             // PUSH b; PUSH e; PUSH size; GET_FIELDS
+    SET_FIELDS_I,             // PUSH b; PUSH e; PUSH size; SET_FIELDS
+    NEW_STRUCT_I,             // PUSH n; NEW_STRUCT
+    SYSCALL_DIRECT,           // SYSCALL of VmCode::syscalls[n]
+
+    ADD_INT_I,                // PUSH k; ADD_INT
+    SUB_INT_I,
+    MUL_INT_I,
+    DIV_INT_I,
+    MOD_INT_I,
+
+    DIV_INT_POW2,             // PUSH 2^k; DIV_INT, made by the optimizer; the operand is k
+    MOD_INT_POW2,
+
+    JUMP,                     // PUSH 1; IF n, made by the inliner
+    POP_FRAMETAIL_I,          // POP_FRAMETAIL, keeping n values of the frame rather than its struct
+    TAILCALL_SELF,            // PUSH <own label>; TAILCALL as a jump back to the start, n = -ip
+
+    FAIL_UNLESS,              // IF 2; FAIL
+
+    FAIL_UNLESS_EQ_INT,       // EQ_INT; IF 2; FAIL
+    FAIL_UNLESS_LT_INT,
+    FAIL_UNLESS_LTE_INT,
+    FAIL_UNLESS_GT_INT,
+    FAIL_UNLESS_GTE_INT,
+
+    FAIL_UNLESS_EQ_UINT,
+    FAIL_UNLESS_LT_UINT,
+    FAIL_UNLESS_LTE_UINT,
+    FAIL_UNLESS_GT_UINT,
+    FAIL_UNLESS_GTE_UINT,
+
+    FAIL_UNLESS_EQ_REAL,
+    FAIL_UNLESS_LT_REAL,
+    FAIL_UNLESS_LTE_REAL,
+    FAIL_UNLESS_GT_REAL,
+    FAIL_UNLESS_GTE_REAL,
+
+    POP_FRAMEHEAD_EXIT,       // POP_FRAMEHEAD; EXIT
+    EXIT_OR_POP_FRAMETAIL,    // IF_FAIL 2; EXIT; POP_FRAMETAIL
+
+    OPCODE_COUNT
 };
 
 
+// The FAIL_UNLESS_* opcode for a comparison, and back.
+
+inline op_t fail_unless(op_t cmp) {
+    return (op_t)(FAIL_UNLESS_EQ_INT + (cmp - EQ_INT));
+}
+
+inline op_t fail_unless_compare(op_t op) {
+    return (op_t)(EQ_INT + (op - FAIL_UNLESS_EQ_INT));
+}
+
+inline bool is_compare(op_t op) {
+    return (op >= EQ_INT && op <= GTE_REAL);
+}
+
+inline bool is_fail_unless_compare(op_t op) {
+    return (op >= FAIL_UNLESS_EQ_INT && op <= FAIL_UNLESS_GTE_REAL);
+}
+
+
+// Evaluates a comparison opcode outside of the interpreter.
+inline bool compare(op_t cmp, Val v1, Val v2) {
+    switch (cmp) {
+    case EQ_INT:   return v1.inte == v2.inte;
+    case LT_INT:   return v1.inte < v2.inte;
+    case LTE_INT:  return v1.inte <= v2.inte;
+    case GT_INT:   return v1.inte > v2.inte;
+    case GTE_INT:  return v1.inte >= v2.inte;
+    case EQ_UINT:  return v1.uint == v2.uint;
+    case LT_UINT:  return v1.uint < v2.uint;
+    case LTE_UINT: return v1.uint <= v2.uint;
+    case GT_UINT:  return v1.uint > v2.uint;
+    case GTE_UINT: return v1.uint >= v2.uint;
+    case EQ_REAL:  return v1.real == v2.real;
+    case LT_REAL:  return v1.real < v2.real;
+    case LTE_REAL: return v1.real <= v2.real;
+    case GT_REAL:  return v1.real > v2.real;
+    case GTE_REAL: return v1.real >= v2.real;
+    default:
+        throw std::runtime_error("Sanity error: not a comparison opcode.");
+    }
+}
+
+
+// x / 2^k, rounding toward zero like DIV_INT: negative values get 2^k-1 added
+// before the shift. 0 < k < 64.
+inline Int div_pow2(Int x, UInt k) {
+    return (x + (Int)((UInt)(x >> 63) >> (64 - k))) >> k;
+}
+
+// x % 2^k, with the sign of x like MOD_INT. Unsigned, since the quotient may be
+// negative and shifting that left is undefined.
+inline Int mod_pow2(Int x, UInt k) {
+    return (Int)((UInt)x - ((UInt)div_pow2(x, k) << k));
+}
+
+
 struct Opcode {
     op_t op;
+
+    // Set when 'arg' is a symbol id rather than a number, so that code can be
+    // carried over to another symbol table.
+    bool sym;
+
     Val arg;
 
-    Opcode(op_t o = NOOP, Val a = (UInt)0) : op(o), arg(a) {}
+    Opcode(op_t o = NOOP, Val a = (UInt)0) : op(o), sym(false), arg(a) {}
+
+    static Opcode push_sym(Sym s) {
+        Opcode ret(PUSH, (UInt)s);
+        ret.sym = true;
+        return ret;
+    }
+
+    // The *_DIRECT calls pack the target offset into the low 32 bits
+    // of the argument and the argument struct size into the high 32 bits.
+
+    static Opcode direct(op_t o, size_t target, size_t argsize) {
+        return Opcode(o, (UInt)target | ((UInt)argsize << 32));
+    }
+
+    size_t call_target() const { return arg.uint & 0xFFFFFFFF; }
+    size_t call_argsize() const { return arg.uint >> 32; }
+
+    // Superinstructions pack up to three small operands (field offsets and
+    // struct sizes, or the symbols of a label) into 21 bits each.
+
+    static bool packable(UInt a, UInt b = 0, UInt c = 0) {
+        return (a < ((UInt)1 << 21) && b < ((UInt)1 << 21) && c < ((UInt)1 << 21));
+    }
+
+    static Opcode packed(op_t o, UInt a, UInt b = 0, UInt c = 0) {
+        return Opcode(o, a | (b << 21) | (c << 42));
+    }
+
+    size_t packed_a() const { return arg.uint & 0x1FFFFF; }
+    size_t packed_b() const { return (arg.uint >> 21) & 0x1FFFFF; }
+    size_t packed_c() const { return arg.uint >> 42; }
+
+    bool is_packed() const {
+        return (op == GET_FRAMEHEAD_FIELDS_I || op == GET_FIELDS_I || op == SET_FIELDS_I);
+    }
+
+    bool is_jump() const {
+        return (op == IF || op == IF_NOT || op == IF_FAIL || op == IF_NOT_FAIL || op == JUMP ||
+                op == TAILCALL_SELF);
+    }
 };
 
 
+static_assert(sizeof(Opcode) == 16, "Opcode is not packed");
+
+
 struct label_t {
     Sym name;
     Sym fromshape;
@@ -416,140 +609,1539 @@ namespace nanom {
 
 typedef std::function<bool(const Shapes&, const Shape&, const Shape&, const Struct&, Struct&)> callback_t;
 
-struct Timings {
-    std::unordered_map<label_t, size_t> timings;
-    
-    struct scope {
-        struct timeval b;
-        size_t& counter;
 
-        scope(Timings& t, const label_t& l) : counter(t.timings[l]) {
-            gettimeofday(&b, NULL);
-        }
+// A read-only view of consecutive values; the arguments of a span_callback_t.
 
-        ~scope() {
-            struct timeval e;
-            gettimeofday(&e, NULL);
-            size_t a = (e.tv_sec*1e6 + e.tv_usec);
-            size_t q = (b.tv_sec*1e6 + b.tv_usec);
-            counter += (a-q);
+struct ValSpan {
+    const Val* b;
+    const Val* e;
+
+    ValSpan(const Val* p, size_t n) : b(p), e(p + n) {}
+
+    size_t size() const { return e - b; }
+    const Val& operator[](size_t i) const { return b[i]; }
+
+    const Val* begin() const { return b; }
+    const Val* end() const { return e; }
+};
+
+// The zero-copy callback ABI: the arguments are read in place on the VM
+// stack, and on success the callback writes exactly toshape.size() values
+// to 'out', which is room reserved on the stack above the arguments.
+// Returning false fails the call and leaves nothing on the stack.
+//
+// The VM stack is usable while the callback runs, so callbacks may re-enter it.
+
+typedef std::function<bool(const Shapes&, const Shape&, const Shape&, ValSpan, Val*)> span_callback_t;
+
+// Runs a callback_t under the span ABI, with the copies through Struct that
+// it implies.
+
+inline span_callback_t adapt_callback(const label_t& l, callback_t cb) {
+
+    return [l, cb](const Shapes& shapes, const Shape& from, const Shape& to, ValSpan in, Val* out) {
+
+        Struct tmp;
+        tmp.v.assign(in.begin(), in.end());
+
+        Struct ret;
+
+        if (!cb(shapes, from, to, tmp, ret))
+            return false;
+
+        if (ret.v.size() != to.size()) {
+            throw std::runtime_error("Callback '" + l.print() + "' returned a struct of the wrong size");
         }
+
+        std::copy(ret.v.begin(), ret.v.end(), out);
+        return true;
     };
+}
+
+
+// A registered callback as the VMs see it: a plain function pointer and
+// the state it was registered with. Typed callbacks get a trampoline made
+// for their exact signature and functor, so calling one is a single
+// indirect call with no std::function in between.
+
+struct Callback {
+    typedef bool (*fn_t)(void*, const Shapes&, const Shape&, const Shape&, ValSpan, Val*);
+
+    fn_t fn;
+    std::shared_ptr<void> data;
+
+    Callback() : fn(nullptr) {}
+
+    Callback(fn_t f, std::shared_ptr<void> d) : fn(f), data(d) {}
+
+    explicit Callback(span_callback_t cb) : 
+        fn(call_span), data(std::make_shared<span_callback_t>(cb)) {}
+
+    bool operator()(const Shapes& shapes, const Shape& from, const Shape& to, ValSpan in, Val* out) const {
+        return fn(data.get(), shapes, from, to, in, out);
+    }
+
+private:
+
+    static bool call_span(void* d, const Shapes& shapes, const Shape& from, const Shape& to, 
+                          ValSpan in, Val* out) {
+        return (*static_cast<span_callback_t*>(d))(shapes, from, to, in, out);
+    }
 };
 
 
+// Typed callbacks: plain C++ functions over scalars, registered by their
+// signature, e.g. register_callback<Int(Int,Int)>("random", fn).
+// The shapes follow from the signature: no arguments is Void, one is that
+// scalar's shape, several are the tuple shape "[ A B ... ]". The result is
+// Void or a scalar's shape. Syms are passed as Symbol, since a Sym is a UInt.
 
-struct VmCode {
-    typedef std::vector<Opcode> code_t;
-     
-    Timings timings;
-    std::unordered_map<label_t, code_t> codes;
+struct Symbol {
+    Sym sym;
 
-    Shapes shapes;
+    Symbol(Sym s = 0) : sym(s) {}
+};
+
+template <typename T> struct callback_type;
 
-    std::unordered_map<label_t, callback_t> callbacks;
+template <> struct callback_type<Int> {
+    static Type type() { return INT; }
+    static const char* name() { return "Int"; }
+    static Int get(const Val& v) { return v.inte; }
+    static Val put(Int x) { return Val(x); }
+};
 
-    VmCode() {}
+template <> struct callback_type<UInt> {
+    static Type type() { return UINT; }
+    static const char* name() { return "UInt"; }
+    static UInt get(const Val& v) { return v.uint; }
+    static Val put(UInt x) { return Val(x); }
+};
 
-    VmCode(const VmCode& vc) : codes(vc.codes), shapes(vc.shapes), callbacks(vc.callbacks) {}
+template <> struct callback_type<Real> {
+    static Type type() { return REAL; }
+    static const char* name() { return "Real"; }
+    static Real get(const Val& v) { return v.real; }
+    static Val put(Real x) { return Val(x); }
+};
 
-    VmCode(VmCode&& vc) : codes(vc.codes), shapes(vc.shapes), callbacks(vc.callbacks) {}
+template <> struct callback_type<bool> {
+    static Type type() { return BOOL; }
+    static const char* name() { return "Bool"; }
+    static bool get(const Val& v) { return v.inte != 0; }
+    static Val put(bool x) { return Val((Int)x); }
+};
 
-    void register_callback(label_t s, callback_t cb) {
+template <> struct callback_type<Symbol> {
+    static Type type() { return SYMBOL; }
+    static const char* name() { return "Sym"; }
+    static Symbol get(const Val& v) { return Symbol(v.uint); }
+    static Val put(Symbol x) { return Val(x.sym); }
+};
 
-        if (callbacks.find(s) != callbacks.end()) {
-            throw std::runtime_error("Callback registered twice: " + s.print());
+template <typename T> struct callback_type<const T> : callback_type<T> {};
+template <typename T> struct callback_type<const T&> : callback_type<T> {};
+
+template <size_t... I> struct index_seq {};
+
+template <size_t N, size_t... I> struct make_index_seq : make_index_seq<N-1, N-1, I...> {};
+
+template <size_t... I> struct make_index_seq<0, I...> {
+    typedef index_seq<I...> type;
+};
+
+template <typename SIG> struct typed_callback;
+
+template <typename R, typename... A>
+struct typed_callback<R(A...)> {
+
+    static std::string from_shape() {
+        return shape_name<A...>();
+    }
+
+    static std::string to_shape() {
+        return shape_name<R>();
+    }
+
+    static std::vector<Type> from_types() {
+        return { callback_type<A>::type()... };
+    }
+
+    static std::vector<Type> to_types() {
+        return types<R>();
+    }
+
+    template <typename F>
+    static Callback make(F f) {
+        return Callback(trampoline<F>, std::make_shared<F>(f));
+    }
+
+private:
+
+    template <typename... T>
+    static typename std::enable_if<sizeof...(T) == 0, std::string>::type shape_name() {
+        return "Void";
+    }
+
+    template <typename T>
+    static typename std::enable_if<!std::is_void<T>::value, std::string>::type shape_name() {
+        return callback_type<T>::name();
+    }
+
+    template <typename T>
+    static typename std::enable_if<std::is_void<T>::value, std::string>::type shape_name() {
+        return "Void";
+    }
+
+    template <typename T1, typename T2, typename... T>
+    static std::string shape_name() {
+        std::string ret = "[";
+        for (const char* n : { callback_type<T1>::name(), callback_type<T2>::name(), callback_type<T>::name()... }) {
+            ret += ' ';
+            ret += n;
         }
+        return ret + " ]";
+    }
 
-        callbacks[s] = cb;
+    template <typename T>
+    static typename std::enable_if<std::is_void<T>::value, std::vector<Type> >::type types() {
+        return {};
     }
 
-    static label_t toplevel_label() {
-        Sym none = symtab().get("");
-        return label_t(none, none, none);
+    template <typename T>
+    static typename std::enable_if<!std::is_void<T>::value, std::vector<Type> >::type types() {
+        return { callback_type<T>::type() };
+    }
+
+    template <typename F, typename T, size_t... I>
+    static typename std::enable_if<std::is_void<T>::value>::type call(F& f, ValSpan in, Val*, index_seq<I...>) {
+        f(callback_type<A>::get(in[I])...);
+    }
+
+    template <typename F, typename T, size_t... I>
+    static typename std::enable_if<!std::is_void<T>::value>::type call(F& f, ValSpan in, Val* out, index_seq<I...>) {
+        out[0] = callback_type<T>::put(f(callback_type<A>::get(in[I])...));
+    }
+
+    template <typename F>
+    static bool trampoline(void* d, const Shapes&, const Shape&, const Shape&, ValSpan in, Val* out) {
+        call<F, R>(*static_cast<F*>(d), in, out, typename make_index_seq<sizeof...(A)>::type());
+        return true;
     }
 };
 
+// Checks that a shape exists and holds exactly the given field types, in order.
 
+inline void check_callback_shape(const Shapes& shapes, const std::string& cbname, 
+                                 const std::string& name, const std::vector<Type>& types) {
 
-struct Vm {
+    Sym s = symtab().get(name);
 
-    struct frame_t {
-        label_t prev_label;
-        size_t prev_ip;
-        size_t stack_ix;
-        size_t struct_size;
+    if (!shapes.has_shape(s)) {
+        throw std::runtime_error("Callback '" + cbname + "' needs shape '" + name + 
+                                 "', which is not defined");
+    }
 
-        frame_t() : prev_ip(0), stack_ix(0), struct_size(0) {}
-        frame_t(const label_t& l, size_t i, size_t s, size_t ss) : 
-            prev_label(l), prev_ip(i), stack_ix(s), struct_size(ss) {}
-    };
+    const Shape& shape = shapes.get(s);
 
-    std::vector<Val> stack;
-    std::vector<frame_t> frame;
-    bool failbit;
+    bool ok = (shape.size() == types.size());
 
-    VmCode& code;
-    Shapes& shapes;
+    for (size_t i = 0; ok && i < types.size(); ++i) {
+        ok = shape.is_type(i, types[i]);
+    }
 
-    Shape tmp_shape;
+    if (!ok) {
+        throw std::runtime_error("Callback '" + cbname + "' does not match shape '" + name + "'");
+    }
+}
 
 
-    Vm(VmCode& c) : failbit(false), code(c), shapes(code.shapes) {
+/*
+ * Rebuilds a code vector one opcode (or opcode sequence) at a time.
+ * The step function appends replacement opcodes and returns how many
+ * of the old opcodes it consumed; relative jumps are retargeted to
+ * the new layout afterwards.
+ */
 
-        stack.reserve(2048);
-        frame.reserve(256);
+struct CodeRewriter {
+    typedef std::vector<Opcode> code_t;
+
+    const code_t& in;
+    code_t out;
+
+    CodeRewriter(const code_t& c) : in(c), newip(c.size() + 1, 0), targets(c.size() + 1, 0) {
+
+        for (size_t ip = 0; ip < in.size(); ++ip) {
+
+            if (!in[ip].is_jump())
+                continue;
+
+            Int t = (Int)ip + in[ip].arg.inte;
+
+            if (t < 0 || t > (Int)in.size()) {
+                throw std::runtime_error("Sanity error: jump out of bounds.");
+            }
+
+            ++targets[t];
+        }
     }
 
-    Vm(VmCode& c, Shapes& s) : failbit(false), code(c), shapes(s) {}
+    bool is_target(size_t ip) const {
+        return targets[ip] > 0;
+    }
 
-    Val pop() {
-        Val ret = stack.back();
-        stack.pop_back();
+    // True if the only jump to 'ip' is the one at 'from'.
+    bool only_target_of(size_t ip, size_t from) const {
+        return (targets[ip] == 1 && in[from].is_jump() && from + in[from].arg.inte == ip);
+    }
+
+    // True if the n opcodes at ip exist and can be replaced as a unit,
+    // i.e. no jump lands inside the sequence.
+    bool can_fold(size_t ip, size_t n) const {
+
+        if (ip + n > in.size())
+            return false;
+
+        for (size_t i = ip + 1; i < ip + n; ++i) {
+            if (targets[i] > 0) return false;
+        }
+
+        return true;
+    }
+
+    void emit(const Opcode& op) {
+        out.push_back(op);
+    }
+
+    void emit_jump(const Opcode& op, size_t in_target) {
+        fixups.push_back(std::make_pair(out.size(), in_target));
+        out.push_back(op);
+    }
+
+    void keep(size_t ip) {
+
+        if (in[ip].is_jump()) {
+            emit_jump(in[ip], ip + in[ip].arg.inte);
+        } else {
+            emit(in[ip]);
+        }
+    }
+
+    template <typename STEP>
+    code_t run(STEP step) {
+
+        size_t ip = 0;
+
+        while (ip < in.size()) {
+            newip[ip] = out.size();
+
+            size_t n = step(*this, ip);
+
+            if (n == 0) {
+                throw std::runtime_error("Sanity error: code rewrite did not advance.");
+            }
+
+            for (size_t i = 1; i < n; ++i) {
+                newip[ip + i] = newip[ip];
+            }
+
+            ip += n;
+        }
+
+        newip[in.size()] = out.size();
+
+        for (const auto& f : fixups) {
+            out[f.first].arg = (Int)newip[f.second] - (Int)f.first;
+        }
+
+        code_t ret;
+        ret.swap(out);
         return ret;
     }
 
-    void push(Val v) {
-        stack.push_back(v);
+private:
+    std::vector<size_t> newip;
+    std::vector<uint32_t> targets;
+    std::vector< std::pair<size_t,size_t> > fixups;
+};
+
+
+// Per-callback instrumentation: call counts, total and worst time, and a
+// histogram of latencies in power-of-two buckets, all in nanoseconds of a
+// monotonic clock. The VM times every SYSCALL into VmCode::timings.
+
+struct CallbackTiming {
+
+    // Bucket i counts the calls that took [2^(i-1), 2^i) ns, bucket 0 those
+    // under a nanosecond. The last bucket also takes anything longer.
+    static const size_t BUCKETS = 48;
+
+    uint64_t calls;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t histogram[BUCKETS];
+
+    CallbackTiming() : calls(0), total_ns(0), max_ns(0), histogram() {}
+
+    static size_t bucket(uint64_t ns) {
+        size_t ret = 0;
+        while (ns > 0 && ret < BUCKETS - 1) {
+            ns >>= 1;
+            ++ret;
+        }
+        return ret;
     }
 
-    void reset() {
-        stack.clear();
-        frame.clear();
-        failbit = false;
+    void add(uint64_t ns) {
+        ++calls;
+        total_ns += ns;
+        max_ns = std::max(max_ns, ns);
+        ++histogram[bucket(ns)];
     }
 
+    void merge(const CallbackTiming& t) {
+        calls += t.calls;
+        total_ns += t.total_ns;
+        max_ns = std::max(max_ns, t.max_ns);
+
+        for (size_t i = 0; i < BUCKETS; ++i) {
+            histogram[i] += t.histogram[i];
+        }
+    }
+
+    double mean_ns() const {
+        return (calls == 0 ? 0.0 : (double)total_ns / calls);
+    }
+
+    // An upper bound of the latency below which a fraction q of the calls
+    // finished: the top of the bucket holding that call, or max_ns if less.
+    uint64_t quantile_ns(double q) const {
+
+        if (calls == 0)
+            return 0;
+
+        uint64_t rank = std::max((uint64_t)1, (uint64_t)(q * calls + 0.5));
+        uint64_t n = 0;
+
+        for (size_t i = 0; i < BUCKETS - 1; ++i) {
+            n += histogram[i];
+
+            if (n >= rank)
+                return std::min(((uint64_t)1 << i) - 1, max_ns);
+        }
+
+        return max_ns;
+    }
 };
 
-namespace {
+struct Timings {
 
+    typedef std::chrono::steady_clock clock_type;
 
-struct _mapper {
-    std::unordered_map<size_t,std::string> m;
-    std::unordered_map<std::string,op_t> n;
+    std::unordered_map<label_t, CallbackTiming> callbacks;
 
-    _mapper() {
-        m[(size_t)NOOP] = "NOOP";
-        m[(size_t)PUSH] = "PUSH";
-        m[(size_t)POP] = "POP";
-        m[(size_t)SWAP] = "SWAP";
-        m[(size_t)IF] = "IF";
-        m[(size_t)IF_NOT] = "IF_NOT";
-        m[(size_t)IF_FAIL] = "IF_FAIL";
-        m[(size_t)IF_NOT_FAIL] = "IF_NOT_FAIL";
-        m[(size_t)POP_FRAMEHEAD] = "POP_FRAMEHEAD";
-        m[(size_t)POP_FRAMETAIL] = "POP_FRAMETAIL";
-        m[(size_t)DROP_FRAME] = "DROP_FRAME";
-        m[(size_t)FAIL] = "FAIL";
-        m[(size_t)CALL] = "CALL";
-        m[(size_t)CALL_LIGHT] = "CALL_LIGHT";
-        m[(size_t)SYSCALL] = "SYSCALL";
-        m[(size_t)TAILCALL] = "TAILCALL";
-        m[(size_t)EXIT] = "EXIT";
-        m[(size_t)NEW_SHAPE] = "NEW_SHAPE";
-        m[(size_t)DEF_FIELD] = "DEF_FIELD";
-        m[(size_t)DEF_STRUCT_FIELD] = "DEF_STRUCT_FIELD";
-        m[(size_t)DEF_SHAPE] = "DEF_SHAPE";
+    // Times its own lifetime into the entry for 'l'.
+    struct scope {
+        CallbackTiming& timing;
+        clock_type::time_point b;
+
+        scope(CallbackTiming& t) : timing(t), b(clock_type::now()) {}
+        scope(Timings& t, const label_t& l) : timing(t.slot(l)), b(clock_type::now()) {}
+
+        ~scope() {
+            timing.add(std::chrono::duration_cast<std::chrono::nanoseconds>(clock_type::now() - b).count());
+        }
+    };
+
+    // The entry for 'l'. It stays where it is, also across reset().
+    CallbackTiming& slot(const label_t& l) {
+        return callbacks[l];
+    }
+
+    // Null if 'l' has not been called.
+    const CallbackTiming* find(const label_t& l) const {
+        auto i = callbacks.find(l);
+        return (i == callbacks.end() || i->second.calls == 0 ? nullptr : &(i->second));
+    }
+
+    // The callbacks that were called, most total time first.
+    std::vector< std::pair<label_t, CallbackTiming> > sorted() const {
+        std::vector< std::pair<label_t, CallbackTiming> > ret;
+
+        for (const auto& i : callbacks) {
+            if (i.second.calls != 0) {
+                ret.push_back(i);
+            }
+        }
+
+        std::stable_sort(ret.begin(), ret.end(),
+                         [](const std::pair<label_t, CallbackTiming>& a,
+                            const std::pair<label_t, CallbackTiming>& b) {
+                             return a.second.total_ns > b.second.total_ns;
+                         });
+        return ret;
+    }
+
+    // Not while the VM is running.
+    void reset() {
+        for (auto& i : callbacks) {
+            i.second = CallbackTiming();
+        }
+    }
+
+    // Adds the counts of 't', e.g. those of another thread; see Vm::timings.
+    void merge(const Timings& t) {
+        for (const auto& i : t.callbacks) {
+            slot(i.first).merge(i.second);
+        }
+    }
+
+    // One line per callback, most total time first.
+    std::string print() const {
+        std::string ret;
+
+        for (const auto& i : sorted()) {
+            const CallbackTiming& t = i.second;
+
+            ret += i.first.print() + ": " + std::to_string(t.calls) + " calls, " +
+                std::to_string(t.total_ns) + " ns total, " +
+                std::to_string((uint64_t)t.mean_ns()) + " ns mean, p50 <= " +
+                std::to_string(t.quantile_ns(0.5)) + " ns, p99 <= " +
+                std::to_string(t.quantile_ns(0.99)) + " ns, max " +
+                std::to_string(t.max_ns) + " ns\n";
+        }
+
+        return ret;
+    }
+};
+
+
+/*
+ * The compact encoding of a linked image: one opcode byte, followed by an
+ * operand only for the opcodes that take one, sized to fit. Jump offsets are
+ * in bytes and direct calls target byte offsets, so vm_run can run it as is.
+ *
+ * Each opcode byte stands for an opcode plus the widths of its operand; a
+ * direct call's operand is the target followed by the argument size. The
+ * decoder reads 8 operand bytes at once (the buffer is padded for that) and
+ * assumes a little-endian host.
+ */
+
+enum operand_t {
+    NO_OPERAND,
+    VALUE_OPERAND,
+    CALL_OPERAND
+};
+
+inline operand_t op_operand(op_t op) {
+    switch (op) {
+    case PUSH:
+    case IF:
+    case IF_NOT:
+    case IF_FAIL:
+    case IF_NOT_FAIL:
+    case GET_FRAMEHEAD_FIELDS_I:
+    case GET_FIELDS_I:
+    case SET_FIELDS_I:
+    case NEW_STRUCT_I:
+    case SYSCALL_DIRECT:
+    case ADD_INT_I:
+    case SUB_INT_I:
+    case MUL_INT_I:
+    case DIV_INT_I:
+    case MOD_INT_I:
+    case DIV_INT_POW2:
+    case MOD_INT_POW2:
+    case JUMP:
+    case POP_FRAMETAIL_I:
+    case TAILCALL_SELF:
+        return VALUE_OPERAND;
+    case CALL_DIRECT:
+    case TAILCALL_DIRECT:
+    case CALL_LIGHT_DIRECT:
+        return CALL_OPERAND;
+    default:
+        return NO_OPERAND;
+    }
+}
+
+struct CompactCode {
+
+    struct form_t {
+        op_t op;
+        uint8_t size;
+        uint8_t lo_width;
+        uint8_t hi_width;
+        uint8_t lo_shift;
+        uint8_t hi_shift;
+        UInt lo_mask;
+        UInt hi_mask;
+    };
+
+    // Operand widths in bytes, by index.
+    static size_t width(size_t i) {
+        static const size_t w[] = { 0, 1, 2, 4, 8 };
+        return w[i];
+    }
+
+    struct forms_t {
+        form_t form[256];
+        uint8_t code[OPCODE_COUNT][5][5];
+
+        forms_t() {
+            size_t n = 0;
+
+            auto add = [&](op_t op, size_t lo, size_t hi) {
+                if (n >= 256) {
+                    throw std::runtime_error("Sanity error: out of compact opcodes.");
+                }
+
+                form_t& f = form[n];
+                size_t wl = width(lo);
+                size_t wh = width(hi);
+
+                f.op = op;
+                f.size = 1 + wl + wh;
+                f.lo_width = wl;
+                f.hi_width = wh;
+                f.lo_shift = (wl == 0 ? 0 : 64 - 8 * wl);
+                f.hi_shift = (wh == 0 ? 0 : 8 * wl);
+                f.lo_mask = (wl == 0 ? 0 : ~(UInt)0);
+                f.hi_mask = (wh == 0 ? 0 : (wh == 8 ? ~(UInt)0 : ((UInt)1 << (8 * wh)) - 1));
+
+                code[op][lo][hi] = n;
+                ++n;
+            };
+
+            for (size_t i = 0; i < OPCODE_COUNT; ++i) {
+                op_t op = (op_t)i;
+
+                switch (op_operand(op)) {
+                case NO_OPERAND:
+                    add(op, 0, 0);
+                    break;
+                case VALUE_OPERAND:
+                    for (size_t lo = 0; lo < 5; ++lo) {
+                        add(op, lo, 0);
+                    }
+                    break;
+                case CALL_OPERAND:
+                    for (size_t lo = 1; lo < 4; ++lo) {
+                        for (size_t hi = 0; hi < 4; ++hi) {
+                            add(op, lo, hi);
+                        }
+                    }
+                    break;
+                }
+            }
+
+            for (; n < 256; ++n) {
+                form[n] = form[0];
+            }
+        }
+    };
+
+    static const forms_t& forms() {
+        static const forms_t ret;
+        return ret;
+    }
+
+    std::vector<uint8_t> bytes;
+
+    // Byte offset of every opcode of the image, plus the end offset.
+    std::vector<uint32_t> offsets;
+
+    size_t size() const {
+        return offsets.empty() ? 0 : offsets.back();
+    }
+
+    size_t from_image(size_t ip) const {
+        return offsets[ip];
+    }
+
+    size_t image_ip(size_t off) const {
+        auto i = std::lower_bound(offsets.begin(), offsets.end(), off);
+        return i - offsets.begin();
+    }
+
+    // Decodes the opcode at 'p' into 'c'; returns its size in bytes.
+    static size_t decode(const form_t* form, const uint8_t* p, Opcode& c) {
+        const form_t& f = form[*p];
+
+        UInt raw;
+        ::memcpy(&raw, p + 1, sizeof(raw));
+
+        UInt lo = (UInt)((Int)(raw << f.lo_shift) >> f.lo_shift) & f.lo_mask;
+        UInt hi = (raw >> f.hi_shift) & f.hi_mask;
+
+        c.op = f.op;
+        c.arg = lo | (hi << 32);
+        return f.size;
+    }
+
+    size_t decode(size_t off, Opcode& c) const {
+        return decode(forms().form, &bytes[off], c);
+    }
+
+    static size_t value_width(Int v) {
+        for (size_t i = 0; i < 4; ++i) {
+            size_t w = width(i);
+
+            if (w == 0 ? v == 0 : (((Int)((UInt)v << (64 - 8 * w)) >> (64 - 8 * w)) == v)) {
+                return i;
+            }
+        }
+        return 4;
+    }
+
+    static size_t size_width(UInt v) {
+        for (size_t i = 0; i < 4; ++i) {
+            if (v < ((UInt)1 << (8 * width(i)))) {
+                return i;
+            }
+        }
+        return 4;
+    }
+
+    void encode(const std::vector<Opcode>& image) {
+
+        const forms_t& fm = forms();
+        size_t n = image.size();
+
+        // Operand widths grow until jump and call offsets stop moving.
+
+        std::vector<uint8_t> lo(n, 0);
+        std::vector<uint8_t> hi(n, 0);
+        std::vector<uint32_t> offs(n + 1, 0);
+
+        for (size_t i = 0; i < n; ++i) {
+            const Opcode& c = image[i];
+
+            switch (op_operand(c.op)) {
+            case NO_OPERAND:
+                break;
+            case VALUE_OPERAND:
+                lo[i] = value_width(c.arg.inte);
+                break;
+            case CALL_OPERAND:
+                lo[i] = 1;
+                hi[i] = size_width(c.call_argsize());
+                if (hi[i] > 3) {
+                    throw std::runtime_error("Sanity error: call argument too large.");
+                }
+                break;
+            }
+        }
+
+        bool changed = true;
+
+        while (changed) {
+            changed = false;
+
+            for (size_t i = 0; i < n; ++i) {
+                offs[i+1] = offs[i] + 1 + width(lo[i]) + width(hi[i]);
+            }
+
+            for (size_t i = 0; i < n; ++i) {
+                const Opcode& c = image[i];
+                size_t need = lo[i];
+
+                if (c.is_jump()) {
+                    need = value_width((Int)offs[i + c.arg.inte] - (Int)offs[i]);
+
+                } else if (op_operand(c.op) == CALL_OPERAND) {
+                    need = value_width(offs[c.call_target()]);
+
+                    if (need > 3) {
+                        throw std::runtime_error("Compact code too large.");
+                    }
+                }
+
+                if (need > lo[i]) {
+                    lo[i] = need;
+                    changed = true;
+                }
+            }
+        }
+
+        std::vector<uint8_t> out;
+        out.reserve(offs[n] + sizeof(UInt));
+
+        auto put = [&](UInt v, size_t w) {
+            for (size_t k = 0; k < w; ++k) {
+                out.push_back((v >> (8 * k)) & 0xFF);
+            }
+        };
+
+        for (size_t i = 0; i < n; ++i) {
+            const Opcode& c = image[i];
+
+            out.push_back(fm.code[c.op][lo[i]][hi[i]]);
+
+            if (c.is_jump()) {
+                put(offs[i + c.arg.inte] - offs[i], width(lo[i]));
+
+            } else if (op_operand(c.op) == CALL_OPERAND) {
+                put(offs[c.call_target()], width(lo[i]));
+                put(c.call_argsize(), width(hi[i]));
+
+            } else if (op_operand(c.op) == VALUE_OPERAND) {
+                put(c.arg.uint, width(lo[i]));
+            }
+        }
+
+        // Padding, so that the decoder can always read a whole operand.
+        out.resize(out.size() + sizeof(UInt), 0);
+
+        bytes.swap(out);
+        offsets.swap(offs);
+    }
+};
+
+
+struct VmCode {
+    typedef std::vector<Opcode> code_t;
+     
+    Timings timings;
+
+    // Function bodies as assembled; copies of the VmCode share them, see Cow.
+    std::unordered_map< label_t, Cow<code_t> > codes;
+
+    Shapes shapes;
+
+    std::unordered_map<label_t, Callback> callbacks;
+
+    // The callbacks that the code calls, in a dense table indexed by the
+    // operand of SYSCALL_DIRECT. The shapes and timing entries are bound by
+    // link(), so a call needs no lookups at all.
+
+    struct syscall_t {
+        label_t label;
+        Callback cb;
+        const Shape* from;
+        const Shape* to;
+        CallbackTiming* timing;
+
+        syscall_t() : from(nullptr), to(nullptr), timing(nullptr) {}
+    };
+
+    std::vector<syscall_t> syscalls;
+    std::unordered_map<label_t, size_t> syscall_ix;
+
+    // The linked image: every function body packed into one code segment,
+    // with call sites rewritten into direct calls. Built by link().
+
+    code_t image;
+    std::unordered_map<label_t, size_t> entries;
+    std::vector< std::pair<size_t, label_t> > layout;
+
+    // The same image in the compact encoding.
+    CompactCode compact;
+
+    // The functions of the image that verify() (nanom_verify.h) has proven
+    // safe to run unchecked, with the most stack values a run of each takes
+    // above its frame base. Emptied by link().
+    std::unordered_map<label_t, size_t> verified;
+
+    // Set by freeze(). Copies are not frozen.
+    bool frozen;
+
+    VmCode() : frozen(false) {}
+
+    VmCode(const VmCode& vc) : codes(vc.codes), shapes(vc.shapes), callbacks(vc.callbacks),
+                               syscalls(vc.syscalls), syscall_ix(vc.syscall_ix),
+                               image(vc.image), entries(vc.entries), layout(vc.layout),
+                               compact(vc.compact), verified(vc.verified), frozen(false) {
+        rebind_syscalls();
+    }
+
+    VmCode(VmCode&& vc) : codes(std::move(vc.codes)), shapes(std::move(vc.shapes)),
+                          callbacks(std::move(vc.callbacks)),
+                          syscalls(std::move(vc.syscalls)), syscall_ix(std::move(vc.syscall_ix)),
+                          image(std::move(vc.image)), entries(std::move(vc.entries)),
+                          layout(std::move(vc.layout)), compact(std::move(vc.compact)),
+                          verified(std::move(vc.verified)), frozen(vc.frozen) {
+        rebind_syscalls();
+    }
+
+    // Makes the code and its shapes read-only: anything that would change them
+    // throws from now on, and nothing a Vm does while running modifies them.
+    // Any number of threads can then each run their own Vm on the code, as long
+    // as every Vm has its own Vm::timings.
+
+    void freeze() {
+        frozen = true;
+        shapes.frozen = true;
+    }
+
+    void check_not_frozen(const char* what) const {
+        if (frozen) {
+            throw std::runtime_error(std::string("Cannot ") + what + " in frozen code");
+        }
+    }
+
+    void register_callback(label_t s, Callback cb) {
+
+        check_not_frozen("register a callback");
+
+        if (callbacks.find(s) != callbacks.end()) {
+            throw std::runtime_error("Callback registered twice: " + s.print());
+        }
+
+        callbacks[s] = cb;
+    }
+
+    void register_callback(label_t s, span_callback_t cb) {
+        register_callback(s, Callback(cb));
+    }
+
+    void register_callback(label_t s, callback_t cb) {
+        register_callback(s, adapt_callback(s, cb));
+    }
+
+    static label_t toplevel_label() {
+        Sym none = symtab().get("");
+        return label_t(none, none, none);
+    }
+
+    // The index of callback 'l' in syscalls, added if it is not there yet.
+    size_t syscall_index(const label_t& l) {
+
+        auto i = syscall_ix.find(l);
+
+        if (i != syscall_ix.end())
+            return i->second;
+
+        check_not_frozen("add a syscall");
+
+        auto j = callbacks.find(l);
+
+        if (j == callbacks.end()) {
+            throw std::runtime_error("Callback '" + l.print() + "' undefined");
+        }
+
+        syscall_t sc;
+        sc.label = l;
+        sc.cb = j->second;
+
+        syscall_ix[l] = syscalls.size();
+        syscalls.push_back(sc);
+        return syscalls.size() - 1;
+    }
+
+    void bind_syscalls(const Shapes& shapes) {
+
+        for (auto& sc : syscalls) {
+            sc.from = &(shapes.get(sc.label.fromshape));
+            sc.to = &(shapes.get(sc.label.toshape));
+            sc.timing = &(timings.slot(sc.label));
+        }
+    }
+
+    size_t entry(const label_t& l) const {
+        auto i = entries.find(l);
+
+        if (i == entries.end()) {
+            throw std::runtime_error("Undefined function: " + l.print());
+        }
+
+        return i->second;
+    }
+
+    const label_t& label_at(size_t ip) const {
+        auto i = std::upper_bound(layout.begin(), layout.end(), ip,
+                                  [](size_t ip, const std::pair<size_t,label_t>& e) {
+                                      return ip < e.first;
+                                  });
+
+        if (i == layout.begin()) {
+            throw std::runtime_error("Sanity error: instruction pointer outside of any function.");
+        }
+
+        --i;
+        return i->second;
+    }
+
+    void link(const Shapes& shapes) {
+
+        check_not_frozen("link");
+
+        std::vector<label_t> order;
+
+        for (const auto& i : codes) {
+            order.push_back(i.first);
+        }
+
+        std::sort(order.begin(), order.end(),
+                  [](const label_t& a, const label_t& b) {
+                      if (a.name != b.name) return a.name < b.name;
+                      if (a.fromshape != b.fromshape) return a.fromshape < b.fromshape;
+                      return a.toshape < b.toshape;
+                  });
+
+        code_t img;
+        std::unordered_map<label_t, size_t> ents;
+        std::vector< std::pair<size_t, label_t> > lay;
+
+        // Image offset of each direct call, and its callee.
+        // Targets are patched in once every entry point is known.
+        std::vector< std::pair<size_t, label_t> > calls;
+
+        for (const auto& l : order) {
+
+            size_t base = img.size();
+
+            ents[l] = base;
+            lay.push_back(std::make_pair(base, l));
+
+            CodeRewriter rw(codes[l].get());
+
+            code_t body = rw.run([&](CodeRewriter& rw, size_t ip) -> size_t {
+
+                    const code_t& in = rw.in;
+
+                    auto is_num = [&](size_t i) {
+                        return (in[i].op == PUSH && !in[i].sym);
+                    };
+
+                    // A field read at 'i': GET_FRAMEHEAD_FIELDS or GET_FIELDS, either
+                    // with immediates or after PUSHes of its operands. Returns the
+                    // number of opcodes, or 0.
+
+                    auto fields_at = [&](size_t i, bool& head, UInt& b, UInt& e, UInt& size) -> size_t {
+
+                        if (i >= in.size())
+                            return 0;
+
+                        if (in[i].op == GET_FRAMEHEAD_FIELDS_I || in[i].op == GET_FIELDS_I) {
+                            head = (in[i].op == GET_FRAMEHEAD_FIELDS_I);
+                            b = in[i].packed_a();
+                            e = in[i].packed_b();
+                            size = in[i].packed_c();
+                            return 1;
+                        }
+
+                        if (rw.can_fold(i, 3) && is_num(i) && is_num(i+1) &&
+                            in[i+2].op == GET_FRAMEHEAD_FIELDS) {
+                            head = true;
+                            b = in[i].arg.uint;
+                            e = in[i+1].arg.uint;
+                            size = 0;
+                            return 3;
+                        }
+
+                        if (rw.can_fold(i, 4) && is_num(i) && is_num(i+1) && is_num(i+2) &&
+                            in[i+3].op == GET_FIELDS) {
+                            head = false;
+                            b = in[i].arg.uint;
+                            e = in[i+1].arg.uint;
+                            size = in[i+2].arg.uint;
+                            return 4;
+                        }
+
+                        return 0;
+                    };
+
+                    // Copying a whole struct only to pick fields out of it:
+                    //   GET_FRAMEHEAD_FIELDS_I b e; GET_FIELDS_I b2 e2 e-b
+                    // reads just those fields instead:
+                    //   GET_FRAMEHEAD_FIELDS_I b+b2 b+e2
+                    // Likewise for a GET_FIELDS followed by more GET_FIELDS.
+
+                    bool head;
+                    UInt b, e, size;
+                    size_t len = fields_at(ip, head, b, e, size);
+
+                    if (len > 0) {
+                        size_t k = ip + len;
+
+                        bool head2;
+                        UInt b2, e2, size2;
+                        size_t len2;
+
+                        while ((len2 = fields_at(k, head2, b2, e2, size2)) > 0 && !head2 &&
+                               size2 == e - b && rw.can_fold(ip, k - ip + len2)) {
+
+                            e = b + e2;
+                            b = b + b2;
+                            k += len2;
+                        }
+
+                        if (b <= e && Opcode::packable(b, e, size)) {
+                            rw.emit(Opcode::packed(head ? GET_FRAMEHEAD_FIELDS_I : GET_FIELDS_I, b, e, size));
+                            return k - ip;
+
+                        } else if (k > ip + len) {
+                            rw.emit(Opcode(PUSH, b));
+                            rw.emit(Opcode(PUSH, e));
+
+                            if (!head) {
+                                rw.emit(Opcode(PUSH, size));
+                            }
+
+                            rw.emit(Opcode(head ? GET_FRAMEHEAD_FIELDS : GET_FIELDS));
+                            return k - ip;
+                        }
+                    }
+
+                    // PUSH b; PUSH e; PUSH size; SET_FIELDS
+                    if (rw.can_fold(ip, 4) && is_num(ip) && is_num(ip+1) && is_num(ip+2) &&
+                        in[ip+3].op == SET_FIELDS && in[ip].arg.uint <= in[ip+1].arg.uint &&
+                        Opcode::packable(in[ip].arg.uint, in[ip+1].arg.uint, in[ip+2].arg.uint)) {
+
+                        rw.emit(Opcode::packed(SET_FIELDS_I, in[ip].arg.uint, in[ip+1].arg.uint,
+                                               in[ip+2].arg.uint));
+                        return 4;
+                    }
+
+                    // PUSH n; NEW_STRUCT
+                    if (rw.can_fold(ip, 2) && is_num(ip) && in[ip+1].op == NEW_STRUCT) {
+                        rw.emit(Opcode(NEW_STRUCT_I, in[ip].arg));
+                        return 2;
+                    }
+
+                    // PUSH k; ADD_INT etc.
+                    if (rw.can_fold(ip, 2) && is_num(ip)) {
+                        op_t o = NOOP;
+
+                        switch (in[ip+1].op) {
+                        case ADD_INT: o = ADD_INT_I; break;
+                        case SUB_INT: o = SUB_INT_I; break;
+                        case MUL_INT: o = MUL_INT_I; break;
+                        case DIV_INT: o = DIV_INT_I; break;
+                        case MOD_INT: o = MOD_INT_I; break;
+                        default: break;
+                        }
+
+                        if (o != NOOP) {
+                            rw.emit(Opcode(o, in[ip].arg));
+                            return 2;
+                        }
+                    }
+
+                    // PUSH name; PUSH from; PUSH to; SYSCALL
+                    if (rw.can_fold(ip, 4) &&
+                        in[ip].op == PUSH && in[ip+1].op == PUSH && in[ip+2].op == PUSH &&
+                        in[ip+3].op == SYSCALL &&
+                        callbacks.count(label_t(in[ip].arg.uint, in[ip+1].arg.uint, in[ip+2].arg.uint))) {
+
+                        size_t n = syscall_index(label_t(in[ip].arg.uint, in[ip+1].arg.uint, in[ip+2].arg.uint));
+                        rw.emit(Opcode(SYSCALL_DIRECT, (UInt)n));
+                        return 4;
+                    }
+
+                    // The 'if' asmcall: [compare;] IF 2; FAIL
+                    if (rw.can_fold(ip, 3) && is_compare(in[ip].op) &&
+                        in[ip+1].op == IF && in[ip+1].arg.inte == 2 && in[ip+2].op == FAIL) {
+
+                        rw.emit(Opcode(fail_unless(in[ip].op)));
+                        return 3;
+                    }
+
+                    if (rw.can_fold(ip, 2) && in[ip].op == IF && in[ip].arg.inte == 2 &&
+                        in[ip+1].op == FAIL) {
+
+                        rw.emit(Opcode(FAIL_UNLESS));
+                        return 2;
+                    }
+
+                    // Returning from a function: POP_FRAMEHEAD; EXIT
+                    if (rw.can_fold(ip, 2) && in[ip].op == POP_FRAMEHEAD && in[ip+1].op == EXIT) {
+                        rw.emit(Opcode(POP_FRAMEHEAD_EXIT));
+                        return 2;
+                    }
+
+                    // Trying the next branch: IF_FAIL 2; EXIT; POP_FRAMETAIL
+                    if (ip + 3 <= in.size() && in[ip].op == IF_FAIL && in[ip].arg.inte == 2 &&
+                        in[ip+1].op == EXIT && in[ip+2].op == POP_FRAMETAIL &&
+                        !rw.is_target(ip+1) && rw.only_target_of(ip+2, ip)) {
+
+                        rw.emit(Opcode(EXIT_OR_POP_FRAMETAIL));
+                        return 3;
+                    }
+
+                    // PUSH name; PUSH from; PUSH to; CALL|TAILCALL
+                    if (rw.can_fold(ip, 4) &&
+                        in[ip].op == PUSH && in[ip+1].op == PUSH && in[ip+2].op == PUSH &&
+                        (in[ip+3].op == CALL || in[ip+3].op == TAILCALL)) {
+
+                        label_t callee(in[ip].arg.uint, in[ip+1].arg.uint, in[ip+2].arg.uint);
+
+                        calls.push_back(std::make_pair(base + rw.out.size(), callee));
+                        rw.emit(Opcode::direct(in[ip+3].op == CALL ? CALL_DIRECT : TAILCALL_DIRECT,
+                                               0, shapes.get(callee.fromshape).size()));
+                        return 4;
+                    }
+
+                    // PUSH name; CALL_LIGHT
+                    if (rw.can_fold(ip, 2) && in[ip].op == PUSH && in[ip+1].op == CALL_LIGHT) {
+
+                        label_t callee(in[ip].arg.uint, l.fromshape, l.toshape);
+
+                        calls.push_back(std::make_pair(base + rw.out.size(), callee));
+                        rw.emit(Opcode(CALL_LIGHT_DIRECT));
+                        return 2;
+                    }
+
+                    rw.keep(ip);
+                    return 1;
+                });
+
+            img.insert(img.end(), body.begin(), body.end());
+        }
+
+        if (img.size() > 0xFFFFFFFF) {
+            throw std::runtime_error("Code image too large.");
+        }
+
+        for (const auto& c : calls) {
+
+            auto i = ents.find(c.second);
+
+            if (i == ents.end()) {
+                throw std::runtime_error("Undefined function called: " + c.second.print());
+            }
+
+            Opcode& op = img[c.first];
+            op = Opcode::direct(op.op, i->second, op.call_argsize());
+        }
+
+        compact.encode(img);
+
+        bind_syscalls(shapes);
+
+        image.swap(img);
+        entries.swap(ents);
+        layout.swap(lay);
+        verified.clear();
+    }
+
+private:
+
+    // After a copy, the same as the last link() did, but into our own
+    // shapes and timings.
+    void rebind_syscalls() {
+
+        for (auto& sc : syscalls) {
+            if (sc.from != nullptr) {
+                sc.from = &(shapes.get(sc.label.fromshape));
+                sc.to = &(shapes.get(sc.label.toshape));
+                sc.timing = &(timings.slot(sc.label));
+            }
+        }
+    }
+};
+
+
+
+/*
+ * The VM value stack: a fixed-capacity arena, allocated once per Vm and reused
+ * across runs. Growing past the capacity throws instead of reallocating, so
+ * 'top' and pointers below it stay valid for the whole run; the hot opcodes
+ * work on 'top' directly. The interface is the subset of std::vector the VM
+ * needs.
+ */
+
+struct Stack {
+    typedef Val* iterator;
+    typedef const Val* const_iterator;
+    typedef std::reverse_iterator<iterator> reverse_iterator;
+    typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
+    // 64K values, 512KB. Deep non-tail recursion takes more; Piccol,
+    // PiccolThread and PiccolPool take a capacity.
+    static const size_t DEFAULT_CAPACITY = 1 << 16;
+
+    // From calloc(), so that the pages of a big arena are only touched as the
+    // stack reaches into them.
+    std::unique_ptr<Val, void (*)(void*)> arena;
+    Val* base;
+    Val* top;
+    Val* limit;
+
+    // The deepest the stack has been since the last reset_high_water().
+    Val* peak;
+
+    static Val* allocate(size_t cap) {
+        Val* ret = (Val*)std::calloc(std::max(cap, (size_t)1), sizeof(Val));
+
+        if (!ret)
+            throw std::bad_alloc();
+
+        return ret;
+    }
+
+    Stack(size_t cap = DEFAULT_CAPACITY) : arena(allocate(cap), std::free) {
+        base = top = peak = arena.get();
+        limit = base + cap;
+    }
+
+    Stack(const Stack& s) : arena(allocate(s.capacity()), std::free) {
+        base = arena.get();
+        top = std::copy(s.base, s.top, base);
+        peak = base + s.high_water();
+        limit = base + s.capacity();
+    }
+
+    size_t size() const { return top - base; }
+    size_t capacity() const { return limit - base; }
+    bool empty() const { return top == base; }
+
+    size_t high_water() const { return peak - base; }
+    void reset_high_water() { peak = top; }
+
+    // Replaces the arena; only valid between runs.
+    void set_capacity(size_t cap) {
+
+        if (cap < size()) {
+            throw std::runtime_error("Stack capacity smaller than the current stack.");
+        }
+
+        std::unique_ptr<Val, void (*)(void*)> a(allocate(cap), std::free);
+        std::copy(base, top, a.get());
+
+        size_t n = size();
+        size_t hw = std::min(high_water(), cap);
+
+        arena.swap(a);
+        base = arena.get();
+        top = base + n;
+        peak = base + hw;
+        limit = base + cap;
+    }
+
+    // Makes room for n more values and returns a pointer to the first.
+    Val* grow(size_t n) {
+
+        if (n > (size_t)(limit - top)) {
+            throw std::runtime_error("Stack overflow: more than " + std::to_string(capacity()) + 
+                                     " values on the stack; see Piccol::set_stack_capacity().");
+        }
+
+        Val* ret = top;
+        top += n;
+
+        if (top > peak)
+            peak = top;
+
+        return ret;
+    }
+
+    // grow() for runs whose stack use has been bounded and reserved beforehand.
+    Val* grow_unchecked(size_t n) {
+
+        Val* ret = top;
+        top += n;
+
+        if (top > peak)
+            peak = top;
+
+        return ret;
+    }
+
+    iterator begin() { return base; }
+    iterator end() { return top; }
+    const_iterator begin() const { return base; }
+    const_iterator end() const { return top; }
+    reverse_iterator rbegin() { return reverse_iterator(top); }
+    reverse_iterator rend() { return reverse_iterator(base); }
+    const_reverse_iterator rbegin() const { return const_reverse_iterator(top); }
+    const_reverse_iterator rend() const { return const_reverse_iterator(base); }
+
+    Val& operator[](size_t i) { return base[i]; }
+    const Val& operator[](size_t i) const { return base[i]; }
+
+    Val& back() { return top[-1]; }
+    const Val& back() const { return top[-1]; }
+
+    void push_back(Val v) { *grow(1) = v; }
+    void pop_back() { --top; }
+
+    void clear() { top = base; }
+
+    void resize(size_t n) {
+        if (n > size()) {
+            size_t k = n - size();
+            std::fill_n(grow(k), k, Val());
+        } else {
+            top = base + n;
+        }
+    }
+
+    template <typename IT>
+    iterator insert(iterator pos, IT b, IT e) {
+        size_t off = pos - base;
+        size_t n = std::distance(b, e);
+        Val* old = grow(n);
+        pos = base + off;
+        std::copy_backward(pos, old, top);
+        std::copy(b, e, pos);
+        return pos;
+    }
+
+    iterator insert(iterator pos, size_t n, Val v) {
+        size_t off = pos - base;
+        Val* old = grow(n);
+        pos = base + off;
+        std::copy_backward(pos, old, top);
+        std::fill_n(pos, n, v);
+        return pos;
+    }
+
+    iterator erase(iterator b, iterator e) {
+        if (b != e) {
+            top = std::copy(e, top, b);
+        }
+        return b;
+    }
+
+    // A return or tail call: the 'n' values at the top, which sit right above
+    // the 'size' values at 'slot', take their place. When they fit into the
+    // slot, as results and new arguments mostly do, they are copied straight
+    // in and nothing else moves.
+    void replace(Val* slot, size_t size, size_t n) {
+        Val* src = slot + size;
+
+        if (n <= size) {
+            std::memcpy(slot, src, n * sizeof(Val));
+        } else {
+            std::memmove(slot, src, n * sizeof(Val));
+        }
+
+        top = slot + n;
+    }
+};
+
+
+struct Vm;
+
+// Hook for a native code generator (see nanom_jit.h). vm_run_at() hands it the
+// instruction pointer whenever it enters or returns into a function, and carries
+// on interpreting from wherever the hook leaves off.
+
+struct VmJit {
+    virtual size_t enter(Vm& vm, size_t ip) = 0;
+    virtual ~VmJit() {}
+};
+
+
+struct Vm {
+
+    // Return address (an offset into the linked image), plus the position and 
+    // size of the frame's argument struct on the stack. 32 bits are plenty
+    // for all three, and keep the frame stack dense for deep recursion.
+
+    struct frame_t {
+        uint32_t prev_ip;
+        uint32_t stack_ix;
+        uint32_t struct_size;
+
+        frame_t() : prev_ip(0), stack_ix(0), struct_size(0) {}
+        frame_t(size_t i, size_t s, size_t ss) : 
+            prev_ip((uint32_t)i), stack_ix((uint32_t)s), struct_size((uint32_t)ss) {}
+    };
+
+    static_assert(sizeof(frame_t) == 12, "Vm::frame_t is not packed");
+
+    Stack stack;
+    std::vector<frame_t> frame;
+    bool failbit;
+
+    VmCode& code;
+    Shapes& shapes;
+
+    Shape tmp_shape;
+
+    VmJit* jit;
+
+    // Run VmCode::compact instead of VmCode::image. Native code is only
+    // entered from the image.
+    bool compact;
+
+    // Where callback times go instead of VmCode::timings, if set. Vms that
+    // share frozen code each need their own; see set_timings().
+    Timings* timings;
+
+    // The entries of 'timings' for VmCode::syscalls, by SYSCALL_DIRECT operand.
+    std::vector<CallbackTiming*> syscall_timings;
+
+
+    Vm(VmCode& c, size_t stack_capacity = Stack::DEFAULT_CAPACITY) : 
+        stack(stack_capacity), failbit(false), code(c), shapes(code.shapes), jit(nullptr), compact(false),
+        timings(nullptr) {
+
+        frame.reserve(256);
+    }
+
+    Vm(VmCode& c, Shapes& s, size_t stack_capacity = Stack::DEFAULT_CAPACITY) : 
+        stack(stack_capacity), failbit(false), code(c), shapes(s), jit(nullptr), compact(false),
+        timings(nullptr) {
+
+        frame.reserve(256);
+    }
+
+    Val pop() {
+        return *(--stack.top);
+    }
+
+    void push(Val v) {
+        stack.push_back(v);
+    }
+
+    void reset() {
+        stack.clear();
+        frame.clear();
+        failbit = false;
+    }
+
+    // Times callbacks into 't' from now on, or into VmCode::timings if null.
+    // The entries are looked up here, once; syscalls the code gains later go
+    // to VmCode::timings until this is called again.
+    void set_timings(Timings* t) {
+        timings = t;
+        syscall_timings.clear();
+
+        if (t) {
+            for (const auto& sc : code.syscalls) {
+                syscall_timings.push_back(&(t->slot(sc.label)));
+            }
+        }
+    }
+
+};
+
+namespace {
+
+
+struct _mapper {
+    std::unordered_map<size_t,std::string> m;
+    std::unordered_map<std::string,op_t> n;
+
+    _mapper() {
+        m[(size_t)NOOP] = "NOOP";
+        m[(size_t)PUSH] = "PUSH";
+        m[(size_t)POP] = "POP";
+        m[(size_t)SWAP] = "SWAP";
+        m[(size_t)IF] = "IF";
+        m[(size_t)IF_NOT] = "IF_NOT";
+        m[(size_t)IF_FAIL] = "IF_FAIL";
+        m[(size_t)IF_NOT_FAIL] = "IF_NOT_FAIL";
+        m[(size_t)POP_FRAMEHEAD] = "POP_FRAMEHEAD";
+        m[(size_t)POP_FRAMETAIL] = "POP_FRAMETAIL";
+        m[(size_t)DROP_FRAME] = "DROP_FRAME";
+        m[(size_t)FAIL] = "FAIL";
+        m[(size_t)CALL] = "CALL";
+        m[(size_t)CALL_LIGHT] = "CALL_LIGHT";
+        m[(size_t)SYSCALL] = "SYSCALL";
+        m[(size_t)TAILCALL] = "TAILCALL";
+        m[(size_t)EXIT] = "EXIT";
+        m[(size_t)CALL_DIRECT] = "CALL_DIRECT";
+        m[(size_t)TAILCALL_DIRECT] = "TAILCALL_DIRECT";
+        m[(size_t)CALL_LIGHT_DIRECT] = "CALL_LIGHT_DIRECT";
+        m[(size_t)NEW_SHAPE] = "NEW_SHAPE";
+        m[(size_t)DEF_FIELD] = "DEF_FIELD";
+        m[(size_t)DEF_STRUCT_FIELD] = "DEF_STRUCT_FIELD";
+        m[(size_t)DEF_SHAPE] = "DEF_SHAPE";
         m[(size_t)NEW_STRUCT] = "NEW_STRUCT";
         m[(size_t)SET_FIELDS] = "SET_FIELDS";
         m[(size_t)GET_FIELDS] = "GET_FIELDS";
@@ -596,6 +2188,39 @@ struct _mapper {
         m[(size_t)REAL_TO_INT] = "REAL_TO_INT";
         m[(size_t)UINT_TO_REAL] = "UINT_TO_REAL";
         m[(size_t)REAL_TO_UINT] = "REAL_TO_UINT";
+        m[(size_t)GET_FRAMEHEAD_FIELDS_I] = "GET_FRAMEHEAD_FIELDS_I";
+        m[(size_t)GET_FIELDS_I] = "GET_FIELDS_I";
+        m[(size_t)SET_FIELDS_I] = "SET_FIELDS_I";
+        m[(size_t)NEW_STRUCT_I] = "NEW_STRUCT_I";
+        m[(size_t)SYSCALL_DIRECT] = "SYSCALL_DIRECT";
+        m[(size_t)ADD_INT_I] = "ADD_INT_I";
+        m[(size_t)SUB_INT_I] = "SUB_INT_I";
+        m[(size_t)MUL_INT_I] = "MUL_INT_I";
+        m[(size_t)DIV_INT_I] = "DIV_INT_I";
+        m[(size_t)MOD_INT_I] = "MOD_INT_I";
+        m[(size_t)DIV_INT_POW2] = "DIV_INT_POW2";
+        m[(size_t)MOD_INT_POW2] = "MOD_INT_POW2";
+        m[(size_t)JUMP] = "JUMP";
+        m[(size_t)POP_FRAMETAIL_I] = "POP_FRAMETAIL_I";
+        m[(size_t)TAILCALL_SELF] = "TAILCALL_SELF";
+        m[(size_t)FAIL_UNLESS] = "FAIL_UNLESS";
+        m[(size_t)FAIL_UNLESS_EQ_INT] = "FAIL_UNLESS_EQ_INT";
+        m[(size_t)FAIL_UNLESS_LT_INT] = "FAIL_UNLESS_LT_INT";
+        m[(size_t)FAIL_UNLESS_LTE_INT] = "FAIL_UNLESS_LTE_INT";
+        m[(size_t)FAIL_UNLESS_GT_INT] = "FAIL_UNLESS_GT_INT";
+        m[(size_t)FAIL_UNLESS_GTE_INT] = "FAIL_UNLESS_GTE_INT";
+        m[(size_t)FAIL_UNLESS_EQ_UINT] = "FAIL_UNLESS_EQ_UINT";
+        m[(size_t)FAIL_UNLESS_LT_UINT] = "FAIL_UNLESS_LT_UINT";
+        m[(size_t)FAIL_UNLESS_LTE_UINT] = "FAIL_UNLESS_LTE_UINT";
+        m[(size_t)FAIL_UNLESS_GT_UINT] = "FAIL_UNLESS_GT_UINT";
+        m[(size_t)FAIL_UNLESS_GTE_UINT] = "FAIL_UNLESS_GTE_UINT";
+        m[(size_t)FAIL_UNLESS_EQ_REAL] = "FAIL_UNLESS_EQ_REAL";
+        m[(size_t)FAIL_UNLESS_LT_REAL] = "FAIL_UNLESS_LT_REAL";
+        m[(size_t)FAIL_UNLESS_LTE_REAL] = "FAIL_UNLESS_LTE_REAL";
+        m[(size_t)FAIL_UNLESS_GT_REAL] = "FAIL_UNLESS_GT_REAL";
+        m[(size_t)FAIL_UNLESS_GTE_REAL] = "FAIL_UNLESS_GTE_REAL";
+        m[(size_t)POP_FRAMEHEAD_EXIT] = "POP_FRAMEHEAD_EXIT";
+        m[(size_t)EXIT_OR_POP_FRAMETAIL] = "EXIT_OR_POP_FRAMETAIL";
         
         n["NOOP"] = NOOP;
         n["PUSH"] = PUSH;
@@ -614,6 +2239,9 @@ struct _mapper {
         n["SYSCALL"] = SYSCALL;
         n["TAILCALL"] = TAILCALL;
         n["EXIT"] = EXIT;
+        n["CALL_DIRECT"] = CALL_DIRECT;
+        n["TAILCALL_DIRECT"] = TAILCALL_DIRECT;
+        n["CALL_LIGHT_DIRECT"] = CALL_LIGHT_DIRECT;
         n["NEW_SHAPE"] = NEW_SHAPE;
         n["DEF_FIELD"] = DEF_FIELD;
         n["DEF_STRUCT_FIELD"] = DEF_STRUCT_FIELD;
@@ -662,686 +2290,1511 @@ struct _mapper {
         n["REAL_TO_INT"] = REAL_TO_INT;
         n["UINT_TO_REAL"] = UINT_TO_REAL;
         n["REAL_TO_UINT"] = REAL_TO_UINT;
+        n["GET_FRAMEHEAD_FIELDS_I"] = GET_FRAMEHEAD_FIELDS_I;
+        n["GET_FIELDS_I"] = GET_FIELDS_I;
+        n["SET_FIELDS_I"] = SET_FIELDS_I;
+        n["NEW_STRUCT_I"] = NEW_STRUCT_I;
+        n["SYSCALL_DIRECT"] = SYSCALL_DIRECT;
+        n["ADD_INT_I"] = ADD_INT_I;
+        n["SUB_INT_I"] = SUB_INT_I;
+        n["MUL_INT_I"] = MUL_INT_I;
+        n["DIV_INT_I"] = DIV_INT_I;
+        n["MOD_INT_I"] = MOD_INT_I;
+        n["DIV_INT_POW2"] = DIV_INT_POW2;
+        n["MOD_INT_POW2"] = MOD_INT_POW2;
+        n["JUMP"] = JUMP;
+        n["POP_FRAMETAIL_I"] = POP_FRAMETAIL_I;
+        n["TAILCALL_SELF"] = TAILCALL_SELF;
+        n["FAIL_UNLESS"] = FAIL_UNLESS;
+        n["FAIL_UNLESS_EQ_INT"] = FAIL_UNLESS_EQ_INT;
+        n["FAIL_UNLESS_LT_INT"] = FAIL_UNLESS_LT_INT;
+        n["FAIL_UNLESS_LTE_INT"] = FAIL_UNLESS_LTE_INT;
+        n["FAIL_UNLESS_GT_INT"] = FAIL_UNLESS_GT_INT;
+        n["FAIL_UNLESS_GTE_INT"] = FAIL_UNLESS_GTE_INT;
+        n["FAIL_UNLESS_EQ_UINT"] = FAIL_UNLESS_EQ_UINT;
+        n["FAIL_UNLESS_LT_UINT"] = FAIL_UNLESS_LT_UINT;
+        n["FAIL_UNLESS_LTE_UINT"] = FAIL_UNLESS_LTE_UINT;
+        n["FAIL_UNLESS_GT_UINT"] = FAIL_UNLESS_GT_UINT;
+        n["FAIL_UNLESS_GTE_UINT"] = FAIL_UNLESS_GTE_UINT;
+        n["FAIL_UNLESS_EQ_REAL"] = FAIL_UNLESS_EQ_REAL;
+        n["FAIL_UNLESS_LT_REAL"] = FAIL_UNLESS_LT_REAL;
+        n["FAIL_UNLESS_LTE_REAL"] = FAIL_UNLESS_LTE_REAL;
+        n["FAIL_UNLESS_GT_REAL"] = FAIL_UNLESS_GT_REAL;
+        n["FAIL_UNLESS_GTE_REAL"] = FAIL_UNLESS_GTE_REAL;
+        n["POP_FRAMEHEAD_EXIT"] = POP_FRAMEHEAD_EXIT;
+        n["EXIT_OR_POP_FRAMETAIL"] = EXIT_OR_POP_FRAMETAIL;
+    }
+
+    const std::string& name(op_t opc) const {
+        auto i = m.find(opc);
+
+        if (i == m.end()) {
+            throw std::runtime_error("Invalid opcode requested");
+        }
+
+        return i->second;
+    }
+
+    const op_t code(const std::string& opc) const {
+        auto i = n.find(opc);
+
+        if (i == n.end()) {
+            throw std::runtime_error("Invalid opcode requested: " + opc);
+        }
+
+        return i->second;
+    }
+};
+
+
+inline const std::string& opcodename(op_t opc) {
+    static const _mapper m;
+    return m.name(opc);
+}
+
+
+inline op_t opcodecode(const std::string& opc) {
+    static const _mapper m;
+    return m.code(opc);
+}
+
+}
+
+
+// A listing of the compact code: byte offset, encoded bytes, decoded opcode.
+
+inline std::string compact_print(const VmCode& code) {
+
+    static const char* hexdigits = "0123456789abcdef";
+
+    const CompactCode& cc = code.compact;
+    std::string ret;
+    size_t n = 0;
+
+    for (size_t ip = 0; ip + 1 < cc.offsets.size(); ++ip) {
+
+        while (n < code.layout.size() && code.layout[n].first == ip) {
+            ret += code.layout[n].second.print() + ":\n";
+            ++n;
+        }
+
+        size_t off = cc.offsets[ip];
+        Opcode c;
+        size_t len = cc.decode(off, c);
+
+        std::string hex;
+        for (size_t i = 0; i < len; ++i) {
+            hex += hexdigits[cc.bytes[off+i] >> 4];
+            hex += hexdigits[cc.bytes[off+i] & 0xF];
+        }
+
+        ret += "  " + std::to_string(off) + "\t" + hex + "\t" + opcodename(c.op);
+
+        if (c.is_jump()) {
+            ret += " " + std::to_string(off + c.arg.inte);
+
+        } else if (op_operand(c.op) == CALL_OPERAND) {
+            ret += " " + code.label_at(cc.image_ip(c.call_target())).print() +
+                " (" + std::to_string(c.call_argsize()) + ")";
+
+        } else if (c.op == SYSCALL_DIRECT) {
+            ret += " " + code.syscalls[c.arg.uint].label.print();
+
+        } else if (c.is_packed()) {
+            ret += " " + std::to_string(c.packed_a()) + " " + std::to_string(c.packed_b()) + " " +
+                std::to_string(c.packed_c());
+
+        } else if (op_operand(c.op) == VALUE_OPERAND) {
+            ret += " " + std::to_string(c.arg.inte);
+        }
+
+        ret += "\n";
     }
 
-    const std::string& name(op_t opc) const {
-        auto i = m.find(opc);
+    return ret;
+}
 
-        if (i == m.end()) {
-            throw std::runtime_error("Invalid opcode requested");
+
+// Tracing.
+//
+// vm_run_with() is instantiated once per tracing policy. With NoTrace the hooks
+// are empty and compile away; with SinkTrace every instruction becomes a
+// VmTraceEvent handed to a VmTraceSink.
+
+struct VmTraceEvent {
+
+    enum kind_t {
+        ENTER,
+        OP,
+        CALL,
+        TAILCALL,
+        CALL_LIGHT,
+        EXIT,
+        FAIL
+    };
+
+    kind_t kind;
+    size_t ip;
+    const Opcode* op;
+    size_t depth;
+
+    // The callee for calls, the function entered for ENTER.
+    // Only 'name' is known for CALL_LIGHT.
+    label_t label;
+
+    VmTraceEvent(kind_t k, size_t i, const Opcode* o, size_t d, const label_t& l = label_t()) :
+        kind(k), ip(i), op(o), depth(d), label(l) {}
+};
+
+struct VmTraceSink {
+    virtual void event(const Vm& vm, const VmTraceEvent& e) = 0;
+    virtual ~VmTraceSink() {}
+};
+
+// The classic call/exit trace on std::cout.
+
+struct VmTraceStdout : public VmTraceSink {
+
+    void event(const Vm& vm, const VmTraceEvent& e) {
+
+        if (e.kind == VmTraceEvent::OP)
+            return;
+
+        std::string pref(e.depth * 2, ' ');
+
+        switch (e.kind) {
+        case VmTraceEvent::ENTER:
+            std::cout << ">>> " << e.label.print() << " " << e.ip - vm.code.entry(e.label) << std::endl;
+            break;
+        case VmTraceEvent::CALL:
+        case VmTraceEvent::TAILCALL:
+            std::cout << pref << "CALL " << symtab().get(e.label.name) << " "
+                      << symtab().get(e.label.fromshape) << " "
+                      << symtab().get(e.label.toshape) << std::endl;
+            break;
+        case VmTraceEvent::CALL_LIGHT:
+            std::cout << pref << "CALL_LIGHT " << symtab().get(e.label.name) << std::endl;
+            break;
+        case VmTraceEvent::EXIT:
+            std::cout << pref << "EXIT" << std::endl;
+            break;
+        case VmTraceEvent::FAIL:
+            std::cout << pref << "FAIL" << std::endl;
+            break;
+        default:
+            break;
         }
+    }
+};
 
-        return i->second;
+inline VmTraceSink& vm_trace_stdout() {
+    static VmTraceStdout ret;
+    return ret;
+}
+
+
+struct NoTrace {
+    static const bool enabled = false;
+
+    void enter(const Vm&, size_t) {}
+    void op(const Vm&, size_t) {}
+};
+
+struct SinkTrace {
+    static const bool enabled = true;
+
+    VmTraceSink& sink;
+
+    SinkTrace(VmTraceSink& s) : sink(s) {}
+
+    void enter(const Vm& vm, size_t ip) {
+        sink.event(vm, VmTraceEvent(VmTraceEvent::ENTER, ip, nullptr, vm.frame.size(), vm.code.label_at(ip)));
     }
 
-    const op_t code(const std::string& opc) const {
-        auto i = n.find(opc);
+    // 'ip' is an offset into the image, also when running compact code.
+    void op(const Vm& vm, size_t ip) {
 
-        if (i == n.end()) {
-            throw std::runtime_error("Invalid opcode requested: " + opc);
+        const Opcode& c = vm.code.image[ip];
+        const Val* top = vm.stack.top;
+        size_t depth = vm.frame.size();
+
+        switch (c.op) {
+        case CALL:
+        case TAILCALL:
+            sink.event(vm, VmTraceEvent((c.op == CALL ? VmTraceEvent::CALL : VmTraceEvent::TAILCALL),
+                                        ip, &c, depth, label_t(top[-3].uint, top[-2].uint, top[-1].uint)));
+            break;
+        case CALL_LIGHT:
+            sink.event(vm, VmTraceEvent(VmTraceEvent::CALL_LIGHT, ip, &c, depth, label_t(top[-1].uint)));
+            break;
+        case CALL_DIRECT:
+        case TAILCALL_DIRECT:
+            sink.event(vm, VmTraceEvent((c.op == CALL_DIRECT ? VmTraceEvent::CALL : VmTraceEvent::TAILCALL),
+                                        ip, &c, depth, vm.code.label_at(c.call_target())));
+            break;
+        case TAILCALL_SELF:
+            sink.event(vm, VmTraceEvent(VmTraceEvent::TAILCALL, ip, &c, depth, vm.code.label_at(ip)));
+            break;
+        case CALL_LIGHT_DIRECT:
+            sink.event(vm, VmTraceEvent(VmTraceEvent::CALL_LIGHT, ip, &c, depth,
+                                        vm.code.label_at(c.call_target())));
+            break;
+        case EXIT:
+            sink.event(vm, VmTraceEvent(VmTraceEvent::EXIT, ip, &c, depth));
+            break;
+        case FAIL:
+            sink.event(vm, VmTraceEvent(VmTraceEvent::FAIL, ip, &c, depth));
+            break;
+        case POP_FRAMEHEAD_EXIT:
+            sink.event(vm, VmTraceEvent(VmTraceEvent::EXIT, ip, &c, depth));
+            break;
+        case EXIT_OR_POP_FRAMETAIL:
+            sink.event(vm, VmTraceEvent((vm.failbit ? VmTraceEvent::OP : VmTraceEvent::EXIT), ip, &c, depth));
+            break;
+        case FAIL_UNLESS:
+            sink.event(vm, VmTraceEvent((top[-1].uint ? VmTraceEvent::OP : VmTraceEvent::FAIL), ip, &c, depth));
+            break;
+        default:
+            if (is_fail_unless_compare(c.op)) {
+                bool pass = compare(fail_unless_compare(c.op), top[-2], top[-1]);
+                sink.event(vm, VmTraceEvent((pass ? VmTraceEvent::OP : VmTraceEvent::FAIL), ip, &c, depth));
+                break;
+            }
+
+            sink.event(vm, VmTraceEvent(VmTraceEvent::OP, ip, &c, depth));
+            break;
         }
+    }
+};
 
-        return i->second;
+
+// Execution counts per opcode, per pair of consecutively executed opcodes,
+// and per instruction of the image; see ProfileTrace.
+
+struct VmProfile {
+
+    std::vector<size_t> hits;
+    std::vector<size_t> ops;
+    std::vector<size_t> pairs;
+
+    op_t last;
+    bool has_last;
+
+    VmProfile() : ops(OPCODE_COUNT, 0), pairs(OPCODE_COUNT * OPCODE_COUNT, 0), has_last(false) {}
+
+    void reset() {
+        hits.clear();
+        ops.assign(OPCODE_COUNT, 0);
+        pairs.assign(OPCODE_COUNT * OPCODE_COUNT, 0);
+        has_last = false;
+    }
+
+    void count(op_t op, size_t ip) {
+
+        if (ip >= hits.size()) {
+            hits.resize(ip + 1, 0);
+        }
+
+        ++hits[ip];
+        ++ops[op];
+
+        if (has_last) {
+            ++pairs[last * OPCODE_COUNT + op];
+        }
+
+        last = op;
+        has_last = true;
+    }
+
+    size_t at(size_t ip) const {
+        return (ip < hits.size() ? hits[ip] : 0);
+    }
+
+    size_t at(const VmCode& code, const label_t& l, size_t ip) const {
+        return at(code.entry(l) + ip);
+    }
+
+    size_t total() const {
+        size_t ret = 0;
+        for (size_t n : ops) {
+            ret += n;
+        }
+        return ret;
+    }
+
+    // Most executed first.
+
+    std::vector< std::pair<op_t, size_t> > opcodes() const {
+        std::vector< std::pair<op_t, size_t> > ret;
+
+        for (size_t i = 0; i < OPCODE_COUNT; ++i) {
+            if (ops[i] > 0) {
+                ret.push_back(std::make_pair((op_t)i, ops[i]));
+            }
+        }
+
+        std::stable_sort(ret.begin(), ret.end(),
+                         [](const std::pair<op_t, size_t>& a, const std::pair<op_t, size_t>& b) {
+                             return a.second > b.second;
+                         });
+        return ret;
+    }
+
+    std::vector< std::pair<std::pair<op_t, op_t>, size_t> > opcode_pairs() const {
+        std::vector< std::pair<std::pair<op_t, op_t>, size_t> > ret;
+
+        for (size_t i = 0; i < pairs.size(); ++i) {
+            if (pairs[i] > 0) {
+                ret.push_back(std::make_pair(std::make_pair((op_t)(i / OPCODE_COUNT), (op_t)(i % OPCODE_COUNT)),
+                                             pairs[i]));
+            }
+        }
+
+        std::stable_sort(ret.begin(), ret.end(),
+                         [](const std::pair<std::pair<op_t, op_t>, size_t>& a,
+                            const std::pair<std::pair<op_t, op_t>, size_t>& b) {
+                             return a.second > b.second;
+                         });
+        return ret;
+    }
+};
+
+struct ProfileTrace {
+    static const bool enabled = true;
+
+    VmProfile& prof;
+
+    ProfileTrace(VmProfile& p) : prof(p) {}
+
+    void enter(const Vm&, size_t) {}
+
+    void op(const Vm& vm, size_t ip) {
+        prof.count(vm.code.image[ip].op, ip);
+    }
+};
+
+
+// The opcode and opcode pair histograms, then the image function by function
+// in the layout of PiccolAsm::print, each instruction with its hit count.
+
+inline std::string profile_print(const VmCode& code, const VmProfile& prof, size_t top = 20) {
+
+    auto quote = [](const std::string& s) {
+        std::string ret = "'";
+        for (char cc : s) {
+            if (cc == '\'') {
+                ret += "\\'";
+            } else {
+                ret += cc;
+            }
+        }
+        return ret + "'";
+    };
+
+    auto count = [](size_t n) {
+        std::string ret = std::to_string(n);
+        return std::string(ret.size() < 12 ? 12 - ret.size() : 0, ' ') + ret + "  ";
+    };
+
+    std::string ret = "opcodes: " + std::to_string(prof.total()) + "\n";
+
+    auto ops = prof.opcodes();
+    for (size_t i = 0; i < ops.size() && i < top; ++i) {
+        ret += count(ops[i].second) + opcodename(ops[i].first) + "\n";
+    }
+
+    ret += "opcode pairs:\n";
+
+    auto pairs = prof.opcode_pairs();
+    for (size_t i = 0; i < pairs.size() && i < top; ++i) {
+        ret += count(pairs[i].second) + opcodename(pairs[i].first.first) + " " +
+            opcodename(pairs[i].first.second) + "\n";
+    }
+
+    size_t n = 0;
+
+    for (size_t ip = 0; ip < code.image.size(); ++ip) {
+
+        while (n < code.layout.size() && code.layout[n].first == ip) {
+            const label_t& l = code.layout[n].second;
+            ret += "LABEL\n" + symtab().get(l.name) + "\n" + symtab().get(l.fromshape) + "\n" +
+                symtab().get(l.toshape) + "\n";
+            ++n;
+        }
+
+        const Opcode& c = code.image[ip];
+
+        ret += count(prof.at(ip)) + quote(opcodename(c.op));
+
+        if (c.sym) {
+            ret += " " + quote(symtab().get(c.arg.uint));
+
+        } else if (c.op == SYSCALL_DIRECT) {
+            const label_t& l = code.syscalls[c.arg.uint].label;
+            ret += " " + quote(symtab().get(l.name)) + " " + quote(symtab().get(l.fromshape)) + " " +
+                quote(symtab().get(l.toshape));
+
+        } else if (c.is_packed()) {
+            ret += " " + quote(std::to_string(c.packed_a())) + " " + quote(std::to_string(c.packed_b())) + " " +
+                quote(std::to_string(c.packed_c()));
+
+        } else if (op_operand(c.op) == VALUE_OPERAND) {
+            ret += " " + quote(std::to_string(c.arg.inte));
+
+        } else if (op_operand(c.op) == CALL_OPERAND) {
+            const label_t& l = code.label_at(c.call_target());
+            ret += " " + quote(symtab().get(l.name)) + " " + quote(symtab().get(l.fromshape)) + " " +
+                quote(symtab().get(l.toshape));
+        }
+
+        ret += "\n";
+    }
+
+    return ret;
+}
+
+
+#if defined(__GNUC__) && !defined(NANOM_NO_THREADED_DISPATCH)
+#define NANOM_THREADED_DISPATCH
+#endif
+
+// Where vm_run_with() fetches opcodes from. Inside the loop 'ip' is in the
+// fetcher's own units; call targets and return addresses are too.
+
+struct ImageFetch {
+    static const bool native = true;
+    static const bool checked = true;
+
+    const VmCode::code_t& code;
+
+    ImageFetch(const VmCode& c) : code(c.image) {}
+
+    size_t from_image(size_t ip) const { return ip; }
+    size_t image_ip(size_t ip) const { return ip; }
+
+    const Opcode* fetch(size_t ip) {
+        if (ip >= code.size()) {
+            throw std::runtime_error("Sanity error: instruction pointer out of bounds.");
+        }
+        return &code[ip];
+    }
+
+    size_t next(size_t ip) const { return ip + 1; }
+};
+
+// ImageFetch for verified code (see VmCode::verified): no bounds checks on
+// the instruction pointer, and none on stack growth either.
+
+struct UncheckedFetch : public ImageFetch {
+    static const bool checked = false;
+
+    UncheckedFetch(const VmCode& c) : ImageFetch(c) {}
+
+    const Opcode* fetch(size_t ip) {
+        return &code[ip];
+    }
+};
+
+struct CompactFetch {
+    static const bool native = false;
+    static const bool checked = true;
+
+    const CompactCode& code;
+    const uint8_t* bytes;
+    const CompactCode::form_t* form;
+    size_t size;
+    Opcode cur;
+    size_t len;
+
+    CompactFetch(const VmCode& c) : code(c.compact), bytes(code.bytes.data()),
+                                    form(CompactCode::forms().form), size(code.size()), len(0) {}
+
+    size_t from_image(size_t ip) const { return code.from_image(ip); }
+    size_t image_ip(size_t ip) const { return code.image_ip(ip); }
+
+    const Opcode* fetch(size_t ip) {
+        if (ip >= size) {
+            throw std::runtime_error("Sanity error: instruction pointer out of bounds.");
+        }
+        len = CompactCode::decode(form, bytes + ip, cur);
+        return &cur;
+    }
+
+    size_t next(size_t ip) const { return ip + len; }
+};
+
+
+// Calls the callback 'cb' on the struct at the top of the stack and
+// replaces it with the result. The result is written above the arguments
+// and then moved down over them.
+
+inline void vm_syscall(Vm& vm, const Callback& cb, const Shape& from, const Shape& to, CallbackTiming& timing) {
+
+    Val* args = vm.stack.top - from.size();
+    Val* out = vm.stack.grow(to.size());
+    bool ok;
+
+    {
+        Timings::scope timer(timing);
+        ok = cb(vm.shapes, from, to, ValSpan(args, from.size()), out);
+    }
+
+    if (ok) {
+        std::copy(out, out + to.size(), args);
+    }
+
+    vm.stack.top = args + (ok ? to.size() : 0);
+    vm.failbit = !ok;
+}
+
+// The same for a callback known only by its label.
+
+inline void vm_syscall(Vm& vm, const label_t& l) {
+
+    auto j = vm.code.callbacks.find(l);
+
+    if (j == vm.code.callbacks.end()) {
+        throw std::runtime_error("Callback '" + l.print() + "' undefined");
+    }
+
+    Timings& t = (vm.timings ? *vm.timings : vm.code.timings);
+
+    vm_syscall(vm, j->second, vm.shapes.get(l.fromshape), vm.shapes.get(l.toshape), t.slot(l));
+}
+
+
+// The frame of a tail call: the new argument struct of 'argsize' values at the
+// top replaces the old one. Right above the old one, which is where the
+// emitter's code leaves it, it is written straight into the old slot.
+
+inline void vm_tailcall(Vm& vm, size_t argsize) {
+
+    auto& fp = vm.frame.back();
+    Val* sb = vm.stack.begin() + fp.stack_ix;
+
+    if (sb + fp.struct_size + argsize == vm.stack.end()) {
+        vm.stack.replace(sb, fp.struct_size, argsize);
+
+    } else {
+        vm.stack.erase(sb, sb + fp.struct_size);
+        fp.stack_ix = vm.stack.size() - argsize;
+    }
+
+    fp.struct_size = argsize;
+}
+
+
+// Runs the linked code starting at image offset 'ip'.
+// The caller must have pushed a frame for the entry function.
+
+template <typename FETCH, typename TRACE>
+void vm_run_with(Vm& vm, size_t ip, TRACE& trace) {
+
+    size_t topframe = vm.frame.size();
+
+    FETCH fetch(vm.code);
+    
+    if (TRACE::enabled) {
+        trace.enter(vm, ip);
+    }
+
+    ip = fetch.from_image(ip);
+
+    const Opcode* c;
+
+    // Native code would skip the trace hooks, and only runs from the image.
+    VmJit* jit = (TRACE::enabled || !FETCH::native ? nullptr : vm.jit);
+
+    if (jit) {
+        ip = jit->enter(vm, ip);
+    }
+
+#define NANOM_FETCH()                                                                   \
+    c = fetch.fetch(ip);                                                                \
+    if (TRACE::enabled) {                                                               \
+        trace.op(vm, fetch.image_ip(ip));                                               \
+    }
+
+#ifdef NANOM_THREADED_DISPATCH
+
+    // Direct-threaded dispatch: every handler jumps straight to the next one.
+    // The designated initializers make g++ reject a table that is out of order.
+
+    static const void* const dispatch[] = {
+        [NOOP]                 = &&op_NOOP,
+        [PUSH]                 = &&op_PUSH,
+        [POP]                  = &&op_POP,
+        [SWAP]                 = &&op_SWAP,
+        [IF_FAIL]              = &&op_IF_FAIL,
+        [IF_NOT_FAIL]          = &&op_IF_NOT_FAIL,
+        [POP_FRAMEHEAD]        = &&op_POP_FRAMEHEAD,
+        [POP_FRAMETAIL]        = &&op_POP_FRAMETAIL,
+        [DROP_FRAME]           = &&op_DROP_FRAME,
+        [FAIL]                 = &&op_FAIL,
+        [IF]                   = &&op_IF,
+        [IF_NOT]               = &&op_IF_NOT,
+        [CALL]                 = &&op_CALL,
+        [SYSCALL]              = &&op_SYSCALL,
+        [TAILCALL]             = &&op_TAILCALL,
+        [CALL_LIGHT]           = &&op_CALL_LIGHT,
+        [EXIT]                 = &&op_EXIT,
+        [CALL_DIRECT]          = &&op_CALL_DIRECT,
+        [TAILCALL_DIRECT]      = &&op_TAILCALL_DIRECT,
+        [CALL_LIGHT_DIRECT]    = &&op_CALL_LIGHT_DIRECT,
+        [NEW_SHAPE]            = &&op_NEW_SHAPE,
+        [DEF_FIELD]            = &&op_DEF_FIELD,
+        [DEF_STRUCT_FIELD]     = &&op_DEF_STRUCT_FIELD,
+        [DEF_SHAPE]            = &&op_DEF_SHAPE,
+        [NEW_STRUCT]           = &&op_NEW_STRUCT,
+        [SET_FIELDS]           = &&op_SET_FIELDS,
+        [GET_FIELDS]           = &&op_GET_FIELDS,
+        [GET_FRAMEHEAD_FIELDS] = &&op_GET_FRAMEHEAD_FIELDS,
+        [ADD_INT]              = &&op_ADD_INT,
+        [SUB_INT]              = &&op_SUB_INT,
+        [MUL_INT]              = &&op_MUL_INT,
+        [DIV_INT]              = &&op_DIV_INT,
+        [MOD_INT]              = &&op_MOD_INT,
+        [NEG_INT]              = &&op_NEG_INT,
+        [ADD_UINT]             = &&op_ADD_UINT,
+        [SUB_UINT]             = &&op_SUB_UINT,
+        [MUL_UINT]             = &&op_MUL_UINT,
+        [MOD_UINT]             = &&op_MOD_UINT,
+        [DIV_UINT]             = &&op_DIV_UINT,
+        [ADD_REAL]             = &&op_ADD_REAL,
+        [SUB_REAL]             = &&op_SUB_REAL,
+        [MUL_REAL]             = &&op_MUL_REAL,
+        [DIV_REAL]             = &&op_DIV_REAL,
+        [NEG_REAL]             = &&op_NEG_REAL,
+        [BAND]                 = &&op_BAND,
+        [BOR]                  = &&op_BOR,
+        [BNOT]                 = &&op_BNOT,
+        [BXOR]                 = &&op_BXOR,
+        [BSHL]                 = &&op_BSHL,
+        [BSHR]                 = &&op_BSHR,
+        [BOOL_NOT]             = &&op_BOOL_NOT,
+        [EQ_INT]               = &&op_EQ_INT,
+        [LT_INT]               = &&op_LT_INT,
+        [LTE_INT]              = &&op_LTE_INT,
+        [GT_INT]               = &&op_GT_INT,
+        [GTE_INT]              = &&op_GTE_INT,
+        [EQ_UINT]              = &&op_EQ_UINT,
+        [LT_UINT]              = &&op_LT_UINT,
+        [LTE_UINT]             = &&op_LTE_UINT,
+        [GT_UINT]              = &&op_GT_UINT,
+        [GTE_UINT]             = &&op_GTE_UINT,
+        [EQ_REAL]              = &&op_EQ_REAL,
+        [LT_REAL]              = &&op_LT_REAL,
+        [LTE_REAL]             = &&op_LTE_REAL,
+        [GT_REAL]              = &&op_GT_REAL,
+        [GTE_REAL]             = &&op_GTE_REAL,
+        [INT_TO_REAL]          = &&op_INT_TO_REAL,
+        [REAL_TO_INT]          = &&op_REAL_TO_INT,
+        [UINT_TO_REAL]         = &&op_UINT_TO_REAL,
+        [REAL_TO_UINT]         = &&op_REAL_TO_UINT,
+        [GET_FRAMEHEAD_FIELDS_I] = &&op_GET_FRAMEHEAD_FIELDS_I,
+        [GET_FIELDS_I]         = &&op_GET_FIELDS_I,
+        [SET_FIELDS_I]         = &&op_SET_FIELDS_I,
+        [NEW_STRUCT_I]         = &&op_NEW_STRUCT_I,
+        [SYSCALL_DIRECT]       = &&op_SYSCALL_DIRECT,
+        [ADD_INT_I]            = &&op_ADD_INT_I,
+        [SUB_INT_I]            = &&op_SUB_INT_I,
+        [MUL_INT_I]            = &&op_MUL_INT_I,
+        [DIV_INT_I]            = &&op_DIV_INT_I,
+        [MOD_INT_I]            = &&op_MOD_INT_I,
+        [DIV_INT_POW2]         = &&op_DIV_INT_POW2,
+        [MOD_INT_POW2]         = &&op_MOD_INT_POW2,
+        [JUMP]                 = &&op_JUMP,
+        [POP_FRAMETAIL_I]      = &&op_POP_FRAMETAIL_I,
+        [TAILCALL_SELF]        = &&op_TAILCALL_SELF,
+        [FAIL_UNLESS]          = &&op_FAIL_UNLESS,
+        [FAIL_UNLESS_EQ_INT]   = &&op_FAIL_UNLESS_EQ_INT,
+        [FAIL_UNLESS_LT_INT]   = &&op_FAIL_UNLESS_LT_INT,
+        [FAIL_UNLESS_LTE_INT]  = &&op_FAIL_UNLESS_LTE_INT,
+        [FAIL_UNLESS_GT_INT]   = &&op_FAIL_UNLESS_GT_INT,
+        [FAIL_UNLESS_GTE_INT]  = &&op_FAIL_UNLESS_GTE_INT,
+        [FAIL_UNLESS_EQ_UINT]  = &&op_FAIL_UNLESS_EQ_UINT,
+        [FAIL_UNLESS_LT_UINT]  = &&op_FAIL_UNLESS_LT_UINT,
+        [FAIL_UNLESS_LTE_UINT] = &&op_FAIL_UNLESS_LTE_UINT,
+        [FAIL_UNLESS_GT_UINT]  = &&op_FAIL_UNLESS_GT_UINT,
+        [FAIL_UNLESS_GTE_UINT] = &&op_FAIL_UNLESS_GTE_UINT,
+        [FAIL_UNLESS_EQ_REAL]  = &&op_FAIL_UNLESS_EQ_REAL,
+        [FAIL_UNLESS_LT_REAL]  = &&op_FAIL_UNLESS_LT_REAL,
+        [FAIL_UNLESS_LTE_REAL] = &&op_FAIL_UNLESS_LTE_REAL,
+        [FAIL_UNLESS_GT_REAL]  = &&op_FAIL_UNLESS_GT_REAL,
+        [FAIL_UNLESS_GTE_REAL] = &&op_FAIL_UNLESS_GTE_REAL,
+        [POP_FRAMEHEAD_EXIT]   = &&op_POP_FRAMEHEAD_EXIT,
+        [EXIT_OR_POP_FRAMETAIL] = &&op_EXIT_OR_POP_FRAMETAIL,
+    };
+
+    static_assert(sizeof(dispatch) / sizeof(dispatch[0]) == OPCODE_COUNT,
+                  "Dispatch table does not cover all opcodes");
+
+#define NANOM_OP(o) op_##o
+#define NANOM_DISPATCH() do { NANOM_FETCH(); goto *dispatch[c->op]; } while (0)
+
+    NANOM_DISPATCH();
+
+#else
+
+#define NANOM_OP(o) case o
+#define NANOM_DISPATCH() goto dispatch
+
+ dispatch:
+    NANOM_FETCH();
+
+    switch (c->op) {
+
+#endif
+
+#define NANOM_NEXT() do { ip = fetch.next(ip); NANOM_DISPATCH(); } while (0)
+#define NANOM_GROW(n) (FETCH::checked ? vm.stack.grow(n) : vm.stack.grow_unchecked(n))
+#define NANOM_ENTER() do { if (jit) { ip = jit->enter(vm, ip); } NANOM_DISPATCH(); } while (0)
+
+#define NANOM_RETURN(fail)                                                              \
+    do {                                                                                \
+        vm.failbit = fail;                                                              \
+        if (vm.frame.size() == topframe) {                                              \
+            vm.frame.pop_back();                                                        \
+            return;                                                                     \
+        }                                                                               \
+        ip = vm.frame.back().prev_ip;                                                   \
+        vm.frame.pop_back();                                                            \
+        NANOM_ENTER();                                                                  \
+    } while (0)
+
+    NANOM_OP(NOOP):
+        NANOM_NEXT();
+        
+    NANOM_OP(PUSH):
+        *NANOM_GROW(1) = c->arg;
+        NANOM_NEXT();
+
+    NANOM_OP(POP):
+        vm.stack.pop_back();
+        NANOM_NEXT();
+
+    NANOM_OP(SWAP):
+        std::swap(vm.stack.top[-1], vm.stack.top[-2]);
+        NANOM_NEXT();
+
+    NANOM_OP(IF): {
+        Val v = vm.pop();
+        if (v.uint) {
+            ip += c->arg.inte;
+            NANOM_DISPATCH();
+        }
+        NANOM_NEXT();
+    }
+
+    NANOM_OP(IF_NOT): {
+        Val v = vm.pop();
+        if (!v.uint) {
+            ip += c->arg.inte;
+            NANOM_DISPATCH();
+        }
+        NANOM_NEXT();
+    }
+
+    NANOM_OP(IF_FAIL): 
+        if (vm.failbit) {
+            ip += c->arg.inte;
+            NANOM_DISPATCH();
+        }
+        NANOM_NEXT();
+
+    NANOM_OP(IF_NOT_FAIL):
+        if (!vm.failbit) {
+            ip += c->arg.inte;
+            NANOM_DISPATCH();
+        }
+        NANOM_NEXT();
+
+    // The result goes over the argument struct.
+    NANOM_OP(POP_FRAMEHEAD): {
+        const auto& fp = vm.frame.back();
+        auto sb = vm.stack.begin() + fp.stack_ix;
+        auto se = sb + fp.struct_size;
+        vm.stack.replace(sb, fp.struct_size, vm.stack.end() - se);
+        NANOM_NEXT();
+    }
+
+    NANOM_OP(POP_FRAMETAIL): {
+        const auto& fp = vm.frame.back();
+        auto sb = vm.stack.begin() + fp.stack_ix + fp.struct_size;
+        vm.stack.erase(sb, vm.stack.end());
+        NANOM_NEXT();
     }
-};
 
+    NANOM_OP(DROP_FRAME):
+        vm.frame.pop_back();
+        NANOM_NEXT();
+        
+    NANOM_OP(FAIL):
+        NANOM_RETURN(true);
 
-const std::string& opcodename(op_t opc) {
-    static const _mapper m;
-    return m.name(opc);
-}
+    NANOM_OP(EXIT):
+        NANOM_RETURN(false);
 
+    NANOM_OP(TAILCALL): {
+        Val totype = vm.pop();
+        Val fromtype = vm.pop();
+        Val name = vm.pop();
 
-const op_t opcodecode(const std::string& opc) {
-    static const _mapper m;
-    return m.code(opc);
-}
+        const Shape& shape = vm.shapes.get(fromtype.uint);
+        
+        label_t l(name.uint, fromtype.uint, totype.uint);
 
-}
+        vm_tailcall(vm, shape.size());
 
+        vm.failbit = false;
+        ip = fetch.from_image(vm.code.entry(l));
+        NANOM_ENTER();
+    }
 
-inline void vm_run(Vm& vm, 
-                   label_t label = VmCode::toplevel_label(), 
-                   size_t ip = 0, 
-                   bool verbose = false) {
+    NANOM_OP(CALL): {
+        Val totype = vm.pop();
+        Val fromtype = vm.pop();
+        Val name = vm.pop();
 
-    size_t topframe = vm.frame.size();
+        const Shape& shape = vm.shapes.get(fromtype.uint);
+        
+        label_t l(name.uint, fromtype.uint, totype.uint);
 
-    VmCode::code_t* code = &(vm.code.codes[label]);
-    
-    if (verbose) {
-        std::cout << ">>> " << label.print() << " " << ip << std::endl;
+        vm.frame.emplace_back(fetch.next(ip), vm.stack.size() - shape.size(), shape.size());
+
+        vm.failbit = false;
+        ip = fetch.from_image(vm.code.entry(l));
+        NANOM_ENTER();
     }
 
-    while (1) {
+    NANOM_OP(SYSCALL): {
+        Val totype = vm.pop();
+        Val fromtype = vm.pop();
+        Val name = vm.pop();
 
-        if (ip >= code->size()) {
-            throw std::runtime_error("Sanity error: instruction pointer out of bounds.");
-        }
+        vm_syscall(vm, label_t(name.uint, fromtype.uint, totype.uint));
 
-        Opcode& c = (*code)[ip];
+        ip = fetch.next(ip);
+        NANOM_ENTER();
+    }
 
-        if (verbose) {
+    NANOM_OP(SYSCALL_DIRECT): {
+        const VmCode::syscall_t& sc = vm.code.syscalls[c->arg.uint];
 
-            std::string pref;
-            for (size_t n = 0; n < vm.frame.size(); ++n) {
-                pref += "  ";
-            }
-            switch (c.op) {
-            case CALL:
-                std::cout << pref << "CALL " << symtab().get((vm.stack.rbegin()+2)->uint) << " "
-                          << symtab().get((vm.stack.rbegin()+1)->uint) << " "
-                          << symtab().get(vm.stack.rbegin()->uint) << std::endl;
-                break;
-            case TAILCALL:
-                std::cout << pref << "CALL " << symtab().get((vm.stack.rbegin()+2)->uint) << " "
-                          << symtab().get((vm.stack.rbegin()+1)->uint) << " "
-                          << symtab().get(vm.stack.rbegin()->uint) << std::endl;
-                break;
-            case SYSCALL:
-                break;
-            case CALL_LIGHT:
-                std::cout << pref << "CALL_LIGHT " << symtab().get(vm.stack.rbegin()->uint) << std::endl;
-                break;
-            case EXIT:
-                std::cout << pref << "EXIT" << std::endl;
-                break;
-            case FAIL:
-                std::cout << pref << "FAIL" << std::endl;
-                break;
-            default:
-                break;
-            }                
+        CallbackTiming* t = (c->arg.uint < vm.syscall_timings.size() ? vm.syscall_timings[c->arg.uint] : sc.timing);
 
-            /*
-            std::cout << ">" << ip << " " << opcodename(c.op) << "(" << c.arg.inte << ") "
-                      << vm.failbit << " ||\t\t\t";
-            for (const auto& ii : vm.stack) {
-                std::cout << " " << ii.inte << ":" << symtab().get(ii.uint);
-            }
-            std::cout << " [" << vm.stack.size() << "]  " << topframe;
-            for (const auto& ii : vm.frame) {
-                std::cout << "\n\t\t" << ii.prev_ip << "/" << ii.stack_ix << "," << ii.struct_size 
-                          << "," << symtab().get(ii.prev_label.name)
-                          << "," << symtab().get(ii.prev_label.fromshape)
-                          << "," << symtab().get(ii.prev_label.toshape) << " ";
-            }
-            std::cout << std::endl;
-            */
-        }
+        vm_syscall(vm, sc.cb, *sc.from, *sc.to, *t);
 
-        switch (c.op) {
-        case NOOP:
-            break;
-            
-        case PUSH:
-            vm.stack.push_back(c.arg);
-            break;
+        ip = fetch.next(ip);
+        NANOM_ENTER();
+    }
 
-        case POP:
-            vm.stack.pop_back();
-            break;
+    NANOM_OP(CALL_LIGHT): {
+        Val name = vm.pop();
 
-        case SWAP: {
-            Val v2 = vm.pop();
-            Val v1 = vm.pop();
-            vm.stack.push_back(v2);
-            vm.stack.push_back(v1);
-            break;
-        }
+        label_t l = vm.code.label_at(fetch.image_ip(ip));
+        l.name = name.uint;
 
-        case IF: {
-            Val v = vm.pop();
-            if (v.uint) {
-                ip += c.arg.inte;
-                continue;
-            }
-            break;
-        }
+        size_t stack_ix = vm.frame.back().stack_ix;
+        size_t struct_size = vm.frame.back().struct_size;
 
-        case IF_NOT: {
-            Val v = vm.pop();
-            if (!v.uint) {
-                ip += c.arg.inte;
-                continue;
-            }
-            break;
-        }
+        vm.frame.emplace_back(fetch.next(ip), stack_ix, struct_size);
 
-        case IF_FAIL: 
-            if (vm.failbit) {
-                ip += c.arg.inte;
-                continue;
-            }
-            break;
+        vm.failbit = false;
+        ip = fetch.from_image(vm.code.entry(l));
+        NANOM_ENTER();
+    }
 
-        case IF_NOT_FAIL:
-            if (!vm.failbit) {
-                ip += c.arg.inte;
-                continue;
-            }
-            break;
+    NANOM_OP(CALL_DIRECT): {
+        size_t argsize = c->call_argsize();
 
-        case POP_FRAMEHEAD: {
-            const auto& fp = vm.frame.back();
-            auto sb = vm.stack.begin() + fp.stack_ix;
-            auto se = sb + fp.struct_size;
-            vm.stack.erase(sb, se);
-            break;
-        }
+        vm.frame.emplace_back(fetch.next(ip), vm.stack.size() - argsize, argsize);
 
-        case POP_FRAMETAIL: {
-            const auto& fp = vm.frame.back();
-            auto sb = vm.stack.begin() + fp.stack_ix + fp.struct_size;
-            vm.stack.erase(sb, vm.stack.end());
-            break;
-        }
+        vm.failbit = false;
+        ip = c->call_target();
+        NANOM_ENTER();
+    }
 
-        case DROP_FRAME:
-            vm.frame.pop_back();
-            break;
-            
-        case FAIL: {
-            vm.failbit = true;
+    NANOM_OP(TAILCALL_DIRECT): {
+        vm_tailcall(vm, c->call_argsize());
 
-            if (vm.frame.size() == topframe) {
-                vm.frame.pop_back();
-                return;
+        vm.failbit = false;
+        ip = c->call_target();
+        NANOM_ENTER();
+    }
 
-            } else {
-                const auto& fp = vm.frame.back();
-                label = fp.prev_label;
-                ip = fp.prev_ip;
-                code = &(vm.code.codes[label]);
-                vm.frame.pop_back();
-                continue;
-            }
-        }
+    NANOM_OP(CALL_LIGHT_DIRECT): {
+        size_t stack_ix = vm.frame.back().stack_ix;
+        size_t struct_size = vm.frame.back().struct_size;
 
-        case EXIT: {
-            vm.failbit = false;
+        vm.frame.emplace_back(fetch.next(ip), stack_ix, struct_size);
 
-            if (vm.frame.size() == topframe) {
-                vm.frame.pop_back();
-                return;
+        vm.failbit = false;
+        ip = c->call_target();
+        NANOM_ENTER();
+    }
 
-            } else {
-                const auto& fp = vm.frame.back();
-                label = fp.prev_label;
-                ip = fp.prev_ip;
-                code = &(vm.code.codes[label]);
-                vm.frame.pop_back();
-                continue;
-            }
-        }
+    NANOM_OP(NEW_SHAPE): {
+        vm.tmp_shape = Shape();
+        NANOM_NEXT();
+    }
+
+    NANOM_OP(DEF_FIELD): {
+        Val v2 = vm.pop();
+        Val v1 = vm.pop();
+        vm.tmp_shape.add_field(v1.uint, (Type)v2.uint);
+        NANOM_NEXT();
+    }
+
+    NANOM_OP(DEF_STRUCT_FIELD): {
+        Val v2 = vm.pop();
+        Val v1 = vm.pop();
+        const Shape& sh = vm.shapes.get(v2.uint);
+        vm.tmp_shape.add_field(v1.uint, STRUCT, v2.uint, sh.size());
+        NANOM_NEXT();
+    }
 
-        case TAILCALL: {
-            Val totype = vm.pop();
-            Val fromtype = vm.pop();
-            Val name = vm.pop();
+    NANOM_OP(DEF_SHAPE): {
+        Val v = vm.pop();
+        vm.shapes.add(v.uint, vm.tmp_shape);
+        NANOM_NEXT();
+    }
 
-            auto& fp = vm.frame.back();
-            auto sb = vm.stack.begin() + fp.stack_ix;
-            auto se = sb + fp.struct_size;
-            vm.stack.erase(sb, se);
+    NANOM_OP(NEW_STRUCT): {
+        Val v = vm.pop();
+        std::fill_n(NANOM_GROW(v.uint), v.uint, Val());
+        NANOM_NEXT();
+    }
 
-            const Shape& shape = vm.shapes.get(fromtype.uint);
-            
-            label_t l(name.uint, fromtype.uint, totype.uint);
+    NANOM_OP(SET_FIELDS): {
+        Val strusize = vm.pop();
+        Val offs_end = vm.pop();
+        Val offs_beg = vm.pop();
 
-            fp.stack_ix = vm.stack.size() - shape.size();
-            fp.struct_size = shape.size();
+        size_t topsize = (offs_end.uint - offs_beg.uint);
+        auto tope = vm.stack.end();
+        auto topi = tope - topsize;
+        auto stri = topi - strusize.uint + offs_beg.uint;
 
-            vm.failbit = false;
-            label = l;
-            code = &(vm.code.codes[label]);
-            ip = 0;
-            continue;
+        for (auto i = topi; i != tope; ++i, ++stri) {
+            *stri = *i;
         }
 
-        case CALL: {
-            Val totype = vm.pop();
-            Val fromtype = vm.pop();
-            Val name = vm.pop();
+        vm.stack.resize(vm.stack.size() - topsize);
+        NANOM_NEXT();
+    } 
+
+    NANOM_OP(GET_FIELDS): {
+        Val strusize = vm.pop();
+        Val offs_end = vm.pop();
+        Val offs_beg = vm.pop();
 
-            const Shape& shape = vm.shapes.get(fromtype.uint);
-            
-            label_t l(name.uint, fromtype.uint, totype.uint);
+        // The fields replace the struct in place.
 
-            vm.frame.emplace_back(label, ip+1, vm.stack.size() - shape.size(), shape.size());
+        Val* stbeg = vm.stack.top - strusize.uint;
+        Val* fb = stbeg + offs_beg.uint;
+        Val* fe = stbeg + offs_end.uint;
 
-            vm.failbit = false;
-            label = l;
-            code = &(vm.code.codes[label]);
-            ip = 0;
-            continue;
+        if (fb != stbeg) {
+            std::copy(fb, fe, stbeg);
         }
 
-        case SYSCALL: {
-            Val totype = vm.pop();
-            Val fromtype = vm.pop();
-            Val name = vm.pop();
+        vm.stack.top = stbeg + (fe - fb);
+        NANOM_NEXT();
+    }
 
-            const Shape& shape = vm.shapes.get(fromtype.uint);
+    NANOM_OP(GET_FRAMEHEAD_FIELDS): {
+        Val offs_end = vm.pop();
+        Val offs_beg = vm.pop();
 
-            label_t l(name.uint, fromtype.uint, totype.uint);
+        const auto& fp = vm.frame.back();
+        Val* sb = vm.stack.base + fp.stack_ix;
+        Val* se = sb + offs_end.uint;
+        sb += offs_beg.uint;
 
-            Struct tmp;
-            auto tope = vm.stack.end();
-            auto topb = tope - shape.size();
-            tmp.v.assign(topb, tope);
-            vm.stack.resize(vm.stack.size() - shape.size());
+        std::copy(sb, se, NANOM_GROW(se - sb));
+        NANOM_NEXT();
+    }
+        
+    NANOM_OP(ADD_INT): {
+        Val v2 = *(--vm.stack.top);
+        Val& v1 = vm.stack.top[-1];
+        v1 = (Int)(v1.uint + v2.uint);
+        NANOM_NEXT();
+    }
 
-            Struct ret;
+    NANOM_OP(SUB_INT): {
+        Val v2 = *(--vm.stack.top);
+        Val& v1 = vm.stack.top[-1];
+        v1 = (Int)(v1.uint - v2.uint);
+        NANOM_NEXT();
+    }
 
-            auto j = vm.code.callbacks.find(l);
+    NANOM_OP(MUL_INT): {
+        Val v2 = *(--vm.stack.top);
+        Val& v1 = vm.stack.top[-1];
+        v1 = (Int)(v1.uint * v2.uint);
+        NANOM_NEXT();
+    }
 
-            if (j == vm.code.callbacks.end()) {
-                throw std::runtime_error("Callback '" + l.print() + "' undefined");
-            }
+    NANOM_OP(DIV_INT): {
+        Val v2 = *(--vm.stack.top);
+        Val& v1 = vm.stack.top[-1];
+        v1 = v1.inte / v2.inte;
+        NANOM_NEXT();
+    }
 
-            Timings::scope(vm.code.timings, l);
-            vm.failbit = !(j->second)(vm.shapes, shape, vm.shapes.get(totype.uint), tmp, ret);
+    NANOM_OP(MOD_INT): {
+        Val v2 = *(--vm.stack.top);
+        Val& v1 = vm.stack.top[-1];
+        v1 = v1.inte % v2.inte;
+        NANOM_NEXT();
+    }
 
-            vm.stack.insert(vm.stack.end(), ret.v.begin(), ret.v.end());
-            break;
-        }
+    NANOM_OP(NEG_INT): {
+        Val& v = vm.stack.top[-1];
+        v = (Int)(0 - v.uint);
+        NANOM_NEXT();
+    }
 
-        case CALL_LIGHT: {
-            Val name = vm.pop();
+    NANOM_OP(ADD_UINT): {
+        Val v2 = *(--vm.stack.top);
+        Val& v1 = vm.stack.top[-1];
+        v1 = v1.uint + v2.uint;
+        NANOM_NEXT();
+    }
 
-            const auto& fr = vm.frame.back();
+    NANOM_OP(SUB_UINT): {
+        Val v2 = *(--vm.stack.top);
+        Val& v1 = vm.stack.top[-1];
+        v1 = v1.uint - v2.uint;
+        NANOM_NEXT();
+    }
 
-            vm.frame.emplace_back(label, ip+1, fr.stack_ix, fr.struct_size);
+    NANOM_OP(MUL_UINT): {
+        Val v2 = *(--vm.stack.top);
+        Val& v1 = vm.stack.top[-1];
+        v1 = v1.uint * v2.uint;
+        NANOM_NEXT();
+    }
 
-            vm.failbit = false;
-            label.name = name.uint;
-            code = &(vm.code.codes[label]);
-            ip = 0;
-            continue;
-        }
+    NANOM_OP(DIV_UINT): {
+        Val v2 = *(--vm.stack.top);
+        Val& v1 = vm.stack.top[-1];
+        v1 = v1.uint / v2.uint;
+        NANOM_NEXT();
+    }
 
-        case NEW_SHAPE: {
-            vm.tmp_shape = Shape();
-            break;
-        }
+    NANOM_OP(MOD_UINT): {
+        Val v2 = *(--vm.stack.top);
+        Val& v1 = vm.stack.top[-1];
+        v1 = v1.uint % v2.uint;
+        NANOM_NEXT();
+    }
 
-        case DEF_FIELD: {
-            Val v2 = vm.pop();
-            Val v1 = vm.pop();
-            vm.tmp_shape.add_field(v1.uint, (Type)v2.uint);
-            break;
-        }
+    NANOM_OP(ADD_REAL): {
+        Val v2 = *(--vm.stack.top);
+        Val& v1 = vm.stack.top[-1];
+        v1 = v1.real + v2.real;
+        NANOM_NEXT();
+    }
 
-        case DEF_STRUCT_FIELD: {
-            Val v2 = vm.pop();
-            Val v1 = vm.pop();
-            const Shape& sh = vm.shapes.get(v2.uint);
-            vm.tmp_shape.add_field(v1.uint, STRUCT, v2.uint, sh.size());
-            break;
-        }
+    NANOM_OP(SUB_REAL): {
+        Val v2 = *(--vm.stack.top);
+        Val& v1 = vm.stack.top[-1];
+        v1 = v1.real - v2.real;
+        NANOM_NEXT();
+    }
 
-        case DEF_SHAPE: {
-            Val v = vm.pop();
-            vm.shapes.add(v.uint, vm.tmp_shape);
-            break;
-        }
+    NANOM_OP(MUL_REAL): {
+        Val v2 = *(--vm.stack.top);
+        Val& v1 = vm.stack.top[-1];
+        v1 = v1.real * v2.real;
+        NANOM_NEXT();
+    }
 
-        case NEW_STRUCT: {
-            Val v = vm.pop();
-            vm.stack.insert(vm.stack.end(), v.uint, Val());
-            break;
-        }
+    NANOM_OP(DIV_REAL): {
+        Val v2 = *(--vm.stack.top);
+        Val& v1 = vm.stack.top[-1];
+        v1 = v1.real / v2.real;
+        NANOM_NEXT();
+    }
 
-        case SET_FIELDS: {
-            Val strusize = vm.pop();
-            Val offs_end = vm.pop();
-            Val offs_beg = vm.pop();
+    NANOM_OP(NEG_REAL): {
+        Val& v = vm.stack.top[-1];
+        v = -v.real;
+        NANOM_NEXT();
+    }
 
-            size_t topsize = (offs_end.uint - offs_beg.uint);
-            auto tope = vm.stack.end();
-            auto topi = tope - topsize;
-            auto stri = topi - strusize.uint + offs_beg.uint;
+    NANOM_OP(BAND): {
+        Val v2 = *(--vm.stack.top);
+        Val& v1 = vm.stack.top[-1];
+        v1 = v1.uint & v2.uint;
+        NANOM_NEXT();
+    }
 
-            for (auto i = topi; i != tope; ++i, ++stri) {
-                *stri = *i;
-            }
+    NANOM_OP(BOR): {
+        Val v2 = *(--vm.stack.top);
+        Val& v1 = vm.stack.top[-1];
+        v1 = v1.uint | v2.uint;
+        NANOM_NEXT();
+    }
 
-            vm.stack.resize(vm.stack.size() - topsize);
-            break;
-        } 
+    NANOM_OP(BNOT): {
+        Val& v1 = vm.stack.top[-1];
+        v1 = ~v1.uint;
+        NANOM_NEXT();
+    }
+
+    NANOM_OP(BXOR): {
+        Val v2 = *(--vm.stack.top);
+        Val& v1 = vm.stack.top[-1];
+        v1 = v1.uint ^ v2.uint;
+        NANOM_NEXT();
+    }
 
-        case GET_FIELDS: {
-            Val strusize = vm.pop();
-            Val offs_end = vm.pop();
-            Val offs_beg = vm.pop();
+    NANOM_OP(BSHL): {
+        Val v2 = *(--vm.stack.top);
+        Val& v1 = vm.stack.top[-1];
+        v1 = v1.uint << v2.uint;
+        NANOM_NEXT();
+    }
 
-            vm.stack.reserve(vm.stack.size() + (offs_end.uint - offs_beg.uint));
+    NANOM_OP(BSHR): {
+        Val v2 = *(--vm.stack.top);
+        Val& v1 = vm.stack.top[-1];
+        v1 = v1.uint >> v2.uint;
+        NANOM_NEXT();
+    }
 
-            auto stbeg = vm.stack.end();
-            stbeg = stbeg - strusize.uint;
-            auto fb = stbeg + offs_beg.uint;
-            auto fe = stbeg + offs_end.uint;
+    NANOM_OP(BOOL_NOT): {
+        Val& v = vm.stack.top[-1];
+        v = (UInt)!(v.uint);
+        NANOM_NEXT();
+    }
 
-            for (; fb != fe; ++fb) {
-                vm.stack.push_back(*fb);
-            }
-            
-            vm.stack.erase(stbeg, stbeg + strusize.uint);
-            break;
-        }
+    NANOM_OP(EQ_INT): {
+        Val v2 = *(--vm.stack.top);
+        Val& v1 = vm.stack.top[-1];
+        v1 = (Int)(v1.inte == v2.inte);
+        NANOM_NEXT();
+    }
 
-        case GET_FRAMEHEAD_FIELDS: {
-            Val offs_end = vm.pop();
-            Val offs_beg = vm.pop();
+    NANOM_OP(LT_INT): {
+        Val v2 = *(--vm.stack.top);
+        Val& v1 = vm.stack.top[-1];
+        v1 = (Int)(v1.inte < v2.inte);
+        NANOM_NEXT();
+    }
 
-            vm.stack.reserve(vm.stack.size() + (offs_end.uint - offs_beg.uint));
+    NANOM_OP(LTE_INT): {
+        Val v2 = *(--vm.stack.top);
+        Val& v1 = vm.stack.top[-1];
+        v1 = (Int)(v1.inte <= v2.inte);
+        NANOM_NEXT();
+    }
 
-            const auto& fp = vm.frame.back();
-            auto sb = vm.stack.begin() + fp.stack_ix;
-            auto se = sb + offs_end.uint;
-            sb += offs_beg.uint;
+    NANOM_OP(GT_INT): {
+        Val v2 = *(--vm.stack.top);
+        Val& v1 = vm.stack.top[-1];
+        v1 = (Int)(v1.inte > v2.inte);
+        NANOM_NEXT();
+    }
 
-            vm.stack.insert(vm.stack.end(), sb, se);
-            break;
-        }
-            
-        case ADD_INT: {
-            Val v2 = vm.pop();
-            Val v1 = vm.pop();
-            vm.stack.push_back(v1.inte + v2.inte);
-            break;
-        }
+    NANOM_OP(GTE_INT): {
+        Val v2 = *(--vm.stack.top);
+        Val& v1 = vm.stack.top[-1];
+        v1 = (Int)(v1.inte >= v2.inte);
+        NANOM_NEXT();
+    }
 
-        case SUB_INT: {
-            Val v2 = vm.pop();
-            Val v1 = vm.pop();
-            vm.stack.push_back(v1.inte - v2.inte);
-            break;
-        }
+    NANOM_OP(EQ_UINT): {
+        Val v2 = *(--vm.stack.top);
+        Val& v1 = vm.stack.top[-1];
+        v1 = (Int)(v1.uint == v2.uint);
+        NANOM_NEXT();
+    }
 
-        case MUL_INT: {
-            Val v2 = vm.pop();
-            Val v1 = vm.pop();
-            vm.stack.push_back(v1.inte * v2.inte);
-            break;
-        }
+    NANOM_OP(LT_UINT): {
+        Val v2 = *(--vm.stack.top);
+        Val& v1 = vm.stack.top[-1];
+        v1 = (Int)(v1.uint < v2.uint);
+        NANOM_NEXT();
+    }
 
-        case DIV_INT: {
-            Val v2 = vm.pop();
-            Val v1 = vm.pop();
-            vm.stack.push_back(v1.inte / v2.inte);
-            break;
-        }
+    NANOM_OP(LTE_UINT): {
+        Val v2 = *(--vm.stack.top);
+        Val& v1 = vm.stack.top[-1];
+        v1 = (Int)(v1.uint <= v2.uint);
+        NANOM_NEXT();
+    }
 
-        case MOD_INT: {
-            Val v2 = vm.pop();
-            Val v1 = vm.pop();
-            vm.stack.push_back(v1.inte % v2.inte);
-            break;
-        }
+    NANOM_OP(GT_UINT): {
+        Val v2 = *(--vm.stack.top);
+        Val& v1 = vm.stack.top[-1];
+        v1 = (Int)(v1.uint > v2.uint);
+        NANOM_NEXT();
+    }
 
-        case NEG_INT: {
-            Val v = vm.pop();
-            vm.stack.push_back(-v.inte);
-            break;
-        }
+    NANOM_OP(GTE_UINT): {
+        Val v2 = *(--vm.stack.top);
+        Val& v1 = vm.stack.top[-1];
+        v1 = (Int)(v1.uint >= v2.uint);
+        NANOM_NEXT();
+    }
 
-        case ADD_UINT: {
-            Val v2 = vm.pop();
-            Val v1 = vm.pop();
-            vm.stack.push_back(v1.uint + v2.uint);
-            break;
-        }
+    NANOM_OP(EQ_REAL): {
+        Val v2 = *(--vm.stack.top);
+        Val& v1 = vm.stack.top[-1];
+        v1 = (Int)(v1.real == v2.real);
+        NANOM_NEXT();
+    }
 
-        case SUB_UINT: {
-            Val v2 = vm.pop();
-            Val v1 = vm.pop();
-            vm.stack.push_back(v1.uint - v2.uint);
-            break;
-        }
+    NANOM_OP(LT_REAL): {
+        Val v2 = *(--vm.stack.top);
+        Val& v1 = vm.stack.top[-1];
+        v1 = (Int)(v1.real < v2.real);
+        NANOM_NEXT();
+    }
 
-        case MUL_UINT: {
-            Val v2 = vm.pop();
-            Val v1 = vm.pop();
-            vm.stack.push_back(v1.uint * v2.uint);
-            break;
-        }
+    NANOM_OP(LTE_REAL): {
+        Val v2 = *(--vm.stack.top);
+        Val& v1 = vm.stack.top[-1];
+        v1 = (Int)(v1.real <= v2.real);
+        NANOM_NEXT();
+    }
 
-        case DIV_UINT: {
-            Val v2 = vm.pop();
-            Val v1 = vm.pop();
-            vm.stack.push_back(v1.uint / v2.uint);
-            break;
-        }
+    NANOM_OP(GT_REAL): {
+        Val v2 = *(--vm.stack.top);
+        Val& v1 = vm.stack.top[-1];
+        v1 = (Int)(v1.real > v2.real);
+        NANOM_NEXT();
+    }
 
-        case MOD_UINT: {
-            Val v2 = vm.pop();
-            Val v1 = vm.pop();
-            vm.stack.push_back(v1.uint % v2.uint);
-            break;
-        }
+    NANOM_OP(GTE_REAL): {
+        Val v2 = *(--vm.stack.top);
+        Val& v1 = vm.stack.top[-1];
+        v1 = (Int)(v1.real >= v2.real);
+        NANOM_NEXT();
+    }
 
-        case ADD_REAL: {
-            Val v2 = vm.pop();
-            Val v1 = vm.pop();
-            vm.stack.push_back(v1.real + v2.real);
-            break;
-        }
+    NANOM_OP(INT_TO_REAL): {
+        Val& v = vm.stack.top[-1];
+        v = (Real)v.inte;
+        NANOM_NEXT();
+    }
 
-        case SUB_REAL: {
-            Val v2 = vm.pop();
-            Val v1 = vm.pop();
-            vm.stack.push_back(v1.real - v2.real);
-            break;
-        }
+    NANOM_OP(REAL_TO_INT): {
+        Val& v = vm.stack.top[-1];
+        v = (Int)v.real;
+        NANOM_NEXT();
+    }
 
-        case MUL_REAL: {
-            Val v2 = vm.pop();
-            Val v1 = vm.pop();
-            vm.stack.push_back(v1.real * v2.real);
-            break;
-        }
+    NANOM_OP(UINT_TO_REAL): {
+        Val& v = vm.stack.top[-1];
+        v = (Real)v.uint;
+        NANOM_NEXT();
+    }
 
-        case DIV_REAL: {
-            Val v2 = vm.pop();
-            Val v1 = vm.pop();
-            vm.stack.push_back(v1.real / v2.real);
-            break;
-        }
+    NANOM_OP(REAL_TO_UINT): {
+        Val& v = vm.stack.top[-1];
+        v = (UInt)v.real;
+        NANOM_NEXT();
+    }
 
-        case NEG_REAL: {
-            Val v = vm.pop();
-            vm.stack.push_back(-v.real);
-            break;
-        }
+    // Superinstructions.
 
-        case BAND: {
-            Val v2 = vm.pop();
-            Val v1 = vm.pop();
-            vm.stack.push_back(v1.uint & v2.uint);
-            break;
-        }
+    NANOM_OP(GET_FRAMEHEAD_FIELDS_I): {
+        const auto& fp = vm.frame.back();
+        Val* sb = vm.stack.base + fp.stack_ix;
+        Val* se = sb + c->packed_b();
+        sb += c->packed_a();
 
-        case BOR: {
-            Val v2 = vm.pop();
-            Val v1 = vm.pop();
-            vm.stack.push_back(v1.uint | v2.uint);
-            break;
-        }
+        std::copy(sb, se, NANOM_GROW(se - sb));
+        NANOM_NEXT();
+    }
 
-        case BNOT: {
-            Val v1 = vm.pop();
-            vm.stack.push_back(~v1.uint);
-            break;
-        }
+    NANOM_OP(GET_FIELDS_I): {
+        Val* stbeg = vm.stack.top - c->packed_c();
+        Val* fb = stbeg + c->packed_a();
+        Val* fe = stbeg + c->packed_b();
 
-        case BXOR: {
-            Val v2 = vm.pop();
-            Val v1 = vm.pop();
-            vm.stack.push_back(v1.uint ^ v2.uint);
-            break;
+        if (fb != stbeg) {
+            std::copy(fb, fe, stbeg);
         }
 
-        case BSHL: {
-            Val v2 = vm.pop();
-            Val v1 = vm.pop();
-            vm.stack.push_back(v1.uint << v2.uint);
-            break;
-        }
+        vm.stack.top = stbeg + (fe - fb);
+        NANOM_NEXT();
+    }
 
-        case BSHR: {
-            Val v2 = vm.pop();
-            Val v1 = vm.pop();
-            vm.stack.push_back(v1.uint >> v2.uint);
-            break;
-        }
+    NANOM_OP(SET_FIELDS_I): {
+        size_t topsize = c->packed_b() - c->packed_a();
+        Val* tope = vm.stack.top;
+        Val* topi = tope - topsize;
 
-        case BOOL_NOT: {
-            Val v = vm.pop();
-            vm.stack.push_back((UInt)!(v.uint));
-            break;
-        }
+        std::copy(topi, tope, topi - c->packed_c() + c->packed_a());
 
-        case EQ_INT: {
-            Val v2 = vm.pop();
-            Val v1 = vm.pop();
-            vm.stack.push_back((Int)(v1.inte == v2.inte));
-            break;
-        }
+        vm.stack.top = topi;
+        NANOM_NEXT();
+    }
 
-        case LT_INT: {
-            Val v2 = vm.pop();
-            Val v1 = vm.pop();
-            vm.stack.push_back((Int)(v1.inte < v2.inte));
-            break;
-        }
+    NANOM_OP(NEW_STRUCT_I):
+        std::fill_n(NANOM_GROW(c->arg.uint), c->arg.uint, Val());
+        NANOM_NEXT();
 
-        case LTE_INT: {
-            Val v2 = vm.pop();
-            Val v1 = vm.pop();
-            vm.stack.push_back((Int)(v1.inte <= v2.inte));
-            break;
-        }
+#define NANOM_ARITH_I(o, expr)                                                          \
+    NANOM_OP(o): {                                                                      \
+        Val& v1 = vm.stack.top[-1];                                                     \
+        v1 = expr;                                                                      \
+        NANOM_NEXT();                                                                   \
+    }
 
-        case GT_INT: {
-            Val v2 = vm.pop();
-            Val v1 = vm.pop();
-            vm.stack.push_back((Int)(v1.inte > v2.inte));
-            break;
-        }
+    NANOM_ARITH_I(ADD_INT_I, (Int)(v1.uint + c->arg.uint))
+    NANOM_ARITH_I(SUB_INT_I, (Int)(v1.uint - c->arg.uint))
+    NANOM_ARITH_I(MUL_INT_I, (Int)(v1.uint * c->arg.uint))
+    NANOM_ARITH_I(DIV_INT_I, v1.inte / c->arg.inte)
+    NANOM_ARITH_I(MOD_INT_I, v1.inte % c->arg.inte)
+    NANOM_ARITH_I(DIV_INT_POW2, div_pow2(v1.inte, c->arg.uint))
+    NANOM_ARITH_I(MOD_INT_POW2, mod_pow2(v1.inte, c->arg.uint))
+
+    NANOM_OP(JUMP):
+        ip += c->arg.inte;
+        NANOM_DISPATCH();
+
+    NANOM_OP(POP_FRAMETAIL_I): {
+        const auto& fp = vm.frame.back();
+        auto sb = vm.stack.begin() + fp.stack_ix + c->arg.uint;
+        vm.stack.erase(sb, vm.stack.end());
+        NANOM_NEXT();
+    }
 
-        case GTE_INT: {
-            Val v2 = vm.pop();
-            Val v1 = vm.pop();
-            vm.stack.push_back((Int)(v1.inte >= v2.inte));
-            break;
-        }
+    // The new argument moves down over the old one; the frame stays.
+    NANOM_OP(TAILCALL_SELF): {
+        vm_tailcall(vm, vm.frame.back().struct_size);
 
-        case EQ_UINT: {
-            Val v2 = vm.pop();
-            Val v1 = vm.pop();
-            vm.stack.push_back((Int)(v1.uint == v2.uint));
-            break;
-        }
+        vm.failbit = false;
+        ip += c->arg.inte;
+        NANOM_ENTER();
+    }
 
-        case LT_UINT: {
-            Val v2 = vm.pop();
-            Val v1 = vm.pop();
-            vm.stack.push_back((Int)(v1.uint < v2.uint));
-            break;
+    NANOM_OP(FAIL_UNLESS): {
+        Val v = vm.pop();
+        if (v.uint) {
+            NANOM_NEXT();
         }
+        NANOM_RETURN(true);
+    }
 
-        case LTE_UINT: {
-            Val v2 = vm.pop();
-            Val v1 = vm.pop();
-            vm.stack.push_back((Int)(v1.uint <= v2.uint));
-            break;
-        }
+#define NANOM_FAIL_UNLESS(o, f, cmp)                                                    \
+    NANOM_OP(o): {                                                                      \
+        Val* top = (vm.stack.top -= 2);                                                 \
+        if (top[0].f cmp top[1].f) {                                                    \
+            NANOM_NEXT();                                                               \
+        }                                                                               \
+        NANOM_RETURN(true);                                                             \
+    }
 
-        case GT_UINT: {
-            Val v2 = vm.pop();
-            Val v1 = vm.pop();
-            vm.stack.push_back((Int)(v1.uint > v2.uint));
-            break;
-        }
+    NANOM_FAIL_UNLESS(FAIL_UNLESS_EQ_INT, inte, ==)
+    NANOM_FAIL_UNLESS(FAIL_UNLESS_LT_INT, inte, <)
+    NANOM_FAIL_UNLESS(FAIL_UNLESS_LTE_INT, inte, <=)
+    NANOM_FAIL_UNLESS(FAIL_UNLESS_GT_INT, inte, >)
+    NANOM_FAIL_UNLESS(FAIL_UNLESS_GTE_INT, inte, >=)
+    NANOM_FAIL_UNLESS(FAIL_UNLESS_EQ_UINT, uint, ==)
+    NANOM_FAIL_UNLESS(FAIL_UNLESS_LT_UINT, uint, <)
+    NANOM_FAIL_UNLESS(FAIL_UNLESS_LTE_UINT, uint, <=)
+    NANOM_FAIL_UNLESS(FAIL_UNLESS_GT_UINT, uint, >)
+    NANOM_FAIL_UNLESS(FAIL_UNLESS_GTE_UINT, uint, >=)
+    NANOM_FAIL_UNLESS(FAIL_UNLESS_EQ_REAL, real, ==)
+    NANOM_FAIL_UNLESS(FAIL_UNLESS_LT_REAL, real, <)
+    NANOM_FAIL_UNLESS(FAIL_UNLESS_LTE_REAL, real, <=)
+    NANOM_FAIL_UNLESS(FAIL_UNLESS_GT_REAL, real, >)
+    NANOM_FAIL_UNLESS(FAIL_UNLESS_GTE_REAL, real, >=)
+
+    NANOM_OP(POP_FRAMEHEAD_EXIT): {
+        const auto& fp = vm.frame.back();
+        auto sb = vm.stack.begin() + fp.stack_ix;
+        auto se = sb + fp.struct_size;
+        vm.stack.replace(sb, fp.struct_size, vm.stack.end() - se);
+        NANOM_RETURN(false);
+    }
 
-        case GTE_UINT: {
-            Val v2 = vm.pop();
-            Val v1 = vm.pop();
-            vm.stack.push_back((Int)(v1.uint >= v2.uint));
-            break;
+    NANOM_OP(EXIT_OR_POP_FRAMETAIL): {
+        if (!vm.failbit) {
+            NANOM_RETURN(false);
         }
 
-        case EQ_REAL: {
-            Val v2 = vm.pop();
-            Val v1 = vm.pop();
-            vm.stack.push_back((Int)(v1.real == v2.real));
-            break;
-        }
+        const auto& fp = vm.frame.back();
+        auto sb = vm.stack.begin() + fp.stack_ix + fp.struct_size;
+        vm.stack.erase(sb, vm.stack.end());
+        NANOM_NEXT();
+    }
 
-        case LT_REAL: {
-            Val v2 = vm.pop();
-            Val v1 = vm.pop();
-            vm.stack.push_back((Int)(v1.real < v2.real));
-            break;
-        }
+#ifndef NANOM_THREADED_DISPATCH
+    default:
+        throw std::runtime_error("Sanity error: invalid opcode.");
+    }
+#endif
 
-        case LTE_REAL: {
-            Val v2 = vm.pop();
-            Val v1 = vm.pop();
-            vm.stack.push_back((Int)(v1.real <= v2.real));
-            break;
-        }
+#undef NANOM_FAIL_UNLESS
+#undef NANOM_ARITH_I
+#undef NANOM_RETURN
+#undef NANOM_NEXT
+#undef NANOM_GROW
+#undef NANOM_ENTER
+#undef NANOM_DISPATCH
+#undef NANOM_OP
+#undef NANOM_FETCH
+}
 
-        case GT_REAL: {
-            Val v2 = vm.pop();
-            Val v1 = vm.pop();
-            vm.stack.push_back((Int)(v1.real > v2.real));
-            break;
-        }
 
-        case GTE_REAL: {
-            Val v2 = vm.pop();
-            Val v1 = vm.pop();
-            vm.stack.push_back((Int)(v1.real >= v2.real));
-            break;
-        }
+template <typename TRACE>
+void vm_run_with(Vm& vm, size_t ip, TRACE& trace, bool checked = true) {
 
-        case INT_TO_REAL: {
-            Val v = vm.pop();
-            Val ret = (Real)v.inte;
-            vm.stack.push_back(ret);
-            break;
-        }
+    if (vm.compact) {
+        vm_run_with<CompactFetch>(vm, ip, trace);
+    } else if (checked) {
+        vm_run_with<ImageFetch>(vm, ip, trace);
+    } else {
+        vm_run_with<UncheckedFetch>(vm, ip, trace);
+    }
+}
 
-        case REAL_TO_INT: {
-            Val v = vm.pop();
-            Val ret = (Int)v.real;
-            vm.stack.push_back(ret);
-            break;
-        }
+inline void vm_run_at(Vm& vm, size_t ip, VmTraceSink& sink) {
+    SinkTrace trace(sink);
+    vm_run_with(vm, ip, trace);
+}
 
-        case UINT_TO_REAL: {
-            Val v = vm.pop();
-            Val ret = (Real)v.uint;
-            vm.stack.push_back(ret);
-            break;
-        }
+inline void vm_run_at(Vm& vm, size_t ip, VmProfile& prof) {
+    ProfileTrace trace(prof);
+    vm_run_with(vm, ip, trace);
+}
 
-        case REAL_TO_UINT: {
-            Val v = vm.pop();
-            Val ret = (UInt)v.real;
-            vm.stack.push_back(ret);
-            break;
-        }
+inline void vm_run_at(Vm& vm, size_t ip, bool verbose = false) {
 
-        }
+    if (verbose) {
+        vm_run_at(vm, ip, vm_trace_stdout());
 
-        ++ip;
+    } else {
+        NoTrace trace;
+        vm_run_with(vm, ip, trace);
     }
 }
 
+// Runs verified code without bounds checks. The caller makes sure the stack
+// has room for the bound recorded in VmCode::verified.
+
+inline void vm_run_unchecked(Vm& vm, size_t ip) {
+    NoTrace trace;
+    vm_run_with(vm, ip, trace, false);
+}
+
+inline void vm_run(Vm& vm, 
+                   label_t label = VmCode::toplevel_label(), 
+                   size_t ip = 0, 
+                   bool verbose = false) {
+
+    vm_run_at(vm, vm.code.entry(label) + ip, verbose);
+}
 }
 
 
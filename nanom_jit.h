@@ -0,0 +1,1098 @@
+#ifndef __NANOM_JIT_H
+#define __NANOM_JIT_H
+
+/*
+ * A template JIT for the stack VM.
+ *
+ * Functions that are entered 'threshold' times are translated opcode by
+ * opcode into x86-64 machine code. The interpreter stays in charge of the control
+ * flow between functions: native code runs a function body until it reaches a call,
+ * a syscall, an EXIT/FAIL or an opcode it does not know, and then hands the
+ * instruction pointer back to vm_run_at(), which carries on from there. Frames,
+ * the failbit and the stack arena are the interpreter's own, so jitted and
+ * interpreted code can call each other freely.
+ *
+ * Native code is entered at a function's first opcode and at the return
+ * points after its calls.
+ */
+
+#include "nanom.h"
+
+#if defined(__x86_64__) && defined(__linux__) && !defined(NANOM_NO_JIT)
+#define NANOM_JIT_X86_64
+#include <sys/mman.h>
+#include <string.h>
+#include <stddef.h>
+#endif
+
+#include <unordered_set>
+
+
+namespace nanom {
+
+// What native code sees of the VM. The layout is hard-coded in the generated code.
+
+struct JitState {
+    Val* top;
+    Val* fb;
+    Val* limit;
+    Val* peak;
+    bool* failbit;
+    Vm* vm;
+    size_t fsize;
+};
+
+
+#ifdef NANOM_JIT_X86_64
+
+namespace {
+
+void jit_drop_frame(JitState* s) {
+    s->vm->frame.pop_back();
+}
+
+void jit_tailcall(JitState* s, size_t argsize) {
+    Vm& vm = *(s->vm);
+    vm.stack.top = s->top;
+
+    vm_tailcall(vm, argsize);
+
+    auto& fp = vm.frame.back();
+
+    vm.failbit = false;
+
+    s->top = vm.stack.top;
+    s->fb = vm.stack.base + fp.stack_ix;
+    s->fsize = argsize;
+}
+
+}
+
+
+struct X64 {
+
+    enum reg_t { RAX = 0, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+    enum cond_t { CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6, CC_A = 0x7,
+                  CC_P = 0xA, CC_NP = 0xB, CC_L = 0xC, CC_GE = 0xD, CC_LE = 0xE, CC_G = 0xF };
+
+    std::vector<uint8_t> b;
+
+    // Forward references to labels, patched by finish().
+    std::vector< std::pair<size_t, size_t> > fixups;
+    std::vector<size_t> labels;
+
+    size_t size() const { return b.size(); }
+
+    void byte(uint8_t x) { b.push_back(x); }
+    void bytes(std::initializer_list<uint8_t> xs) { b.insert(b.end(), xs); }
+
+    void dword(uint32_t x) {
+        for (int i = 0; i < 4; ++i) byte((x >> (i * 8)) & 0xFF);
+    }
+
+    void qword(uint64_t x) {
+        for (int i = 0; i < 8; ++i) byte((x >> (i * 8)) & 0xFF);
+    }
+
+    size_t new_label() {
+        labels.push_back((size_t)-1);
+        return labels.size() - 1;
+    }
+
+    void bind(size_t l) {
+        labels[l] = size();
+    }
+
+    void rel32(size_t l) {
+        fixups.emplace_back(size(), l);
+        dword(0);
+    }
+
+    void finish() {
+        for (const auto& f : fixups) {
+            int32_t d = (int32_t)(labels[f.second] - (f.first + 4));
+            for (int i = 0; i < 4; ++i) b[f.first + i] = (d >> (i * 8)) & 0xFF;
+        }
+        fixups.clear();
+    }
+
+    void rex(bool w, int reg, int rm) {
+        uint8_t r = 0x40 | (w ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((rm & 8) ? 1 : 0);
+        if (r != 0x40) byte(r);
+    }
+
+    // 'reg' with the memory operand [base + disp]; 'reg' may also be an opcode extension.
+    void op_m(std::initializer_list<uint8_t> ops, int reg, int base, int32_t disp,
+              bool w = true, int prefix = -1) {
+        if (prefix >= 0) byte(prefix);
+        rex(w, reg, base);
+        bytes(ops);
+        byte(0x80 | ((reg & 7) << 3) | (base & 7));
+        if ((base & 7) == RSP) byte(0x24);
+        dword(disp);
+    }
+
+    void op_r(std::initializer_list<uint8_t> ops, int reg, int rm, bool w = true) {
+        rex(w, reg, rm);
+        bytes(ops);
+        byte(0xC0 | ((reg & 7) << 3) | (rm & 7));
+    }
+
+    void load(int r, int base, int32_t disp)  { op_m({0x8B}, r, base, disp); }
+    void store(int base, int32_t disp, int r) { op_m({0x89}, r, base, disp); }
+    void lea(int r, int base, int32_t disp)   { op_m({0x8D}, r, base, disp); }
+    void mov(int dst, int src)                { op_r({0x89}, src, dst); }
+    void cmp(int a, int b)                    { op_r({0x39}, b, a); }
+
+    void mov_imm(int r, uint64_t v) {
+        if (v <= 0xFFFFFFFF) {
+            rex(false, 0, r);
+            byte(0xB8 + (r & 7));
+            dword((uint32_t)v);
+        } else {
+            rex(true, 0, r);
+            byte(0xB8 + (r & 7));
+            qword(v);
+        }
+    }
+
+    void add_imm(int r, int32_t v) {
+        if (v == 0) return;
+        op_r({0x81}, 0, r);
+        dword(v);
+    }
+
+    void sub_imm(int r, int32_t v) {
+        if (v == 0) return;
+        op_r({0x81}, 5, r);
+        dword(v);
+    }
+
+    void push(int r) {
+        if (r & 8) byte(0x41);
+        byte(0x50 + (r & 7));
+    }
+
+    void pop(int r) {
+        if (r & 8) byte(0x41);
+        byte(0x58 + (r & 7));
+    }
+
+    void jcc(cond_t cc, size_t l) {
+        bytes({0x0F, (uint8_t)(0x80 + cc)});
+        rel32(l);
+    }
+
+    void jmp(size_t l) {
+        byte(0xE9);
+        rel32(l);
+    }
+
+    // setcc al; movzx eax, al
+    void setcc_rax(cond_t cc) {
+        bytes({0x0F, (uint8_t)(0x90 + cc), 0xC0});
+        bytes({0x0F, 0xB6, 0xC0});
+    }
+
+    void call_abs(const void* f) {
+        mov_imm(RAX, (uint64_t)f);
+        bytes({0xFF, 0xD0});
+    }
+};
+
+
+struct JitCompiler {
+
+    typedef X64 A;
+
+    // Register assignment inside native code.
+    static const int TOP = A::RBX;
+    static const int STATE = A::R12;
+    static const int FB = A::R13;
+    static const int LIMIT = A::R14;
+    static const int PEAK = A::R15;
+
+    // Set in the returned instruction pointer when native code ends in a tail call,
+    // so that Jit::enter can go on natively in the callee.
+    static const size_t REENTER = (size_t)1 << 63;
+
+    const VmCode& code;
+
+    size_t fstart;
+    size_t fend;
+
+    A a;
+    std::vector<size_t> oplabel;
+    std::vector<bool> target;
+    size_t exit_label;
+
+    struct stub_t {
+        size_t slow;
+        size_t back;
+        size_t exit;
+    };
+
+    std::vector<stub_t> stubs;
+    std::vector< std::pair<size_t,size_t> > exits;
+
+    JitCompiler(const VmCode& c, size_t start) : code(c), fstart(start) {
+
+        auto i = std::upper_bound(code.layout.begin(), code.layout.end(), start,
+                                  [](size_t ip, const std::pair<size_t,label_t>& e) {
+                                      return ip < e.first;
+                                  });
+
+        fend = (i == code.layout.end() ? code.image.size() : i->first);
+    }
+
+    const Opcode& at(size_t ip) const { return code.image[ip]; }
+
+    static bool native_op(op_t op) {
+        switch (op) {
+        case CALL: case SYSCALL: case TAILCALL: case CALL_LIGHT: case EXIT: case FAIL:
+        case CALL_DIRECT: case CALL_LIGHT_DIRECT: case SYSCALL_DIRECT: case POP_FRAMEHEAD_EXIT:
+        case NEW_SHAPE: case DEF_FIELD: case DEF_STRUCT_FIELD: case DEF_SHAPE:
+        case UINT_TO_REAL: case REAL_TO_UINT:
+            return false;
+        default:
+            return true;
+        }
+    }
+
+    static bool returns_here(op_t op) {
+        return (op == CALL || op == CALL_DIRECT || op == CALL_LIGHT || op == CALL_LIGHT_DIRECT ||
+                op == SYSCALL || op == SYSCALL_DIRECT);
+    }
+
+    // Where native code may be entered: the function's start and the return points
+    // after its calls, if the opcode there can run natively at all.
+
+    std::vector<size_t> entries() const {
+        std::vector<size_t> ret;
+
+        if (native_op(at(fstart).op))
+            ret.push_back(fstart);
+
+        for (size_t ip = fstart; ip + 1 < fend; ++ip) {
+            if (returns_here(at(ip).op) && native_op(at(ip + 1).op))
+                ret.push_back(ip + 1);
+        }
+
+        return ret;
+    }
+
+    // True if the opcode at ip + n is preceded by n PUSHes starting at 'ip', with
+    // no jumps or entries into the middle, so that they become its constant operands.
+
+    bool const_args(size_t ip, size_t n, op_t op) const {
+        if (ip + n >= fend || at(ip + n).op != op)
+            return false;
+
+        for (size_t i = ip; i < ip + n; ++i) {
+            if (at(i).op != PUSH)
+                return false;
+        }
+
+        for (size_t i = ip + 1; i <= ip + n; ++i) {
+            if (target[i - fstart])
+                return false;
+        }
+        return true;
+    }
+
+    static int32_t off(size_t n) {
+        return (int32_t)(n * sizeof(Val));
+    }
+
+    // A label for jumps to 'ip': the translated opcode when it is inside this
+    // function, a way back to the interpreter otherwise.
+    size_t jump_label(size_t ip) {
+        if (ip >= fstart && ip < fend)
+            return oplabel[ip - fstart];
+
+        return exit_label_at(ip);
+    }
+
+    // A label that leaves native code and continues interpreting at 'ip'.
+    size_t exit_label_at(size_t ip) {
+        size_t l = a.new_label();
+        exits.emplace_back(l, ip);
+        return l;
+    }
+
+    // Checks that 'n' more values fit on the stack and keeps the high-water mark.
+    // On overflow native code leaves at 'ip' with nothing done, and the
+    // interpreter reports the error.
+
+    void grow(size_t n, size_t ip) {
+        stub_t s;
+        s.slow = a.new_label();
+        s.back = a.new_label();
+        s.exit = exit_label_at(ip);
+
+        a.lea(A::RAX, TOP, off(n));
+        a.cmp(A::RAX, PEAK);
+        a.jcc(A::CC_A, s.slow);
+        a.bind(s.back);
+
+        stubs.push_back(s);
+    }
+
+    // Copies n values downwards in memory or between disjoint areas.
+    void copy(int src, int32_t srcoff, int dst, int32_t dstoff, size_t n) {
+        if (n <= 8) {
+            for (size_t i = 0; i < n; ++i) {
+                a.load(A::RCX, src, srcoff + off(i));
+                a.store(dst, dstoff + off(i), A::RCX);
+            }
+        } else {
+            a.lea(A::RSI, src, srcoff);
+            a.lea(A::RDI, dst, dstoff);
+            a.mov_imm(A::RCX, n);
+            a.bytes({0xF3, 0x48, 0xA5});
+        }
+    }
+
+    void binop(std::initializer_list<uint8_t> ops) {
+        a.load(A::RAX, TOP, -16);
+        a.op_m(ops, A::RAX, TOP, -8);
+        a.store(TOP, -16, A::RAX);
+        a.sub_imm(TOP, 8);
+    }
+
+    void divop(bool sign, bool mod) {
+        a.load(A::RAX, TOP, -16);
+        if (sign) {
+            a.bytes({0x48, 0x99});
+        } else {
+            a.bytes({0x31, 0xD2});
+        }
+        a.op_m({0xF7}, sign ? 7 : 6, TOP, -8);
+        a.store(TOP, -16, mod ? A::RDX : A::RAX);
+        a.sub_imm(TOP, 8);
+    }
+
+    void shiftop(int ext) {
+        a.load(A::RCX, TOP, -8);
+        a.op_m({0xD3}, ext, TOP, -16);
+        a.sub_imm(TOP, 8);
+    }
+
+    void realop(uint8_t op) {
+        a.op_m({0x0F, 0x10}, 0, TOP, -16, false, 0xF2);
+        a.op_m({0x0F, op}, 0, TOP, -8, false, 0xF2);
+        a.op_m({0x0F, 0x11}, 0, TOP, -16, false, 0xF2);
+        a.sub_imm(TOP, 8);
+    }
+
+    void cmpop(A::cond_t cc) {
+        a.load(A::RAX, TOP, -16);
+        a.op_m({0x3B}, A::RAX, TOP, -8);
+        a.setcc_rax(cc);
+        a.store(TOP, -16, A::RAX);
+        a.sub_imm(TOP, 8);
+    }
+
+    // ucomisd sets CF on unordered operands, so 'above' comparisons are false for
+    // NaN, as in C++. 'less' is done as 'above' with the operands swapped.
+
+    void realcmp(A::cond_t cc, bool swap) {
+        a.op_m({0x0F, 0x10}, 0, TOP, swap ? -8 : -16, false, 0xF2);
+        a.op_m({0x0F, 0x2E}, 0, TOP, swap ? -16 : -8, false, 0x66);
+        a.setcc_rax(cc);
+        a.store(TOP, -16, A::RAX);
+        a.sub_imm(TOP, 8);
+    }
+
+    void realeq() {
+        a.op_m({0x0F, 0x10}, 0, TOP, -16, false, 0xF2);
+        a.op_m({0x0F, 0x2E}, 0, TOP, -8, false, 0x66);
+        // sete al; setnp cl; and al, cl; movzx eax, al
+        a.bytes({0x0F, 0x94, 0xC0, 0x0F, 0x9B, 0xC1, 0x20, 0xC8, 0x0F, 0xB6, 0xC0});
+        a.store(TOP, -16, A::RAX);
+        a.sub_imm(TOP, 8);
+    }
+
+    void branch(size_t ip, A::cond_t cc) {
+        a.jcc(cc, jump_label(ip + at(ip).arg.inte));
+    }
+
+    // The field opcodes with constant operands. These return false for
+    // operands that native code does not handle.
+
+    bool getframehead(size_t b, size_t e, size_t ip) {
+        if (b > e)
+            return false;
+
+        grow(e - b, ip);
+        copy(FB, off(b), TOP, 0, e - b);
+        a.add_imm(TOP, off(e - b));
+        return true;
+    }
+
+    bool getfields(size_t b, size_t e, size_t size) {
+        if (b > e || e > size)
+            return false;
+
+        if (b > 0)
+            copy(TOP, off(b) - off(size), TOP, -off(size), e - b);
+
+        a.sub_imm(TOP, off(size - (e - b)));
+        return true;
+    }
+
+    bool setfields(size_t b, size_t e, size_t size) {
+        if (b > e || e > size)
+            return false;
+
+        copy(TOP, -off(e - b), TOP, off(b) - off(e - b) - off(size), e - b);
+        a.sub_imm(TOP, off(e - b));
+        return true;
+    }
+
+    void newstruct(size_t n, size_t ip) {
+        grow(n, ip);
+
+        if (n <= 8) {
+            a.bytes({0x31, 0xC9});
+            for (size_t i = 0; i < n; ++i) {
+                a.store(TOP, off(i), A::RCX);
+            }
+        } else {
+            a.mov(A::RDI, TOP);
+            a.mov_imm(A::RCX, n);
+            a.bytes({0x31, 0xC0, 0xF3, 0x48, 0xAB});
+        }
+
+        a.add_imm(TOP, off(n));
+    }
+
+    // The top value op= an immediate, for the *_INT_I opcodes.
+
+    void immop(std::initializer_list<uint8_t> ops, Int k) {
+        a.mov_imm(A::RCX, k);
+        a.op_m(ops, A::RCX, TOP, -8);
+    }
+
+    void immmul(Int k) {
+        a.mov_imm(A::RCX, k);
+        a.load(A::RAX, TOP, -8);
+        a.op_r({0x0F, 0xAF}, A::RAX, A::RCX);
+        a.store(TOP, -8, A::RAX);
+    }
+
+    void immdiv(Int k, bool mod) {
+        a.mov_imm(A::RCX, k);
+        a.load(A::RAX, TOP, -8);
+        a.bytes({0x48, 0x99});
+        a.op_r({0xF7}, 7, A::RCX);
+        a.store(TOP, -8, mod ? A::RDX : A::RAX);
+    }
+
+    // DIV_INT_POW2 and MOD_INT_POW2: a shift, after adding 2^k-1 to negative values.
+
+    void pow2div(uint8_t k, bool mod) {
+        a.load(A::RAX, TOP, -8);
+        a.mov(A::RDX, A::RAX);
+        a.bytes({0x48, 0xC1, 0xFA, 63});
+        a.bytes({0x48, 0xC1, 0xEA, (uint8_t)(64 - k)});
+        a.op_r({0x01}, A::RAX, A::RDX);
+        a.bytes({0x48, 0xC1, 0xFA, k});
+
+        if (mod) {
+            a.bytes({0x48, 0xC1, 0xE2, k});
+            a.op_r({0x29}, A::RDX, A::RAX);
+            a.store(TOP, -8, A::RAX);
+        } else {
+            a.store(TOP, -8, A::RDX);
+        }
+    }
+
+    // The FAIL_UNLESS_* opcodes: when the comparison does not hold, native code
+    // leaves with the operands still on the stack and the interpreter fails.
+
+    void failcmp(size_t ip, A::cond_t cc) {
+        a.load(A::RAX, TOP, -16);
+        a.op_m({0x3B}, A::RAX, TOP, -8);
+        a.jcc((A::cond_t)(cc ^ 1), exit_label_at(ip));
+        a.sub_imm(TOP, 16);
+    }
+
+    void failrealcmp(size_t ip, A::cond_t cc, bool swap) {
+        a.op_m({0x0F, 0x10}, 0, TOP, swap ? -8 : -16, false, 0xF2);
+        a.op_m({0x0F, 0x2E}, 0, TOP, swap ? -16 : -8, false, 0x66);
+        a.jcc((A::cond_t)(cc ^ 1), exit_label_at(ip));
+        a.sub_imm(TOP, 16);
+    }
+
+    void failrealeq(size_t ip) {
+        size_t l = exit_label_at(ip);
+
+        a.op_m({0x0F, 0x10}, 0, TOP, -16, false, 0xF2);
+        a.op_m({0x0F, 0x2E}, 0, TOP, -8, false, 0x66);
+        a.jcc(A::CC_NE, l);
+        a.jcc(A::CC_P, l);
+        a.sub_imm(TOP, 16);
+    }
+
+    void popframetail() {
+        a.load(A::RDX, STATE, offsetof(JitState, fsize));
+        a.bytes({0x48, 0xC1, 0xE2, 0x03});
+        a.mov(TOP, FB);
+        a.op_r({0x01}, A::RDX, TOP);
+    }
+
+    void failbit_test() {
+        a.load(A::RAX, STATE, offsetof(JitState, failbit));
+        a.bytes({0x80, 0x38, 0x00});
+    }
+
+    // Emits native code for the opcode at 'ip' and returns the next opcode to
+    // translate; field opcodes absorb the PUSHes of their constant operands.
+
+    size_t opcode(size_t ip) {
+
+        const Opcode& c = at(ip);
+
+        switch (c.op) {
+        case NOOP:
+            break;
+
+        case PUSH:
+            if (const_args(ip, 2, GET_FRAMEHEAD_FIELDS) &&
+                getframehead(at(ip).arg.uint, at(ip+1).arg.uint, ip)) {
+                return ip + 3;
+
+            } else if (const_args(ip, 3, GET_FIELDS) &&
+                       getfields(at(ip).arg.uint, at(ip+1).arg.uint, at(ip+2).arg.uint)) {
+                return ip + 4;
+
+            } else if (const_args(ip, 3, SET_FIELDS) &&
+                       setfields(at(ip).arg.uint, at(ip+1).arg.uint, at(ip+2).arg.uint)) {
+                return ip + 4;
+
+            } else if (const_args(ip, 1, NEW_STRUCT)) {
+                newstruct(at(ip).arg.uint, ip);
+                return ip + 2;
+            }
+
+            grow(1, ip);
+            a.mov_imm(A::RCX, c.arg.uint);
+            a.store(TOP, 0, A::RCX);
+            a.add_imm(TOP, 8);
+            return ip + 1;
+
+        case POP:
+            a.sub_imm(TOP, 8);
+            break;
+
+        case SWAP:
+            a.load(A::RAX, TOP, -8);
+            a.load(A::RCX, TOP, -16);
+            a.store(TOP, -8, A::RCX);
+            a.store(TOP, -16, A::RAX);
+            break;
+
+        case IF:
+        case IF_NOT:
+            a.sub_imm(TOP, 8);
+            a.op_m({0x83}, 7, TOP, 0);
+            a.byte(0);
+            branch(ip, c.op == IF ? A::CC_NE : A::CC_E);
+            break;
+
+        case IF_FAIL:
+        case IF_NOT_FAIL:
+            failbit_test();
+            branch(ip, c.op == IF_FAIL ? A::CC_NE : A::CC_E);
+            break;
+
+        case JUMP:
+            a.jmp(jump_label(ip + c.arg.inte));
+            break;
+
+        case TAILCALL_SELF: {
+            // When the frame holds just the old argument and the new one, as it
+            // does after the emitter's code, the new one moves down natively;
+            // otherwise jit_tailcall does it.
+            size_t n = code.shapes.get(code.label_at(fstart).fromshape).size();
+            size_t slow = a.new_label();
+
+            a.lea(A::RAX, FB, off(2 * n));
+            a.cmp(A::RAX, TOP);
+            a.jcc(A::CC_NE, slow);
+
+            for (size_t i = 0; i < n; ++i) {
+                a.load(A::RAX, FB, off(n + i));
+                a.store(FB, off(i), A::RAX);
+            }
+
+            a.lea(TOP, FB, off(n));
+            a.load(A::RAX, STATE, offsetof(JitState, failbit));
+            a.bytes({0xC6, 0x00, 0x00});
+            a.jmp(jump_label(ip + c.arg.inte));
+
+            a.bind(slow);
+            a.store(STATE, offsetof(JitState, top), TOP);
+            a.mov(A::RDI, STATE);
+            a.mov_imm(A::RSI, n);
+            a.call_abs((const void*)&jit_tailcall);
+            a.load(TOP, STATE, offsetof(JitState, top));
+            a.load(FB, STATE, offsetof(JitState, fb));
+            a.jmp(jump_label(ip + c.arg.inte));
+            break;
+        }
+
+        case POP_FRAMEHEAD:
+            // rsi = fb + struct_size; rcx = (top - rsi) / 8; rep movsq
+            a.load(A::RSI, STATE, offsetof(JitState, fsize));
+            a.bytes({0x48, 0xC1, 0xE6, 0x03});
+            a.op_r({0x01}, FB, A::RSI);
+            a.mov(A::RDI, FB);
+            a.mov(A::RCX, TOP);
+            a.op_r({0x29}, A::RSI, A::RCX);
+            a.bytes({0x48, 0xC1, 0xE9, 0x03});
+            a.bytes({0xF3, 0x48, 0xA5});
+            a.mov(TOP, A::RDI);
+            break;
+
+        case POP_FRAMETAIL:
+            popframetail();
+            break;
+
+        case DROP_FRAME:
+            a.mov(A::RDI, STATE);
+            a.call_abs((const void*)&jit_drop_frame);
+            break;
+
+        case TAILCALL_DIRECT:
+            a.store(STATE, offsetof(JitState, top), TOP);
+            a.mov(A::RDI, STATE);
+            a.mov_imm(A::RSI, c.call_argsize());
+            a.call_abs((const void*)&jit_tailcall);
+            a.load(TOP, STATE, offsetof(JitState, top));
+            a.load(FB, STATE, offsetof(JitState, fb));
+            a.mov_imm(A::RAX, c.call_target() | REENTER);
+            a.jmp(exit_label);
+            break;
+
+        case GET_FRAMEHEAD_FIELDS_I:
+            if (!getframehead(c.packed_a(), c.packed_b(), ip)) {
+                a.mov_imm(A::RAX, ip);
+                a.jmp(exit_label);
+            }
+            break;
+
+        case GET_FIELDS_I:
+            if (!getfields(c.packed_a(), c.packed_b(), c.packed_c())) {
+                a.mov_imm(A::RAX, ip);
+                a.jmp(exit_label);
+            }
+            break;
+
+        case SET_FIELDS_I:
+            if (!setfields(c.packed_a(), c.packed_b(), c.packed_c())) {
+                a.mov_imm(A::RAX, ip);
+                a.jmp(exit_label);
+            }
+            break;
+
+        case NEW_STRUCT_I:
+            newstruct(c.arg.uint, ip);
+            break;
+
+        case ADD_INT_I:   immop({0x01}, c.arg.inte); break;
+        case SUB_INT_I:   immop({0x29}, c.arg.inte); break;
+        case MUL_INT_I:   immmul(c.arg.inte); break;
+        case DIV_INT_I:   immdiv(c.arg.inte, false); break;
+        case MOD_INT_I:   immdiv(c.arg.inte, true); break;
+        case DIV_INT_POW2: pow2div(c.arg.uint, false); break;
+        case MOD_INT_POW2: pow2div(c.arg.uint, true); break;
+
+        case POP_FRAMETAIL_I:
+            a.mov(TOP, FB);
+            a.add_imm(TOP, off(c.arg.uint));
+            break;
+
+        case FAIL_UNLESS:
+            a.op_m({0x83}, 7, TOP, -8);
+            a.byte(0);
+            a.jcc(A::CC_E, exit_label_at(ip));
+            a.sub_imm(TOP, 8);
+            break;
+
+        case FAIL_UNLESS_EQ_INT:
+        case FAIL_UNLESS_EQ_UINT:  failcmp(ip, A::CC_E); break;
+        case FAIL_UNLESS_LT_INT:   failcmp(ip, A::CC_L); break;
+        case FAIL_UNLESS_LTE_INT:  failcmp(ip, A::CC_LE); break;
+        case FAIL_UNLESS_GT_INT:   failcmp(ip, A::CC_G); break;
+        case FAIL_UNLESS_GTE_INT:  failcmp(ip, A::CC_GE); break;
+        case FAIL_UNLESS_LT_UINT:  failcmp(ip, A::CC_B); break;
+        case FAIL_UNLESS_LTE_UINT: failcmp(ip, A::CC_BE); break;
+        case FAIL_UNLESS_GT_UINT:  failcmp(ip, A::CC_A); break;
+        case FAIL_UNLESS_GTE_UINT: failcmp(ip, A::CC_AE); break;
+
+        case FAIL_UNLESS_EQ_REAL:  failrealeq(ip); break;
+        case FAIL_UNLESS_LT_REAL:  failrealcmp(ip, A::CC_A, true); break;
+        case FAIL_UNLESS_LTE_REAL: failrealcmp(ip, A::CC_AE, true); break;
+        case FAIL_UNLESS_GT_REAL:  failrealcmp(ip, A::CC_A, false); break;
+        case FAIL_UNLESS_GTE_REAL: failrealcmp(ip, A::CC_AE, false); break;
+
+        case EXIT_OR_POP_FRAMETAIL:
+            // Exiting is left to the interpreter.
+            failbit_test();
+            a.jcc(A::CC_E, exit_label_at(ip));
+            popframetail();
+            break;
+
+        case ADD_INT:
+        case ADD_UINT:    binop({0x03}); break;
+        case SUB_INT:
+        case SUB_UINT:    binop({0x2B}); break;
+        case MUL_INT:
+        case MUL_UINT:    binop({0x0F, 0xAF}); break;
+        case BAND:        binop({0x23}); break;
+        case BOR:         binop({0x0B}); break;
+        case BXOR:        binop({0x33}); break;
+
+        case DIV_INT:     divop(true, false); break;
+        case MOD_INT:     divop(true, true); break;
+        case DIV_UINT:    divop(false, false); break;
+        case MOD_UINT:    divop(false, true); break;
+
+        case BSHL:        shiftop(4); break;
+        case BSHR:        shiftop(5); break;
+
+        case NEG_INT:     a.op_m({0xF7}, 3, TOP, -8); break;
+        case BNOT:        a.op_m({0xF7}, 2, TOP, -8); break;
+
+        case NEG_REAL:
+            a.mov_imm(A::RAX, (uint64_t)1 << 63);
+            a.op_m({0x31}, A::RAX, TOP, -8);
+            break;
+
+        case BOOL_NOT:
+            a.op_m({0x83}, 7, TOP, -8);
+            a.byte(0);
+            a.setcc_rax(A::CC_E);
+            a.store(TOP, -8, A::RAX);
+            break;
+
+        case ADD_REAL:    realop(0x58); break;
+        case SUB_REAL:    realop(0x5C); break;
+        case MUL_REAL:    realop(0x59); break;
+        case DIV_REAL:    realop(0x5E); break;
+
+        case EQ_INT:
+        case EQ_UINT:     cmpop(A::CC_E); break;
+        case LT_INT:      cmpop(A::CC_L); break;
+        case LTE_INT:     cmpop(A::CC_LE); break;
+        case GT_INT:      cmpop(A::CC_G); break;
+        case GTE_INT:     cmpop(A::CC_GE); break;
+        case LT_UINT:     cmpop(A::CC_B); break;
+        case LTE_UINT:    cmpop(A::CC_BE); break;
+        case GT_UINT:     cmpop(A::CC_A); break;
+        case GTE_UINT:    cmpop(A::CC_AE); break;
+
+        case EQ_REAL:     realeq(); break;
+        case LT_REAL:     realcmp(A::CC_A, true); break;
+        case LTE_REAL:    realcmp(A::CC_AE, true); break;
+        case GT_REAL:     realcmp(A::CC_A, false); break;
+        case GTE_REAL:    realcmp(A::CC_AE, false); break;
+
+        case INT_TO_REAL:
+            a.op_m({0x0F, 0x2A}, 0, TOP, -8, true, 0xF2);
+            a.op_m({0x0F, 0x11}, 0, TOP, -8, false, 0xF2);
+            break;
+
+        case REAL_TO_INT:
+            a.op_m({0x0F, 0x2C}, A::RAX, TOP, -8, true, 0xF2);
+            a.store(TOP, -8, A::RAX);
+            break;
+
+        default:
+            a.mov_imm(A::RAX, ip);
+            a.jmp(exit_label);
+            break;
+        }
+
+        return ip + 1;
+    }
+
+    // Returns the machine code for the whole function, and the offsets of its
+    // entry points in 'offsets'. The code is position-independent.
+
+    std::vector<uint8_t> compile(std::vector< std::pair<size_t,size_t> >& offsets) {
+
+        std::vector<size_t> ents = entries();
+
+        if (ents.empty())
+            return std::vector<uint8_t>();
+
+        target.assign(fend - fstart + 1, false);
+
+        for (size_t ip = fstart; ip < fend; ++ip) {
+            if (at(ip).is_jump()) {
+                size_t t = ip + at(ip).arg.inte;
+
+                if (t >= fstart && t < fend)
+                    target[t - fstart] = true;
+            }
+        }
+
+        for (size_t e : ents) {
+            target[e - fstart] = true;
+        }
+
+        exit_label = a.new_label();
+
+        for (size_t ip = fstart; ip <= fend; ++ip) {
+            oplabel.push_back(a.new_label());
+        }
+
+        for (size_t e : ents) {
+            offsets.emplace_back(e, a.size());
+
+            a.push(A::RBX);
+            a.push(A::R12);
+            a.push(A::R13);
+            a.push(A::R14);
+            a.push(A::R15);
+            a.mov(STATE, A::RDI);
+            a.load(TOP, STATE, offsetof(JitState, top));
+            a.load(FB, STATE, offsetof(JitState, fb));
+            a.load(LIMIT, STATE, offsetof(JitState, limit));
+            a.load(PEAK, STATE, offsetof(JitState, peak));
+            a.jmp(oplabel[e - fstart]);
+        }
+
+        size_t ip = fstart;
+
+        while (ip < fend) {
+            a.bind(oplabel[ip - fstart]);
+            size_t next = opcode(ip);
+
+            for (size_t i = ip + 1; i < next; ++i) {
+                a.bind(oplabel[i - fstart]);
+            }
+
+            ip = next;
+        }
+
+        a.bind(oplabel[fend - fstart]);
+        a.mov_imm(A::RAX, fend);
+        a.jmp(exit_label);
+
+        for (const auto& s : stubs) {
+            a.bind(s.slow);
+            a.cmp(A::RAX, LIMIT);
+            a.jcc(A::CC_A, s.exit);
+            a.mov(PEAK, A::RAX);
+            a.jmp(s.back);
+        }
+
+        for (const auto& e : exits) {
+            a.bind(e.first);
+            a.mov_imm(A::RAX, e.second);
+            a.jmp(exit_label);
+        }
+
+        a.bind(exit_label);
+        a.store(STATE, offsetof(JitState, top), TOP);
+        a.store(STATE, offsetof(JitState, fb), FB);
+        a.store(STATE, offsetof(JitState, peak), PEAK);
+        a.pop(A::R15);
+        a.pop(A::R14);
+        a.pop(A::R13);
+        a.pop(A::R12);
+        a.pop(A::RBX);
+        a.byte(0xC3);
+
+        a.finish();
+        return a.b;
+    }
+};
+
+#endif
+
+
+// The JIT proper: call counting, the native entry table and the code buffer.
+
+struct Jit : public VmJit {
+
+    typedef size_t (*native_t)(JitState*);
+
+    size_t threshold;
+
+    std::vector<native_t> native;
+    std::vector<uint32_t> counts;
+    std::unordered_set<size_t> compiled;
+
+    size_t functions;
+    size_t bytes;
+
+    struct chunk_t {
+        uint8_t* mem;
+        size_t size;
+        size_t used;
+    };
+
+    std::vector<chunk_t> chunks;
+
+    static const size_t DEFAULT_THRESHOLD = 1000;
+    static const size_t CHUNK_SIZE = 1 << 20;
+
+    Jit(size_t t = DEFAULT_THRESHOLD) : threshold(t), functions(0), bytes(0) {}
+
+    Jit(const Jit&) = delete;
+    Jit& operator=(const Jit&) = delete;
+
+    ~Jit() {
+        release();
+    }
+
+    static bool available() {
+#ifdef NANOM_JIT_X86_64
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    // Forget all native code; must be called whenever the linked image changes.
+    void reset() {
+        native.clear();
+        counts.clear();
+        compiled.clear();
+        functions = 0;
+        bytes = 0;
+        release();
+    }
+
+    size_t enter(Vm& vm, size_t ip) {
+
+#ifdef NANOM_JIT_X86_64
+        if (native.size() != vm.code.image.size()) {
+            reset();
+            native.resize(vm.code.image.size());
+            counts.resize(vm.code.image.size());
+        }
+
+        while (1) {
+            native_t f = native[ip];
+
+            if (!f) {
+                if (counts[ip] >= threshold || ++counts[ip] < threshold)
+                    return ip;
+
+                compile(vm, ip);
+                f = native[ip];
+
+                if (!f)
+                    return ip;
+            }
+
+            JitState s;
+            s.top = vm.stack.top;
+            s.fb = vm.stack.base + vm.frame.back().stack_ix;
+            s.limit = vm.stack.limit;
+            s.peak = vm.stack.peak;
+            s.failbit = &vm.failbit;
+            s.vm = &vm;
+            s.fsize = vm.frame.back().struct_size;
+
+            size_t next = f(&s);
+
+            vm.stack.top = s.top;
+            vm.stack.peak = s.peak;
+
+            if (!(next & JitCompiler::REENTER))
+                return next;
+
+            ip = next & ~JitCompiler::REENTER;
+        }
+#else
+        return ip;
+#endif
+    }
+
+private:
+
+#ifdef NANOM_JIT_X86_64
+
+    void compile(Vm& vm, size_t ip) {
+
+        const label_t& l = vm.code.label_at(ip);
+        size_t start = vm.code.entry(l);
+
+        if (compiled.count(start))
+            return;
+
+        compiled.insert(start);
+
+        JitCompiler jc(vm.code, start);
+        std::vector< std::pair<size_t,size_t> > offsets;
+        std::vector<uint8_t> buf = jc.compile(offsets);
+
+        if (offsets.empty())
+            return;
+
+        uint8_t* mem = place(buf);
+
+        for (const auto& o : offsets) {
+            native[o.first] = (native_t)(mem + o.second);
+        }
+
+        ++functions;
+        bytes += buf.size();
+    }
+
+    // Copies machine code into executable memory; pages are never writable and
+    // executable at the same time.
+    uint8_t* place(const std::vector<uint8_t>& buf) {
+
+        if (chunks.empty() || chunks.back().size - chunks.back().used < buf.size()) {
+
+            chunk_t c;
+            c.size = std::max((size_t)CHUNK_SIZE, (buf.size() + 4095) & ~(size_t)4095);
+            c.used = 0;
+
+            void* m = ::mmap(NULL, c.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+            if (m == MAP_FAILED) {
+                throw std::runtime_error("JIT: could not allocate executable memory.");
+            }
+
+            c.mem = (uint8_t*)m;
+            chunks.push_back(c);
+
+        } else {
+            ::mprotect(chunks.back().mem, chunks.back().size, PROT_READ | PROT_WRITE);
+        }
+
+        chunk_t& c = chunks.back();
+        uint8_t* ret = c.mem + c.used;
+
+        ::memcpy(ret, buf.data(), buf.size());
+        c.used += (buf.size() + 15) & ~(size_t)15;
+
+        ::mprotect(c.mem, c.size, PROT_READ | PROT_EXEC);
+        return ret;
+    }
+
+#endif
+
+    void release() {
+#ifdef NANOM_JIT_X86_64
+        for (const auto& c : chunks) {
+            ::munmap(c.mem, c.size);
+        }
+#endif
+        chunks.clear();
+    }
+};
+
+}
+
+#endif
@@ -0,0 +1,1137 @@
+#ifndef __NANOM_OPT_H
+#define __NANOM_OPT_H
+
+/*
+ * A bytecode optimizer for nanom.
+ *
+ * It rewrites the functions in VmCode::codes before link() packs them into
+ * the image; only the ones just assembled, since code can only call functions
+ * defined before it, and the older ones are optimized already. Every pass is
+ * a CodeRewriter run, so relative jumps stay right; the passes repeat until
+ * nothing changes.
+ *
+ *  - Constant folding: arithmetic, bitwise, comparison and conversion opcodes
+ *    on PUSHed constants become one PUSH, and operations with an identity
+ *    operand (x + 0, x * 1, ...) go away.
+ *  - Strength reduction: division and modulo by a power of two become shifts
+ *    and masks; DIV_INT_POW2 and MOD_INT_POW2 do it for signed values.
+ *  - Dead code: NOOPs, branches on constants that are never taken, and
+ *    opcodes that no path reaches, such as the ones after a TAILCALL.
+ *  - Inlining: small branches and lambdas are spliced into their callers
+ *    (see Inliner).
+ *  - Self tail calls: a function's tail call to itself becomes a jump back
+ *    to its start (TAILCALL_SELF).
+ *
+ * Nothing that could trap or is undefined, such as a division by zero, is
+ * evaluated here; that is left for run time.
+ */
+
+#include <limits>
+#include <unordered_set>
+
+#include "nanom.h"
+
+
+namespace nanom {
+
+// The result of a unary opcode on a constant, if it can be had here.
+
+inline bool fold_unop(op_t op, Val x, Val& r) {
+    switch (op) {
+    case NEG_INT:      r = (Int)(0 - (UInt)x.inte); return true;
+    case NEG_REAL:     r = -x.real; return true;
+    case BNOT:         r = ~x.uint; return true;
+    case BOOL_NOT:     r = (UInt)!(x.uint); return true;
+    case INT_TO_REAL:  r = (Real)x.inte; return true;
+    case UINT_TO_REAL: r = (Real)x.uint; return true;
+    default:
+        return false;
+    }
+}
+
+// The same for binary opcodes. Signed arithmetic wraps, as it does on every
+// backend.
+
+inline bool fold_binop(op_t op, Val x, Val y, Val& r) {
+
+    if (is_compare(op)) {
+        r = (Int)compare(op, x, y);
+        return true;
+    }
+
+    switch (op) {
+    case ADD_INT:  r = (Int)((UInt)x.inte + (UInt)y.inte); return true;
+    case SUB_INT:  r = (Int)((UInt)x.inte - (UInt)y.inte); return true;
+    case MUL_INT:  r = (Int)((UInt)x.inte * (UInt)y.inte); return true;
+
+    case DIV_INT:
+    case MOD_INT:
+        if (y.inte == 0 || (y.inte == -1 && x.inte == std::numeric_limits<Int>::min()))
+            return false;
+        r = (op == DIV_INT ? x.inte / y.inte : x.inte % y.inte);
+        return true;
+
+    case ADD_UINT: r = x.uint + y.uint; return true;
+    case SUB_UINT: r = x.uint - y.uint; return true;
+    case MUL_UINT: r = x.uint * y.uint; return true;
+
+    case DIV_UINT:
+    case MOD_UINT:
+        if (y.uint == 0)
+            return false;
+        r = (op == DIV_UINT ? x.uint / y.uint : x.uint % y.uint);
+        return true;
+
+    case ADD_REAL: r = x.real + y.real; return true;
+    case SUB_REAL: r = x.real - y.real; return true;
+    case MUL_REAL: r = x.real * y.real; return true;
+    case DIV_REAL: r = x.real / y.real; return true;
+
+    case BAND:     r = x.uint & y.uint; return true;
+    case BOR:      r = x.uint | y.uint; return true;
+    case BXOR:     r = x.uint ^ y.uint; return true;
+
+    case BSHL:
+    case BSHR:
+        if (y.uint >= 64)
+            return false;
+        r = (op == BSHL ? x.uint << y.uint : x.uint >> y.uint);
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+// The same for DIV_INT_POW2 and MOD_INT_POW2 with operand k, the way the VM
+// computes them.
+
+inline bool fold_pow2(op_t op, Val x, UInt k, Val& r) {
+
+    if (k == 0 || k >= 63)
+        return false;
+
+    switch (op) {
+    case DIV_INT_POW2: r = div_pow2(x.inte, k); return true;
+    case MOD_INT_POW2: r = mod_pow2(x.inte, k); return true;
+    default:
+        return false;
+    }
+}
+
+// True if 'x op y' is x for every x.
+
+inline bool is_identity(op_t op, Val y) {
+    switch (op) {
+    case ADD_INT: case SUB_INT:
+        return y.inte == 0;
+    case MUL_INT: case DIV_INT:
+        return y.inte == 1;
+    case ADD_UINT: case SUB_UINT: case BOR: case BXOR: case BSHL: case BSHR:
+        return y.uint == 0;
+    case MUL_UINT: case DIV_UINT:
+        return y.uint == 1;
+    default:
+        return false;
+    }
+}
+
+// k if v is 2^k for some 0 < k < 63, else 0.
+
+inline size_t pow2_exponent(UInt v) {
+
+    if (v < 2 || (v & (v - 1)) != 0 || v > ((UInt)1 << 62))
+        return 0;
+
+    size_t k = 0;
+
+    while (v > 1) {
+        v >>= 1;
+        ++k;
+    }
+
+    return k;
+}
+
+inline bool falls_through(op_t op) {
+    switch (op) {
+    case FAIL:
+    case EXIT:
+    case TAILCALL:
+    case TAILCALL_DIRECT:
+    case POP_FRAMEHEAD_EXIT:
+    case JUMP:
+    case TAILCALL_SELF:
+        return false;
+    default:
+        return true;
+    }
+}
+
+// True for the opcodes that leave the failbit set one way or the other.
+
+inline bool sets_failbit(op_t op) {
+    switch (op) {
+    case CALL:
+    case CALL_LIGHT:
+    case CALL_DIRECT:
+    case CALL_LIGHT_DIRECT:
+    case SYSCALL:
+    case SYSCALL_DIRECT:
+    case TAILCALL:
+    case TAILCALL_DIRECT:
+    case TAILCALL_SELF:
+    case EXIT:
+    case FAIL:
+    case POP_FRAMEHEAD_EXIT:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// The net number of values an arithmetic opcode pushes, or false for other opcodes.
+
+inline bool arith_effect(op_t op, Int& d) {
+
+    if (is_compare(op)) {
+        d = -1;
+        return true;
+    }
+
+    switch (op) {
+    case ADD_INT: case SUB_INT: case MUL_INT: case DIV_INT: case MOD_INT:
+    case ADD_UINT: case SUB_UINT: case MUL_UINT: case MOD_UINT: case DIV_UINT:
+    case ADD_REAL: case SUB_REAL: case MUL_REAL: case DIV_REAL:
+    case BAND: case BOR: case BXOR: case BSHL: case BSHR:
+        d = -1;
+        return true;
+
+    case NEG_INT: case NEG_REAL: case BNOT: case BOOL_NOT:
+    case INT_TO_REAL: case REAL_TO_INT: case UINT_TO_REAL: case REAL_TO_UINT:
+    case ADD_INT_I: case SUB_INT_I: case MUL_INT_I: case DIV_INT_I: case MOD_INT_I:
+    case DIV_INT_POW2: case MOD_INT_POW2:
+        d = 0;
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+// True at the opcodes where the failbit may be read before anything sets it.
+
+inline std::vector<bool> failbit_live(const VmCode::code_t& code) {
+
+    std::vector<bool> live(code.size() + 1, false);
+    bool changed = true;
+
+    while (changed) {
+        changed = false;
+
+        for (size_t ip = code.size(); ip-- > 0; ) {
+            const Opcode& c = code[ip];
+            bool v = false;
+
+            if (c.op == IF_FAIL || c.op == IF_NOT_FAIL || c.op == EXIT_OR_POP_FRAMETAIL) {
+                v = true;
+
+            } else if (!sets_failbit(c.op)) {
+                v = (falls_through(c.op) && live[ip + 1]);
+
+                if (c.is_jump() && ip + c.arg.inte <= code.size()) {
+                    v = v || live[ip + c.arg.inte];
+                }
+            }
+
+            if (v && !live[ip]) {
+                live[ip] = true;
+                changed = true;
+            }
+        }
+    }
+
+    return live;
+}
+
+// The number of values above the frame base before every opcode of the
+// function 'l', or -1 where it is not known, e.g. on the paths of a failed
+// call. Calls are taken to replace their argument with their result, as the
+// register backend does.
+
+inline std::vector<Int> stack_heights(const VmCode& code, const label_t& l, const VmCode::code_t& c) {
+
+    const Int unseen = -2;
+    const Int unknown = -1;
+
+    std::vector<Int> h(c.size() + 1, unseen);
+
+    auto size_of = [&](Sym shape) -> Int {
+        return (code.shapes.has_shape(shape) ? (Int)code.shapes.get(shape).size() : unknown);
+    };
+
+    Int argsize = size_of(l.fromshape);
+    Int retsize = size_of(l.toshape);
+
+    std::vector<bool> target(c.size() + 1, false);
+
+    for (size_t ip = 0; ip < c.size(); ++ip) {
+        if (c[ip].is_jump() && ip + c[ip].arg.inte <= c.size()) {
+            target[ip + c[ip].arg.inte] = true;
+        }
+    }
+
+    // The operands that the n PUSHes before 'ip' give it.
+    auto pushed = [&](size_t ip, size_t n) {
+        if (ip < n)
+            return false;
+
+        for (size_t i = ip - n; i < ip; ++i) {
+            if (c[i].op != PUSH || (i > ip - n && target[i]) || target[ip])
+                return false;
+        }
+        return true;
+    };
+
+    // The height a call leaves, from the shapes of its label.
+    auto call = [&](Int x, const label_t& callee) {
+        Int from = size_of(callee.fromshape);
+        Int to = size_of(callee.toshape);
+
+        if (from < 0 || to < 0 || x < from)
+            return unknown;
+
+        return x - from + to;
+    };
+
+    std::vector<size_t> todo;
+
+    auto flow = [&](size_t ip, Int v) {
+        if (ip > c.size())
+            return;
+
+        if (v < 0)
+            v = unknown;
+
+        if (h[ip] == unseen) {
+            h[ip] = v;
+            todo.push_back(ip);
+
+        } else if (h[ip] != v && h[ip] != unknown) {
+            h[ip] = unknown;
+            todo.push_back(ip);
+        }
+    };
+
+    flow(0, argsize);
+
+    while (!todo.empty()) {
+        size_t ip = todo.back();
+        todo.pop_back();
+
+        if (ip == c.size())
+            continue;
+
+        const Opcode& o = c[ip];
+        Int x = h[ip];
+        Int y = unknown;
+        Int d;
+
+        switch (o.op) {
+        case NOOP:
+        case SWAP:
+        case JUMP:
+            y = x;
+            break;
+
+        case PUSH:
+            y = (x < 0 ? x : x + 1);
+            break;
+
+        case POP:
+        case IF:
+        case IF_NOT:
+            y = x - 1;
+            break;
+
+        case POP_FRAMEHEAD:
+            y = (x < 0 || argsize < 0 ? unknown : x - argsize);
+            break;
+
+        case POP_FRAMETAIL:
+            y = argsize;
+            break;
+
+        case POP_FRAMETAIL_I:
+            y = o.arg.inte;
+            break;
+
+        case TAILCALL_SELF:
+            y = argsize;
+            break;
+
+        case CALL:
+        case SYSCALL:
+            if (x >= 3 && pushed(ip, 3)) {
+                y = call(x - 3, label_t(c[ip-3].arg.uint, c[ip-2].arg.uint, c[ip-1].arg.uint));
+            }
+            break;
+
+        case SYSCALL_DIRECT:
+            if (x >= 0 && o.arg.uint < code.syscalls.size()) {
+                y = call(x, code.syscalls[o.arg.uint].label);
+            }
+            break;
+
+        case CALL_LIGHT:
+            y = retsize;
+            break;
+
+        case NEW_STRUCT_I:
+            y = x + o.arg.inte;
+            break;
+
+        case NEW_STRUCT:
+            if (x >= 1 && pushed(ip, 1)) {
+                y = x - 1 + c[ip-1].arg.inte;
+            }
+            break;
+
+        case GET_FRAMEHEAD_FIELDS_I:
+            y = x + (Int)o.packed_b() - (Int)o.packed_a();
+            break;
+
+        case GET_FIELDS_I:
+            y = x - (Int)o.packed_c() + (Int)o.packed_b() - (Int)o.packed_a();
+            break;
+
+        case SET_FIELDS_I:
+            y = x - ((Int)o.packed_b() - (Int)o.packed_a());
+            break;
+
+        default:
+            if (arith_effect(o.op, d)) {
+                y = x + d;
+            }
+            break;
+        }
+
+        if (x < 0 && o.op != POP_FRAMETAIL && o.op != POP_FRAMETAIL_I) {
+            y = unknown;
+        }
+
+        if (o.op == IF_FAIL) {
+            flow(ip + o.arg.inte, unknown);
+            flow(ip + 1, x);
+
+        } else if (o.op == IF_NOT_FAIL) {
+            flow(ip + o.arg.inte, x);
+            flow(ip + 1, unknown);
+
+        } else {
+            if (o.is_jump()) {
+                flow(ip + o.arg.inte, y);
+            }
+
+            if (falls_through(o.op)) {
+                flow(ip + 1, y);
+            }
+        }
+    }
+
+    for (Int& v : h) {
+        if (v == unseen)
+            v = unknown;
+    }
+
+    return h;
+}
+
+
+// Marks the opcodes that run after the function has dropped its frame
+// (DROP_FRAME before a tail call); in a branch, its EXIT and FAIL then return
+// from the parent function. False if some opcode is reached both ways.
+
+inline bool dropped_at(const VmCode::code_t& c, std::vector<bool>& dropped) {
+
+    std::vector<int> st(c.size() + 1, 0);
+    std::vector<size_t> todo;
+
+    auto flow = [&](size_t ip, int v) {
+        if (ip > c.size())
+            return true;
+
+        if (st[ip] == 0) {
+            st[ip] = v;
+            todo.push_back(ip);
+            return true;
+        }
+
+        return (st[ip] == v);
+    };
+
+    flow(0, 1);
+
+    while (!todo.empty()) {
+        size_t ip = todo.back();
+        todo.pop_back();
+
+        if (ip == c.size())
+            continue;
+
+        const Opcode& o = c[ip];
+        int v = st[ip];
+
+        if (o.op == DROP_FRAME) {
+            if (v == 2)
+                return false;
+
+            v = 2;
+        }
+
+        if (o.is_jump() && !flow(ip + o.arg.inte, v))
+            return false;
+
+        if (falls_through(o.op) && !flow(ip + 1, v))
+            return false;
+    }
+
+    dropped.assign(c.size(), false);
+
+    for (size_t ip = 0; ip < c.size(); ++ip) {
+        dropped[ip] = (st[ip] == 2);
+    }
+
+    return true;
+}
+
+
+// One folding and strength reduction pass.
+
+inline VmCode::code_t optimize_fold(const VmCode::code_t& code, bool& changed) {
+
+    CodeRewriter rw(code);
+
+    return rw.run([&](CodeRewriter& rw, size_t ip) -> size_t {
+
+            const VmCode::code_t& in = rw.in;
+
+            auto is_num = [&](size_t i) {
+                return (in[i].op == PUSH && !in[i].sym);
+            };
+
+            if (in[ip].op == NOOP || (in[ip].op == JUMP && in[ip].arg.inte == 1)) {
+                changed = true;
+                return 1;
+            }
+
+            // IF 2; JUMP n
+            if (rw.can_fold(ip, 2) && (in[ip].op == IF || in[ip].op == IF_NOT || in[ip].op == IF_FAIL ||
+                                       in[ip].op == IF_NOT_FAIL) &&
+                in[ip].arg.inte == 2 && in[ip+1].op == JUMP) {
+
+                op_t inv;
+
+                switch (in[ip].op) {
+                case IF:      inv = IF_NOT; break;
+                case IF_NOT:  inv = IF; break;
+                case IF_FAIL: inv = IF_NOT_FAIL; break;
+                default:      inv = IF_FAIL; break;
+                }
+
+                rw.emit_jump(Opcode(inv), ip + 1 + in[ip+1].arg.inte);
+                changed = true;
+                return 2;
+            }
+
+            if (!rw.can_fold(ip, 2) || !is_num(ip)) {
+                rw.keep(ip);
+                return 1;
+            }
+
+            op_t op = in[ip+1].op;
+            Val x = in[ip].arg;
+            Val r;
+
+            // PUSH x; PUSH y; op
+            if (rw.can_fold(ip, 3) && is_num(ip+1) && fold_binop(in[ip+2].op, x, in[ip+1].arg, r)) {
+                rw.emit(Opcode(PUSH, r));
+                changed = true;
+                return 3;
+            }
+
+            // PUSH x; DIV_INT_POW2 k
+            if (fold_pow2(op, x, in[ip+1].arg.uint, r)) {
+                rw.emit(Opcode(PUSH, r));
+                changed = true;
+                return 2;
+            }
+
+            // PUSH x; op
+            if (fold_unop(op, x, r)) {
+                rw.emit(Opcode(PUSH, r));
+                changed = true;
+                return 2;
+            }
+
+            // PUSH y; op, with y the identity of op
+            if (is_identity(op, x)) {
+                changed = true;
+                return 2;
+            }
+
+            // A branch that is never taken.
+            if ((op == IF && x.uint == 0) || (op == IF_NOT && x.uint != 0)) {
+                changed = true;
+                return 2;
+            }
+
+            size_t k = pow2_exponent(x.uint);
+
+            if (k > 0) {
+                switch (op) {
+                case DIV_UINT:
+                    rw.emit(Opcode(PUSH, (UInt)k));
+                    rw.emit(Opcode(BSHR));
+                    changed = true;
+                    return 2;
+
+                case MOD_UINT:
+                    rw.emit(Opcode(PUSH, x.uint - 1));
+                    rw.emit(Opcode(BAND));
+                    changed = true;
+                    return 2;
+
+                case DIV_INT:
+                case MOD_INT:
+                    rw.emit(Opcode(op == DIV_INT ? DIV_INT_POW2 : MOD_INT_POW2, (UInt)k));
+                    changed = true;
+                    return 2;
+
+                default:
+                    break;
+                }
+            }
+
+            rw.keep(ip);
+            return 1;
+        });
+}
+
+// Drops the opcodes that no path from the function's start reaches.
+
+inline VmCode::code_t optimize_prune(const VmCode::code_t& code, bool& changed) {
+
+    std::vector<bool> live(code.size(), false);
+    std::vector<size_t> todo(1, 0);
+
+    while (!todo.empty()) {
+        size_t ip = todo.back();
+        todo.pop_back();
+
+        while (ip < code.size() && !live[ip]) {
+            live[ip] = true;
+
+            const Opcode& c = code[ip];
+
+            if (c.is_jump()) {
+                todo.push_back(ip + c.arg.inte);
+            }
+
+            if (!falls_through(c.op))
+                break;
+
+            ++ip;
+        }
+    }
+
+    if (std::find(live.begin(), live.end(), false) == live.end())
+        return code;
+
+    changed = true;
+
+    CodeRewriter rw(code);
+
+    return rw.run([&](CodeRewriter& rw, size_t ip) -> size_t {
+            if (live[ip]) {
+                rw.keep(ip);
+            }
+            return 1;
+        });
+}
+
+inline void optimize(VmCode::code_t& code) {
+
+    bool changed = true;
+
+    while (changed) {
+        changed = false;
+        code = optimize_fold(code, changed);
+        code = optimize_prune(code, changed);
+    }
+}
+
+// Splices small functions into their callers: branches, which share the
+// caller's frame (CALL_LIGHT), and lambdas (CALL), whose frame accesses are
+// moved to where their argument sits in the caller's frame. The callee's EXIT
+// and FAIL become jumps to where the failure check after the call would have
+// gone. Callers are done after their callees, so nested branches inline too.
+//
+// Replaces a function body unless the new one is the same, so that bodies the
+// optimizer leaves alone stay shared with other copies of the code.
+
+inline void store(Cow<VmCode::code_t>& body, VmCode::code_t&& c) {
+
+    const VmCode::code_t& b = body.get();
+    bool same = (b.size() == c.size());
+
+    for (size_t i = 0; same && i < b.size(); ++i) {
+        same = (b[i].op == c[i].op && b[i].sym == c[i].sym && b[i].arg.uint == c[i].arg.uint);
+    }
+
+    if (!same) {
+        body = Cow<VmCode::code_t>(std::move(c));
+    }
+}
+
+// Callees of up to 'budget' opcodes are inlined until the caller reaches
+// 'limit' opcodes. Branches and lambdas that are no longer called are dropped.
+
+struct Inliner {
+
+    VmCode& code;
+
+    // The functions to inline into; the others are left as they are.
+    const std::unordered_set<label_t>& labels;
+
+    size_t budget;
+    size_t limit;
+
+    std::unordered_set<label_t> done;
+    std::unordered_set<label_t> active;
+
+    // Branches called with anything but their frame's struct on the stack;
+    // their stack heights are not known, so no lambdas are inlined into them.
+    std::unordered_set<label_t> odd_entry;
+
+    Inliner(VmCode& c, const std::unordered_set<label_t>& ls, size_t b, size_t lim) :
+        code(c), labels(ls), budget(b), limit(lim) {}
+
+    void run() {
+
+        for (const auto& i : code.codes) {
+
+            if (!labels.count(i.first))
+                continue;
+
+            const VmCode::code_t& c = i.second;
+            std::vector<Int> h = stack_heights(code, i.first, c);
+
+            for (size_t ip = 0; ip + 1 < c.size(); ++ip) {
+                label_t callee;
+
+                if (light_site(i.first, c, ip, callee) && h[ip] != h[0]) {
+                    odd_entry.insert(callee);
+                }
+            }
+        }
+
+        std::vector<label_t> order;
+
+        for (const auto& i : code.codes) {
+            if (labels.count(i.first)) {
+                order.push_back(i.first);
+            }
+        }
+
+        for (const auto& l : order) {
+            visit(l);
+        }
+
+        drop_unused();
+    }
+
+private:
+
+    static bool light_site(const label_t& l, const VmCode::code_t& c, size_t ip, label_t& callee) {
+
+        if (ip + 2 > c.size() || c[ip].op != PUSH || !c[ip].sym || c[ip+1].op != CALL_LIGHT)
+            return false;
+
+        callee = label_t(c[ip].arg.uint, l.fromshape, l.toshape);
+        return true;
+    }
+
+    static bool call_site(const VmCode::code_t& c, size_t ip, label_t& callee) {
+
+        if (ip + 4 > c.size() || c[ip+3].op != CALL)
+            return false;
+
+        for (size_t i = ip; i < ip + 3; ++i) {
+            if (c[i].op != PUSH || !c[i].sym)
+                return false;
+        }
+
+        callee = label_t(c[ip].arg.uint, c[ip+1].arg.uint, c[ip+2].arg.uint);
+        return true;
+    }
+
+    void visit(const label_t& l) {
+
+        if (done.count(l) || active.count(l) || !labels.count(l))
+            return;
+
+        auto i = code.codes.find(l);
+
+        if (i == code.codes.end())
+            return;
+
+        active.insert(l);
+
+        const VmCode::code_t& in = i->second;
+
+        for (size_t ip = 0; ip < in.size(); ++ip) {
+            label_t callee;
+
+            if (light_site(l, in, ip, callee) || call_site(in, ip, callee)) {
+                visit(callee);
+            }
+        }
+
+        VmCode::code_t out = splice(l, in);
+        optimize(out);
+        store(i->second, std::move(out));
+
+        active.erase(l);
+        done.insert(l);
+    }
+
+    // An opcode of the inlined body; EXIT and FAIL turn into jumps to 'target'
+    // in the caller.
+    struct op_t_ {
+        Opcode op;
+        bool leave;
+        size_t target;
+
+        op_t_(const Opcode& o, bool l = false, size_t t = 0) : op(o), leave(l), target(t) {}
+    };
+
+    // The callee's body as it goes into the caller, or false if it cannot be
+    // inlined. For lambdas 'base' is where the argument starts in the caller's frame.
+
+    bool body(const label_t& callee, bool lambda, Int base, size_t exit_to, size_t fail_to,
+              std::vector<op_t_>& out) {
+
+        auto i = code.codes.find(callee);
+
+        if (i == code.codes.end() || active.count(callee))
+            return false;
+
+        const VmCode::code_t& c = i->second.get();
+
+        if (c.empty() || c.size() > budget || falls_through(c.back().op) || failbit_live(c)[0])
+            return false;
+
+        std::vector<Int> h;
+        Int argsize = 0;
+        Int retsize = 0;
+
+        if (lambda) {
+            if (!code.shapes.has_shape(callee.fromshape) || !code.shapes.has_shape(callee.toshape))
+                return false;
+
+            argsize = code.shapes.get(callee.fromshape).size();
+            retsize = code.shapes.get(callee.toshape).size();
+            h = stack_heights(code, callee, c);
+        }
+
+        std::vector<bool> dropped;
+
+        if (!dropped_at(c, dropped))
+            return false;
+
+        for (size_t ip = 0; ip < c.size(); ++ip) {
+            const Opcode& o = c[ip];
+
+            if (o.is_jump() && (o.arg.inte <= 0 || ip + o.arg.inte >= c.size()))
+                return false;
+
+            switch (o.op) {
+            case EXIT:
+            case FAIL:
+                if (dropped[ip]) {
+                    out.push_back(op_t_(o));
+
+                } else if (lambda && o.op == EXIT && h[ip] != retsize) {
+                    return false;
+
+                } else {
+                    out.push_back(op_t_(o, true, o.op == EXIT ? exit_to : fail_to));
+                }
+                break;
+
+            // There is no frame of the branch's own to drop.
+            case DROP_FRAME:
+                if (lambda)
+                    return false;
+
+                out.push_back(op_t_(Opcode(NOOP)));
+                break;
+
+            case TAILCALL:
+                if (lambda || !dropped[ip])
+                    return false;
+
+                out.push_back(op_t_(o));
+                break;
+
+            case TAILCALL_DIRECT:
+            case TAILCALL_SELF:
+            case CALL_DIRECT:
+            case CALL_LIGHT_DIRECT:
+            case POP_FRAMEHEAD_EXIT:
+            case EXIT_OR_POP_FRAMETAIL:
+            case NEW_SHAPE:
+            case DEF_FIELD:
+            case DEF_STRUCT_FIELD:
+            case DEF_SHAPE:
+                return false;
+
+            case CALL_LIGHT:
+            case GET_FRAMEHEAD_FIELDS:
+                if (lambda)
+                    return false;
+
+                out.push_back(op_t_(o));
+                break;
+
+            case GET_FRAMEHEAD_FIELDS_I:
+                if (!lambda) {
+                    out.push_back(op_t_(o));
+
+                } else if (Opcode::packable(base + o.packed_a(), base + o.packed_b())) {
+                    out.push_back(op_t_(Opcode::packed(o.op, base + o.packed_a(), base + o.packed_b())));
+
+                } else {
+                    return false;
+                }
+                break;
+
+            case POP_FRAMEHEAD:
+                if (!lambda) {
+                    out.push_back(op_t_(o));
+
+                } else if (h[ip] >= argsize && Opcode::packable(argsize, h[ip], h[ip])) {
+                    out.push_back(op_t_(Opcode::packed(GET_FIELDS_I, argsize, h[ip], h[ip])));
+
+                } else {
+                    return false;
+                }
+                break;
+
+            case POP_FRAMETAIL:
+                out.push_back(op_t_(lambda ? Opcode(POP_FRAMETAIL_I, (UInt)(base + argsize)) : o));
+                break;
+
+            case POP_FRAMETAIL_I:
+                out.push_back(op_t_(lambda ? Opcode(POP_FRAMETAIL_I, (UInt)(base + o.arg.inte)) : o));
+                break;
+
+            default:
+                out.push_back(op_t_(o));
+                break;
+            }
+        }
+
+        return true;
+    }
+
+    VmCode::code_t splice(const label_t& l, const VmCode::code_t& in) {
+
+        std::vector<Int> h = stack_heights(code, l, in);
+        std::vector<bool> live = failbit_live(in);
+
+        CodeRewriter rw(in);
+
+        return rw.run([&](CodeRewriter& rw, size_t ip) -> size_t {
+
+                label_t callee;
+                size_t n = 0;
+                bool lambda = false;
+                Int base = 0;
+
+                if (light_site(l, in, ip, callee) && rw.can_fold(ip, 2)) {
+                    n = 2;
+
+                } else if (call_site(in, ip, callee) && rw.can_fold(ip, 4) && !odd_entry.count(l) &&
+                           h[ip] >= 0 && code.shapes.has_shape(callee.fromshape)) {
+                    n = 4;
+                    lambda = true;
+                    base = h[ip] - (Int)code.shapes.get(callee.fromshape).size();
+                }
+
+                if (n == 0 || base < 0) {
+                    rw.keep(ip);
+                    return 1;
+                }
+
+                // The failure check after the call goes away when nothing else jumps to it.
+                size_t cont = ip + n;
+                bool check = (cont < in.size() && (in[cont].op == IF_FAIL || in[cont].op == IF_NOT_FAIL) &&
+                              rw.can_fold(ip, n + 1));
+
+                auto resolve = [&](bool fail) -> size_t {
+                    if (!check)
+                        return cont;
+
+                    return ((in[cont].op == IF_FAIL) == fail ? cont + in[cont].arg.inte : cont + 1);
+                };
+
+                size_t exit_to = resolve(false);
+                size_t fail_to = resolve(true);
+
+                std::vector<op_t_> ops;
+
+                if (exit_to >= in.size() || fail_to >= in.size() || live[exit_to] || live[fail_to] ||
+                    !body(callee, lambda, base, exit_to, fail_to, ops) ||
+                    rw.out.size() + ops.size() + in.size() - ip > limit) {
+
+                    rw.keep(ip);
+                    return 1;
+                }
+
+                for (const auto& o : ops) {
+                    if (!o.leave) {
+                        rw.emit(o.op);
+
+                    } else if (in[o.target].op == EXIT || in[o.target].op == FAIL) {
+                        rw.emit(Opcode(in[o.target].op));
+
+                    } else {
+                        rw.emit_jump(Opcode(JUMP), o.target);
+                    }
+                }
+
+                return n + (check ? 1 : 0);
+            });
+    }
+
+    // Branches and lambdas are named 'name$N'; they can only be called from
+    // the code of their parent, which was assembled along with them.
+
+    static bool is_internal(Sym name) {
+        const std::string& s = symtab().get(name);
+        size_t i = s.rfind('$');
+
+        return (i != std::string::npos && i > 0 && i + 1 < s.size() &&
+                s.find_first_not_of("0123456789", i + 1) == std::string::npos);
+    }
+
+    void drop_unused() {
+
+        bool changed = true;
+
+        while (changed) {
+            changed = false;
+
+            std::unordered_set<Sym> called;
+
+            for (const auto& l : labels) {
+                auto i = code.codes.find(l);
+
+                if (i == code.codes.end())
+                    continue;
+
+                for (const auto& c : i->second.get()) {
+                    if (c.op == PUSH && c.sym) {
+                        called.insert(c.arg.uint);
+                    }
+                }
+            }
+
+            for (const auto& l : labels) {
+                if (is_internal(l.name) && !called.count(l.name) && code.codes.erase(l) > 0) {
+                    changed = true;
+                }
+            }
+        }
+    }
+};
+
+// A function's tail calls to itself, made on its own frame, become
+// TAILCALL_SELF: the new argument replaces the old one and control goes back
+// to the start, as in a loop. Recursion through a branch gets here once the
+// branch is inlined.
+
+inline VmCode::code_t optimize_self_tailcalls(const label_t& l, const VmCode::code_t& code) {
+
+    std::vector<bool> dropped;
+
+    if (!dropped_at(code, dropped))
+        return code;
+
+    CodeRewriter rw(code);
+
+    return rw.run([&](CodeRewriter& rw, size_t ip) -> size_t {
+
+            const VmCode::code_t& in = rw.in;
+
+            if (rw.can_fold(ip, 4) && !dropped[ip] &&
+                in[ip].op == PUSH && in[ip+1].op == PUSH && in[ip+2].op == PUSH &&
+                in[ip+3].op == TAILCALL &&
+                label_t(in[ip].arg.uint, in[ip+1].arg.uint, in[ip+2].arg.uint) == l) {
+
+                rw.emit_jump(Opcode(TAILCALL_SELF), 0);
+                return 4;
+            }
+
+            rw.keep(ip);
+            return 1;
+        });
+}
+
+// Optimizes the functions 'labels', e.g. the ones a PiccolAsm::parse just
+// assembled. With 'inline_budget' 0 nothing is inlined.
+
+inline void optimize(VmCode& code, const std::unordered_set<label_t>& labels, size_t inline_budget = 32) {
+
+    for (const auto& l : labels) {
+        auto i = code.codes.find(l);
+
+        if (i == code.codes.end())
+            continue;
+
+        VmCode::code_t c = i->second;
+        optimize(c);
+        store(i->second, std::move(c));
+    }
+
+    if (inline_budget > 0) {
+        Inliner(code, labels, inline_budget, 32 * inline_budget).run();
+    }
+
+    for (const auto& l : labels) {
+        auto i = code.codes.find(l);
+
+        if (i != code.codes.end()) {
+            store(i->second, optimize_self_tailcalls(i->first, i->second));
+        }
+    }
+}
+
+// The same for every function.
+
+inline void optimize(VmCode& code, size_t inline_budget = 32) {
+
+    std::unordered_set<label_t> labels;
+
+    for (const auto& i : code.codes) {
+        labels.insert(i.first);
+    }
+
+    optimize(code, labels, inline_budget);
+}
+
+}
+
+#endif
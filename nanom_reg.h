@@ -0,0 +1,1353 @@
+#ifndef __NANOM_REG_H
+#define __NANOM_REG_H
+
+#include "nanom.h"
+
+
+/*
+ * A register-style backend for nanom.
+ *
+ * Every function's stack layout is fixed once the assembler has type-checked
+ * it, so the stack bytecode can be translated into instructions that address
+ * frame slots directly. Slot n of a frame is the n-th value above the frame's
+ * argument struct's first field, exactly where the stack VM would keep it;
+ * frames of nested calls start where the callee's arguments were pushed.
+ *
+ * The stack VM stays the reference engine: translation is all or nothing, and
+ * RegCode::error says why a program could not be translated.
+ */
+
+namespace nanom {
+
+// Two-operand instructions come in two flavours: _RR reads both operands
+// from slots, _RI takes the right-hand operand as an immediate.
+
+#define NANOM_REG_BINOPS(X)                         \
+    X(ADD_INT,  (Int)(x.uint + y.uint))             \
+    X(SUB_INT,  (Int)(x.uint - y.uint))             \
+    X(MUL_INT,  (Int)(x.uint * y.uint))             \
+    X(DIV_INT,  (Int)(x.inte / y.inte))             \
+    X(MOD_INT,  (Int)(x.inte % y.inte))             \
+    X(ADD_UINT, (UInt)(x.uint + y.uint))            \
+    X(SUB_UINT, (UInt)(x.uint - y.uint))            \
+    X(MUL_UINT, (UInt)(x.uint * y.uint))            \
+    X(MOD_UINT, (UInt)(x.uint % y.uint))            \
+    X(DIV_UINT, (UInt)(x.uint / y.uint))            \
+    X(ADD_REAL, (Real)(x.real + y.real))            \
+    X(SUB_REAL, (Real)(x.real - y.real))            \
+    X(MUL_REAL, (Real)(x.real * y.real))            \
+    X(DIV_REAL, (Real)(x.real / y.real))            \
+    X(BAND,     (UInt)(x.uint & y.uint))            \
+    X(BOR,      (UInt)(x.uint | y.uint))            \
+    X(BXOR,     (UInt)(x.uint ^ y.uint))            \
+    X(BSHL,     (UInt)(x.uint << y.uint))           \
+    X(BSHR,     (UInt)(x.uint >> y.uint))           \
+    X(EQ_INT,   (Int)(x.inte == y.inte))            \
+    X(LT_INT,   (Int)(x.inte < y.inte))             \
+    X(LTE_INT,  (Int)(x.inte <= y.inte))            \
+    X(GT_INT,   (Int)(x.inte > y.inte))             \
+    X(GTE_INT,  (Int)(x.inte >= y.inte))            \
+    X(EQ_UINT,  (Int)(x.uint == y.uint))            \
+    X(LT_UINT,  (Int)(x.uint < y.uint))             \
+    X(LTE_UINT, (Int)(x.uint <= y.uint))            \
+    X(GT_UINT,  (Int)(x.uint > y.uint))             \
+    X(GTE_UINT, (Int)(x.uint >= y.uint))            \
+    X(EQ_REAL,  (Int)(x.real == y.real))            \
+    X(LT_REAL,  (Int)(x.real < y.real))             \
+    X(LTE_REAL, (Int)(x.real <= y.real))            \
+    X(GT_REAL,  (Int)(x.real > y.real))             \
+    X(GTE_REAL, (Int)(x.real >= y.real))
+
+#define NANOM_REG_UNOPS(X)                          \
+    X(NEG_INT,      (Int)(0 - x.uint))              \
+    X(NEG_REAL,     (Real)(-x.real))                \
+    X(BNOT,         (UInt)(~x.uint))                \
+    X(BOOL_NOT,     (UInt)(!x.uint))                \
+    X(INT_TO_REAL,  (Real)x.inte)                   \
+    X(REAL_TO_INT,  (Int)x.real)                    \
+    X(UINT_TO_REAL, (Real)x.uint)                   \
+    X(REAL_TO_UINT, (UInt)x.real)
+
+// Control and data movement; see RegInsn for the operand layout.
+
+#define NANOM_REG_OPS(X)                            \
+    X(R_MOV)                                        \
+    X(R_MOVI)                                       \
+    X(R_MOVE)                                       \
+    X(R_SWAP)                                       \
+    X(R_JMP)                                        \
+    X(R_JMP_IF)                                     \
+    X(R_JMP_IF_NOT)                                 \
+    X(R_JMP_FAIL)                                   \
+    X(R_JMP_NOT_FAIL)                               \
+    X(R_CALL)                                       \
+    X(R_CALL_LIGHT)                                 \
+    X(R_TAILCALL)                                   \
+    X(R_SYSCALL)                                    \
+    X(R_DROP_FRAME)                                 \
+    X(R_EXIT)                                       \
+    X(R_FAIL)
+
+enum reg_op_t {
+
+#define NANOM_X(o) o,
+    NANOM_REG_OPS(NANOM_X)
+#undef NANOM_X
+
+#define NANOM_X(o, e) R_##o##_RR, R_##o##_RI,
+    NANOM_REG_BINOPS(NANOM_X)
+#undef NANOM_X
+
+#define NANOM_X(o, e) R_##o,
+    NANOM_REG_UNOPS(NANOM_X)
+#undef NANOM_X
+
+    REG_OPCODE_COUNT
+};
+
+
+/*
+ * Operands, by instruction:
+ *
+ *   R_MOV         d = a
+ *   R_MOVI        d = imm
+ *   R_MOVE        d..d+b = a..a+b
+ *   R_SWAP        swap d and a
+ *   R_JMP*        a is the condition slot, b the target
+ *   R_CALL        new frame at slot a, b the target, d the callee's frame size
+ *   R_CALL_LIGHT  b the target, d the callee's frame size
+ *   R_TAILCALL    b the target, d the callee's frame size
+ *   R_SYSCALL     arguments and result at slot a, b indexes RegCode::syscalls,
+ *                 d is the calling function's frame size
+ *   _RR, _RI      d = a op b, d = a op imm
+ *   unary         d = op a
+ *
+ * Slots are relative to the current frame; jump and call targets are
+ * offsets into RegCode::image.
+ */
+
+struct RegInsn {
+    reg_op_t op;
+    uint32_t d;
+    uint32_t a;
+    uint32_t b;
+    Val imm;
+
+    RegInsn(reg_op_t o = R_JMP, size_t d_ = 0, size_t a_ = 0, size_t b_ = 0, Val i = (UInt)0) :
+        op(o), d((uint32_t)d_), a((uint32_t)a_), b((uint32_t)b_), imm(i) {}
+};
+
+
+inline const char* reg_opcodename(reg_op_t o) {
+
+    static const char* names[] = {
+
+#define NANOM_X(o) #o,
+        NANOM_REG_OPS(NANOM_X)
+#undef NANOM_X
+
+#define NANOM_X(o, e) "R_" #o "_RR", "R_" #o "_RI",
+        NANOM_REG_BINOPS(NANOM_X)
+#undef NANOM_X
+
+#define NANOM_X(o, e) "R_" #o,
+        NANOM_REG_UNOPS(NANOM_X)
+#undef NANOM_X
+    };
+
+    if (o >= REG_OPCODE_COUNT)
+        return "<bad opcode>";
+
+    return names[o];
+}
+
+
+struct RegCode {
+
+    struct func_t {
+        size_t entry;
+        size_t framesize;
+        size_t argsize;
+        size_t retsize;
+    };
+
+    struct syscall_t {
+        label_t label;
+        const Callback* cb;
+        const Shape* from;
+        const Shape* to;
+    };
+
+    std::vector<RegInsn> image;
+    std::unordered_map<label_t, func_t> funcs;
+    std::vector<syscall_t> syscalls;
+
+    // Empty if the whole program was translated.
+    std::string error;
+
+    bool ok() const { return error.empty(); }
+
+    const func_t& func(const label_t& l) const {
+        auto i = funcs.find(l);
+
+        if (i == funcs.end()) {
+            throw std::runtime_error("Undefined function: " + l.print());
+        }
+
+        return i->second;
+    }
+
+    void clear() {
+        image.clear();
+        funcs.clear();
+        syscalls.clear();
+        error.clear();
+    }
+
+    std::string print() const {
+        std::string ret;
+
+        std::vector< std::pair<size_t, label_t> > order;
+        for (const auto& f : funcs) {
+            order.push_back(std::make_pair(f.second.entry, f.first));
+        }
+        std::sort(order.begin(), order.end(),
+                  [](const std::pair<size_t,label_t>& a, const std::pair<size_t,label_t>& b) {
+                      return a.first < b.first;
+                  });
+
+        size_t n = 0;
+        for (size_t ip = 0; ip < image.size(); ++ip) {
+
+            while (n < order.size() && order[n].first == ip) {
+                ret += order[n].second.print() + ":\n";
+                ++n;
+            }
+
+            const RegInsn& c = image[ip];
+            ret += "  " + std::to_string(ip) + "\t" + reg_opcodename(c.op) + " " +
+                std::to_string(c.d) + " " + std::to_string(c.a) + " " + std::to_string(c.b) +
+                " (" + std::to_string(c.imm.inte) + ")\n";
+        }
+
+        return ret;
+    }
+};
+
+
+/*
+ * Translates one VmCode into a RegCode.
+ *
+ * The translator walks each function keeping a symbolic copy of its stack:
+ * a slot either lives in memory, holds a known constant, or is a copy of
+ * another slot. Constants and copies are only written out when something
+ * needs them in memory (a call, a jump, a return), so pushes of immediates
+ * and of frame fields fold into the operands of the instructions using them.
+ *
+ * The bytecode is assumed to be what the Piccol emitter produces: forward
+ * jumps only, and a call's failure checked right after the call.
+ */
+
+struct RegCompiler {
+
+    typedef VmCode::code_t code_t;
+
+    struct slot_t {
+        enum kind_t { MEM, CONST, COPY } kind;
+        Val k;
+        size_t src;
+
+        slot_t(kind_t t = MEM, Val v = (UInt)0, size_t s = 0) : kind(t), k(v), src(s) {}
+    };
+
+    enum fail_t { FB_CLEAR, FB_SET, FB_MAYBE };
+
+    struct state_t {
+        bool reachable;
+
+        // The stack depth is lost on paths where a call just failed.
+        bool unknown;
+
+        // Right after a call: the stack is only as described if it succeeded.
+        bool pending_call;
+
+        fail_t failbit;
+        std::vector<slot_t> st;
+
+        state_t() : reachable(false), unknown(false), pending_call(false), failbit(FB_CLEAR) {}
+    };
+
+    struct error : public std::runtime_error {
+        error(const std::string& s) : std::runtime_error(s) {}
+    };
+
+    const VmCode& code;
+    const Shapes& shapes;
+    RegCode& out;
+
+    RegCompiler(const VmCode& c, const Shapes& s, RegCode& o) : code(c), shapes(s), out(o) {}
+
+    void run() {
+
+        out.clear();
+
+        std::vector<label_t> order;
+
+        for (const auto& i : code.codes) {
+            if (i.first == VmCode::toplevel_label())
+                continue;
+
+            order.push_back(i.first);
+        }
+
+        std::sort(order.begin(), order.end(),
+                  [](const label_t& a, const label_t& b) {
+                      if (a.name != b.name) return a.name < b.name;
+                      if (a.fromshape != b.fromshape) return a.fromshape < b.fromshape;
+                      return a.toshape < b.toshape;
+                  });
+
+        try {
+            for (const auto& l : order) {
+                try {
+                    function(l, code.codes.at(l));
+
+                } catch (std::exception& e) {
+                    throw error("In " + l.print() + ": " + e.what());
+                }
+            }
+
+            link();
+
+        } catch (error& e) {
+            std::string msg = e.what();
+            out.clear();
+            out.error = msg;
+        }
+    }
+
+private:
+
+    // Per-function translation state.
+
+    size_t argsize;
+    size_t retsize;
+    size_t framesize;
+    size_t depth_guard;
+    state_t cur;
+
+    // Call sites to patch once every function has been translated.
+    std::vector< std::pair<size_t, label_t> > calls;
+    std::vector<size_t> syscall_sites;
+
+    void emit(const RegInsn& i) {
+        out.image.push_back(i);
+    }
+
+    void use(size_t slot) {
+        framesize = std::max(framesize, slot + 1);
+    }
+
+    static size_t slot_reg(const slot_t& s, size_t self) {
+        return (s.kind == slot_t::COPY ? s.src : self);
+    }
+
+    // The descriptor for a copy of slot i placed elsewhere.
+    slot_t moved(size_t i) const {
+        const slot_t& s = cur.st[i];
+
+        if (s.kind == slot_t::MEM)
+            return slot_t(slot_t::COPY, (UInt)0, i);
+
+        return s;
+    }
+
+    void normalize(size_t i) {
+        slot_t& s = cur.st[i];
+        if (s.kind == slot_t::COPY && s.src == i)
+            s = slot_t();
+    }
+
+    // Writes out every slot that still needs the value currently in slot x.
+    // Must be called before anything overwrites slot x.
+    void guard(size_t x) {
+
+        for (size_t t = 0; t < cur.st.size(); ++t) {
+            if (t != x && cur.st[t].kind == slot_t::COPY && cur.st[t].src == x) {
+                materialize(t);
+            }
+        }
+    }
+
+    void materialize(size_t t) {
+
+        if (cur.st[t].kind == slot_t::MEM)
+            return;
+
+        if (++depth_guard > cur.st.size() + 2) {
+            throw error("Sanity error: cyclic slot copies.");
+        }
+
+        guard(t);
+
+        const slot_t& s = cur.st[t];
+
+        if (s.kind == slot_t::CONST) {
+            emit(RegInsn(R_MOVI, t, 0, 0, s.k));
+        } else if (s.kind == slot_t::COPY) {
+            emit(RegInsn(R_MOV, t, s.src));
+        }
+
+        cur.st[t] = slot_t();
+        --depth_guard;
+    }
+
+    void materialize_all(size_t n) {
+        for (size_t i = 0; i < n; ++i) {
+            materialize(i);
+        }
+    }
+
+    void materialize_all() {
+        materialize_all(cur.st.size());
+    }
+
+    Val pop_const(const char* what) {
+
+        if (cur.st.empty() || cur.st.back().kind != slot_t::CONST) {
+            throw error(std::string("Operand of ") + what + " is not a constant.");
+        }
+
+        Val v = cur.st.back().k;
+        cur.st.pop_back();
+        return v;
+    }
+
+    // The field range of a field opcode, from its immediates or from the
+    // constants below it. Returns the struct size, 0 for the frame head.
+    UInt field_operands(const Opcode& c, UInt& b, UInt& e) {
+
+        if (c.is_packed()) {
+            b = c.packed_a();
+            e = c.packed_b();
+            return c.packed_c();
+        }
+
+        UInt size = (c.op == GET_FRAMEHEAD_FIELDS ? 0 : pop_const(opcodename(c.op).c_str()).uint);
+
+        e = pop_const(opcodename(c.op).c_str()).uint;
+        b = pop_const(opcodename(c.op).c_str()).uint;
+        return size;
+    }
+
+    void need(size_t n) {
+        if (cur.st.size() < n) {
+            throw error("Stack underflow.");
+        }
+    }
+
+    void require_known(const char* what) {
+        if (cur.unknown || cur.pending_call) {
+            throw error(std::string("Stack depth unknown at ") + what + ".");
+        }
+    }
+
+    void after_call() {
+        cur.pending_call = true;
+        cur.failbit = FB_MAYBE;
+    }
+
+    void binop(reg_op_t rr) {
+
+        need(2);
+
+        size_t d = cur.st.size();
+        size_t dst = d - 2;
+
+        guard(dst);
+
+        if (cur.st[d-2].kind == slot_t::CONST) {
+            // No immediate left-hand operands; stage the constant above the stack.
+            guard(d);
+            use(d);
+            emit(RegInsn(R_MOVI, d, 0, 0, cur.st[d-2].k));
+            cur.st[d-2] = slot_t(slot_t::COPY, (UInt)0, d);
+        }
+
+        const slot_t& x = cur.st[d-2];
+        const slot_t& y = cur.st[d-1];
+
+        if (y.kind == slot_t::CONST) {
+            emit(RegInsn((reg_op_t)(rr + 1), dst, slot_reg(x, d-2), 0, y.k));
+        } else {
+            emit(RegInsn(rr, dst, slot_reg(x, d-2), slot_reg(y, d-1)));
+        }
+
+        cur.st.pop_back();
+        cur.st.back() = slot_t();
+    }
+
+    void unop(reg_op_t r) {
+
+        need(1);
+
+        size_t dst = cur.st.size() - 1;
+
+        guard(dst);
+        materialize_const(dst);
+
+        emit(RegInsn(r, dst, slot_reg(cur.st[dst], dst)));
+        cur.st[dst] = slot_t();
+    }
+
+    void materialize_const(size_t i) {
+        if (cur.st[i].kind == slot_t::CONST) {
+            materialize(i);
+        }
+    }
+
+    // Moves the top n slots down to the frame start.
+    void store_head(size_t from, size_t n) {
+
+        for (size_t i = 0; i < n; ++i) {
+
+            slot_t& s = cur.st[from + i];
+
+            // Already in place: e.g. an argument passed through unchanged.
+            if (s.kind == slot_t::COPY && s.src == i) {
+                cur.st[i] = slot_t();
+                continue;
+            }
+
+            guard(i);
+
+            const slot_t& t = cur.st[from + i];
+
+            if (t.kind == slot_t::CONST) {
+                emit(RegInsn(R_MOVI, i, 0, 0, t.k));
+            } else {
+                emit(RegInsn(R_MOV, i, slot_reg(t, from + i)));
+            }
+
+            // The old value of slot i is gone; nothing refers to it any more.
+            cur.st[i] = slot_t();
+        }
+    }
+
+    void jump(size_t src_ip, const Opcode& c, std::vector<state_t>& incoming,
+              std::vector< std::pair<size_t,size_t> >& jumps, const state_t& target) {
+
+        Int t = (Int)src_ip + c.arg.inte;
+
+        if (t <= (Int)src_ip || t > (Int)incoming.size() - 1) {
+            throw error("Unsupported jump.");
+        }
+
+        jumps.push_back(std::make_pair(out.image.size() - 1, (size_t)t));
+        merge(incoming[t], target);
+    }
+
+    void merge(state_t& into, const state_t& s) {
+
+        if (!into.reachable) {
+            into = s;
+            into.reachable = true;
+            return;
+        }
+
+        if (into.pending_call != s.pending_call) {
+            throw error("Inconsistent stack at jump target.");
+        }
+
+        // Paths that meet with different stacks, such as the failure exits of an
+        // inlined branch, can only go on to reset the frame.
+        if (into.unknown != s.unknown || (!into.unknown && into.st.size() != s.st.size())) {
+            into.unknown = true;
+            into.st.clear();
+        }
+
+        if (into.failbit != s.failbit) {
+            into.failbit = FB_MAYBE;
+        }
+    }
+
+    void function(const label_t& l, const code_t& c) {
+
+        label_name = l.name;
+        label_fromshape = l.fromshape;
+        label_toshape = l.toshape;
+        argsize = shapes.get(l.fromshape).size();
+        retsize = shapes.get(l.toshape).size();
+        framesize = std::max(argsize, retsize);
+        depth_guard = 0;
+
+        size_t base = out.image.size();
+        syscall_sites.clear();
+
+        std::vector<state_t> incoming(c.size() + 1);
+        std::vector<size_t> irpos(c.size() + 1);
+        std::vector< std::pair<size_t,size_t> > jumps;
+
+        cur = state_t();
+        cur.reachable = true;
+        cur.st.resize(argsize);
+
+        for (size_t ip = 0; ip <= c.size(); ++ip) {
+
+            if (incoming[ip].reachable) {
+
+                if (cur.reachable) {
+                    if (!cur.unknown)
+                        materialize_all();
+
+                    merge(incoming[ip], cur);
+                }
+
+                cur = incoming[ip];
+            }
+
+            irpos[ip] = out.image.size();
+
+            if (!cur.reachable)
+                continue;
+
+            if (ip == c.size()) {
+                throw error("Control falls off the end of the function.");
+            }
+
+            if (!cur.unknown) {
+                framesize = std::max(framesize, cur.st.size());
+            }
+
+            opcode(ip, c[ip], incoming, jumps);
+        }
+
+        for (const auto& j : jumps) {
+            out.image[j.first].b = irpos[j.second];
+        }
+
+        for (size_t i : syscall_sites) {
+            out.image[i].d = framesize;
+        }
+
+        RegCode::func_t f;
+        f.entry = base;
+        f.framesize = framesize;
+        f.argsize = argsize;
+        f.retsize = retsize;
+        out.funcs[l] = f;
+    }
+
+    void call(reg_op_t op, const label_t& callee, size_t a) {
+        calls.push_back(std::make_pair(out.image.size(), callee));
+        emit(RegInsn(op, 0, a, 0));
+    }
+
+    void opcode(size_t ip, const Opcode& c, std::vector<state_t>& incoming,
+                std::vector< std::pair<size_t,size_t> >& jumps) {
+
+        // Only a failure check may follow a call, and only a few
+        // opcodes make sense once the stack has been lost.
+
+        if (cur.unknown || cur.pending_call) {
+
+            bool ok = (c.op == IF_FAIL || c.op == IF_NOT_FAIL || c.op == FAIL || c.op == NOOP ||
+                       (cur.unknown && (c.op == POP_FRAMETAIL || c.op == POP_FRAMETAIL_I ||
+                                        c.op == DROP_FRAME || c.op == JUMP)));
+
+            if (!ok) {
+                throw error(std::string("Unexpected ") + opcodename(c.op) + " after a call.");
+            }
+        }
+
+        switch (c.op) {
+
+        case NOOP:
+            break;
+
+        case PUSH:
+            cur.st.push_back(slot_t(slot_t::CONST, c.arg));
+            break;
+
+        case POP:
+            need(1);
+            cur.st.pop_back();
+            break;
+
+        case SWAP: {
+            need(2);
+            size_t d = cur.st.size();
+
+            if (cur.st[d-2].kind == slot_t::MEM && cur.st[d-1].kind == slot_t::MEM) {
+                guard(d-2);
+                guard(d-1);
+                emit(RegInsn(R_SWAP, d-2, d-1));
+
+            } else {
+                slot_t x = moved(d-2);
+                slot_t y = moved(d-1);
+                cur.st[d-2] = y;
+                cur.st[d-1] = x;
+                normalize(d-2);
+                normalize(d-1);
+            }
+            break;
+        }
+
+        case IF:
+        case IF_NOT: {
+            need(1);
+            size_t d = cur.st.size();
+            materialize_all(d - 1);
+
+            slot_t v = cur.st[d-1];
+            cur.st.pop_back();
+
+            if (v.kind == slot_t::CONST) {
+                bool taken = ((v.k.uint != 0) == (c.op == IF));
+
+                if (taken) {
+                    emit(RegInsn(R_JMP));
+                    jump(ip, c, incoming, jumps, cur);
+                    cur.reachable = false;
+                }
+
+            } else {
+                emit(RegInsn(c.op == IF ? R_JMP_IF : R_JMP_IF_NOT, 0, slot_reg(v, d-1)));
+                jump(ip, c, incoming, jumps, cur);
+            }
+            break;
+        }
+
+        case IF_FAIL:
+        case IF_NOT_FAIL: {
+
+            bool on_fail = (c.op == IF_FAIL);
+
+            if (!cur.unknown)
+                materialize_all();
+
+            if (cur.failbit == FB_CLEAR) {
+                if (!on_fail) {
+                    emit(RegInsn(R_JMP));
+                    jump(ip, c, incoming, jumps, cur);
+                    cur.reachable = false;
+                }
+                break;
+            }
+
+            if (cur.failbit == FB_SET) {
+                if (on_fail) {
+                    emit(RegInsn(R_JMP));
+                    jump(ip, c, incoming, jumps, cur);
+                    cur.reachable = false;
+                }
+                break;
+            }
+
+            state_t failed = cur;
+            failed.failbit = FB_SET;
+            if (cur.pending_call) {
+                failed.unknown = true;
+                failed.st.clear();
+            }
+            failed.pending_call = false;
+
+            state_t ok = cur;
+            ok.failbit = FB_CLEAR;
+            ok.pending_call = false;
+
+            emit(RegInsn(on_fail ? R_JMP_FAIL : R_JMP_NOT_FAIL));
+            jump(ip, c, incoming, jumps, on_fail ? failed : ok);
+            cur = (on_fail ? ok : failed);
+            break;
+        }
+
+        case POP_FRAMEHEAD: {
+            need(argsize);
+            size_t n = cur.st.size() - argsize;
+
+            if (argsize > 0) {
+                store_head(argsize, n);
+                cur.st.resize(n);
+            }
+            break;
+        }
+
+        case POP_FRAMETAIL:
+        case POP_FRAMETAIL_I: {
+            size_t n = (c.op == POP_FRAMETAIL ? argsize : c.arg.uint);
+
+            if (cur.unknown) {
+                cur.unknown = false;
+                cur.st.assign(n, slot_t());
+
+            } else {
+                need(n);
+                cur.st.resize(n);
+            }
+            break;
+        }
+
+        case JUMP:
+            if (!cur.unknown)
+                materialize_all();
+
+            emit(RegInsn(R_JMP));
+            jump(ip, c, incoming, jumps, cur);
+            cur.reachable = false;
+            break;
+
+        case DROP_FRAME:
+            emit(RegInsn(R_DROP_FRAME));
+            break;
+
+        case FAIL:
+            emit(RegInsn(R_FAIL));
+            cur.reachable = false;
+            break;
+
+        case EXIT:
+            if (cur.st.size() != retsize) {
+                throw error("Returning a struct of the wrong size.");
+            }
+            materialize_all();
+            emit(RegInsn(R_EXIT));
+            cur.reachable = false;
+            break;
+
+        case TAILCALL_SELF: {
+            need(argsize);
+            size_t a = cur.st.size() - argsize;
+
+            if (a != argsize) {
+                throw error("Tail call with values left below its arguments.");
+            }
+
+            store_head(a, argsize);
+            call(R_TAILCALL, label_t(label_name, label_fromshape, label_toshape), 0);
+            cur.reachable = false;
+            break;
+        }
+
+        case CALL:
+        case SYSCALL:
+        case SYSCALL_DIRECT:
+        case TAILCALL: {
+            label_t callee;
+
+            if (c.op == SYSCALL_DIRECT) {
+                callee = code.syscalls[c.arg.uint].label;
+
+            } else {
+                Val to = pop_const("call");
+                Val from = pop_const("call");
+                Val name = pop_const("call");
+
+                callee = label_t(name.uint, from.uint, to.uint);
+            }
+
+            size_t an = shapes.get(callee.fromshape).size();
+            size_t rn = shapes.get(callee.toshape).size();
+
+            need(an);
+            size_t a = cur.st.size() - an;
+
+            if (c.op == TAILCALL) {
+                if (a != argsize) {
+                    throw error("Tail call with values left below its arguments.");
+                }
+
+                store_head(a, an);
+                call(R_TAILCALL, callee, 0);
+                cur.reachable = false;
+                break;
+            }
+
+            materialize_all();
+
+            if (c.op == CALL) {
+                call(R_CALL, callee, a);
+
+            } else {
+                auto cb = code.callbacks.find(callee);
+
+                if (cb == code.callbacks.end()) {
+                    throw error("Callback '" + callee.print() + "' undefined");
+                }
+
+                RegCode::syscall_t sc;
+                sc.label = callee;
+                sc.cb = &(cb->second);
+                sc.from = &(shapes.get(callee.fromshape));
+                sc.to = &(shapes.get(callee.toshape));
+
+                syscall_sites.push_back(out.image.size());
+                emit(RegInsn(R_SYSCALL, 0, a, out.syscalls.size()));
+                out.syscalls.push_back(sc);
+            }
+
+            cur.st.resize(a);
+            cur.st.resize(a + rn);
+            use(a + std::max(an, rn));
+            after_call();
+            break;
+        }
+
+        case CALL_LIGHT: {
+            Val name = pop_const("CALL_LIGHT");
+
+            if (cur.st.size() != argsize) {
+                throw error("Branch called with a non-empty stack.");
+            }
+
+            materialize_all();
+
+            label_t callee(name.uint, label_fromshape, label_toshape);
+            call(R_CALL_LIGHT, callee, 0);
+
+            cur.st.assign(retsize, slot_t());
+            after_call();
+            break;
+        }
+
+        case NEW_STRUCT:
+        case NEW_STRUCT_I: {
+            UInt n = (c.op == NEW_STRUCT_I ? c.arg.uint : pop_const("NEW_STRUCT").uint);
+            cur.st.insert(cur.st.end(), n, slot_t(slot_t::CONST, (UInt)0));
+            break;
+        }
+
+        case GET_FRAMEHEAD_FIELDS:
+        case GET_FRAMEHEAD_FIELDS_I: {
+            UInt b, e;
+            field_operands(c, b, e);
+
+            if (b > e || e > cur.st.size()) {
+                throw error("Frame head field out of range.");
+            }
+
+            for (size_t i = b; i < e; ++i) {
+                cur.st.push_back(moved(i));
+            }
+            break;
+        }
+
+        case GET_FIELDS:
+        case GET_FIELDS_I: {
+            UInt b, e;
+            UInt size = field_operands(c, b, e);
+
+            need(size);
+
+            if (b > e || e > size) {
+                throw error("Struct field out of range.");
+            }
+
+            size_t base = cur.st.size() - size;
+            std::vector<slot_t> fields;
+
+            for (size_t i = b; i < e; ++i) {
+                fields.push_back(moved(base + i));
+            }
+
+            cur.st.resize(base);
+            cur.st.insert(cur.st.end(), fields.begin(), fields.end());
+
+            for (size_t i = base; i < cur.st.size(); ++i) {
+                normalize(i);
+            }
+            break;
+        }
+
+        case SET_FIELDS:
+        case SET_FIELDS_I: {
+            UInt b, e;
+            UInt size = field_operands(c, b, e);
+
+            size_t n = e - b;
+
+            if (b > e || e > size) {
+                throw error("Struct field out of range.");
+            }
+
+            need(n + size);
+
+            size_t top = cur.st.size() - n;
+            size_t dst = top - size + b;
+
+            for (size_t i = 0; i < n; ++i) {
+                cur.st[dst + i] = moved(top + i);
+                normalize(dst + i);
+            }
+
+            cur.st.resize(top);
+            break;
+        }
+
+        case DIV_INT_POW2:
+        case MOD_INT_POW2:
+            cur.st.push_back(slot_t(slot_t::CONST, (Int)1 << c.arg.uint));
+            binop(c.op == DIV_INT_POW2 ? R_DIV_INT_RR : R_MOD_INT_RR);
+            break;
+
+#define NANOM_X(o, e) case o: binop(R_##o##_RR); break;
+        NANOM_REG_BINOPS(NANOM_X)
+#undef NANOM_X
+
+#define NANOM_X(o, e) case o: unop(R_##o); break;
+        NANOM_REG_UNOPS(NANOM_X)
+#undef NANOM_X
+
+        default:
+            throw error(std::string("Cannot translate ") + opcodename(c.op) + ".");
+        }
+    }
+
+    void link() {
+
+        for (const auto& c : calls) {
+
+            auto i = out.funcs.find(c.second);
+
+            if (i == out.funcs.end()) {
+                throw error("Undefined function called: " + c.second.print());
+            }
+
+            RegInsn& insn = out.image[c.first];
+            insn.b = i->second.entry;
+            insn.d = i->second.framesize;
+        }
+
+        if (out.image.size() > 0xFFFFFFFF) {
+            throw error("Code image too large.");
+        }
+    }
+
+    Sym label_name;
+    Sym label_fromshape;
+    Sym label_toshape;
+};
+
+
+struct RegVm {
+
+    struct frame_t {
+        const RegInsn* ret;
+        Val* fb;
+
+        frame_t(const RegInsn* r, Val* f) : ret(r), fb(f) {}
+    };
+
+    const RegCode& code;
+    const Shapes& shapes;
+
+    // Slots, allocated on first use.
+    std::vector<Val> regs;
+    size_t stack_size;
+
+    std::vector<frame_t> frame;
+    bool failbit;
+
+    // Where the next run's frame starts; moves up while a callback runs,
+    // so that callbacks may re-enter the VM.
+    Val* top;
+
+    // Where callback calls are timed; not timed if null.
+    Timings* timings;
+
+    RegVm(const RegCode& c, const Shapes& s, Timings* t = nullptr, size_t ss = 1 << 16) :
+        code(c), shapes(s), stack_size(ss), failbit(false), top(nullptr), timings(t) {}
+
+    RegVm(const RegVm&) = delete;
+
+    bool run(const label_t& l, const Struct& in, Struct& out) {
+
+        if (regs.empty()) {
+            regs.resize(stack_size);
+            frame.reserve(256);
+            top = regs.data();
+        }
+
+        const RegCode::func_t& f = code.func(l);
+
+        Val* fb = top;
+
+        if (fb + std::max(in.v.size(), f.framesize) > regs.data() + regs.size()) {
+            throw std::runtime_error("Register VM stack overflow.");
+        }
+
+        std::copy(in.v.begin(), in.v.end(), fb);
+
+        size_t nframes = frame.size();
+        frame.emplace_back(nullptr, fb);
+
+        try {
+            exec(code.image.data() + f.entry, fb);
+
+        } catch (...) {
+            frame.erase(frame.begin() + nframes, frame.end());
+            top = fb;
+            throw;
+        }
+
+        top = fb;
+
+        if (failbit) {
+            out.v.clear();
+        } else {
+            out.v.assign(fb, fb + f.retsize);
+        }
+
+        return !failbit;
+    }
+
+private:
+
+    void exec(const RegInsn* pc, Val* fb) {
+
+        size_t topframe = frame.size();
+        const RegInsn* image = code.image.data();
+        Val* end = regs.data() + regs.size();
+        const RegInsn* i;
+
+#define NANOM_FETCH() i = pc
+
+#ifdef NANOM_THREADED_DISPATCH
+
+        static const void* const dispatch[] = {
+
+#define NANOM_X(o) &&op_##o,
+            NANOM_REG_OPS(NANOM_X)
+#undef NANOM_X
+
+#define NANOM_X(o, e) &&op_R_##o##_RR, &&op_R_##o##_RI,
+            NANOM_REG_BINOPS(NANOM_X)
+#undef NANOM_X
+
+#define NANOM_X(o, e) &&op_R_##o,
+            NANOM_REG_UNOPS(NANOM_X)
+#undef NANOM_X
+        };
+
+        static_assert(sizeof(dispatch) / sizeof(dispatch[0]) == REG_OPCODE_COUNT,
+                      "Dispatch table does not cover all opcodes");
+
+#define NANOM_OP(o) op_##o
+#define NANOM_DISPATCH() do { NANOM_FETCH(); goto *dispatch[i->op]; } while (0)
+
+        NANOM_DISPATCH();
+
+#else
+
+#define NANOM_OP(o) case o
+#define NANOM_DISPATCH() goto dispatch
+
+    dispatch:
+        NANOM_FETCH();
+
+        switch (i->op) {
+
+#endif
+
+#define NANOM_NEXT() do { ++pc; NANOM_DISPATCH(); } while (0)
+
+#define NANOM_X(o, e)                                   \
+        NANOM_OP(R_##o##_RR): {                         \
+            Val x = fb[i->a];                           \
+            Val y = fb[i->b];                           \
+            fb[i->d] = e;                               \
+            NANOM_NEXT();                               \
+        }                                               \
+        NANOM_OP(R_##o##_RI): {                         \
+            Val x = fb[i->a];                           \
+            Val y = i->imm;                             \
+            fb[i->d] = e;                               \
+            NANOM_NEXT();                               \
+        }
+
+        NANOM_REG_BINOPS(NANOM_X)
+#undef NANOM_X
+
+#define NANOM_X(o, e)                                   \
+        NANOM_OP(R_##o): {                              \
+            Val x = fb[i->a];                           \
+            fb[i->d] = e;                               \
+            NANOM_NEXT();                               \
+        }
+
+        NANOM_REG_UNOPS(NANOM_X)
+#undef NANOM_X
+
+        NANOM_OP(R_MOV):
+            fb[i->d] = fb[i->a];
+            NANOM_NEXT();
+
+        NANOM_OP(R_MOVI):
+            fb[i->d] = i->imm;
+            NANOM_NEXT();
+
+        NANOM_OP(R_MOVE):
+            std::copy(fb + i->a, fb + i->a + i->b, fb + i->d);
+            NANOM_NEXT();
+
+        NANOM_OP(R_SWAP):
+            std::swap(fb[i->d], fb[i->a]);
+            NANOM_NEXT();
+
+        NANOM_OP(R_JMP):
+            pc = image + i->b;
+            NANOM_DISPATCH();
+
+        NANOM_OP(R_JMP_IF):
+            if (fb[i->a].uint) {
+                pc = image + i->b;
+                NANOM_DISPATCH();
+            }
+            NANOM_NEXT();
+
+        NANOM_OP(R_JMP_IF_NOT):
+            if (!fb[i->a].uint) {
+                pc = image + i->b;
+                NANOM_DISPATCH();
+            }
+            NANOM_NEXT();
+
+        NANOM_OP(R_JMP_FAIL):
+            if (failbit) {
+                pc = image + i->b;
+                NANOM_DISPATCH();
+            }
+            NANOM_NEXT();
+
+        NANOM_OP(R_JMP_NOT_FAIL):
+            if (!failbit) {
+                pc = image + i->b;
+                NANOM_DISPATCH();
+            }
+            NANOM_NEXT();
+
+        NANOM_OP(R_CALL): {
+            Val* nfb = fb + i->a;
+
+            if (nfb + i->d > end) {
+                throw std::runtime_error("Register VM stack overflow.");
+            }
+
+            frame.emplace_back(pc + 1, fb);
+            fb = nfb;
+
+            failbit = false;
+            pc = image + i->b;
+            NANOM_DISPATCH();
+        }
+
+        NANOM_OP(R_CALL_LIGHT):
+            if (fb + i->d > end) {
+                throw std::runtime_error("Register VM stack overflow.");
+            }
+
+            frame.emplace_back(pc + 1, fb);
+
+            failbit = false;
+            pc = image + i->b;
+            NANOM_DISPATCH();
+
+        NANOM_OP(R_TAILCALL):
+            if (fb + i->d > end) {
+                throw std::runtime_error("Register VM stack overflow.");
+            }
+
+            failbit = false;
+            pc = image + i->b;
+            NANOM_DISPATCH();
+
+        NANOM_OP(R_SYSCALL): {
+            const RegCode::syscall_t& sc = code.syscalls[i->b];
+            Val* args = fb + i->a;
+
+            // The result goes above the frame, then over the arguments.
+            Val* out = fb + i->d;
+
+            if (out + sc.to->size() > end) {
+                throw std::runtime_error("Register VM stack overflow.");
+            }
+
+            Val* prev_top = top;
+            top = out + sc.to->size();
+
+            try {
+                if (timings) {
+                    Timings::scope timer(*timings, sc.label);
+                    failbit = !(*sc.cb)(shapes, *sc.from, *sc.to, ValSpan(args, sc.from->size()), out);
+
+                } else {
+                    failbit = !(*sc.cb)(shapes, *sc.from, *sc.to, ValSpan(args, sc.from->size()), out);
+                }
+
+            } catch (...) {
+                top = prev_top;
+                throw;
+            }
+
+            top = prev_top;
+
+            if (!failbit) {
+                std::copy(out, out + sc.to->size(), args);
+            }
+
+            NANOM_NEXT();
+        }
+
+        NANOM_OP(R_DROP_FRAME):
+            frame.pop_back();
+            NANOM_NEXT();
+
+        NANOM_OP(R_FAIL):
+            failbit = true;
+
+            if (frame.size() == topframe) {
+                frame.pop_back();
+                return;
+            }
+
+            pc = frame.back().ret;
+            fb = frame.back().fb;
+            frame.pop_back();
+            NANOM_DISPATCH();
+
+        NANOM_OP(R_EXIT):
+            failbit = false;
+
+            if (frame.size() == topframe) {
+                frame.pop_back();
+                return;
+            }
+
+            pc = frame.back().ret;
+            fb = frame.back().fb;
+            frame.pop_back();
+            NANOM_DISPATCH();
+
+#ifndef NANOM_THREADED_DISPATCH
+        default:
+            throw std::runtime_error("Sanity error: invalid opcode.");
+        }
+#endif
+
+#undef NANOM_NEXT
+#undef NANOM_DISPATCH
+#undef NANOM_OP
+#undef NANOM_FETCH
+    }
+};
+
+
+inline void reg_compile(const VmCode& code, const Shapes& shapes, RegCode& out) {
+    RegCompiler c(code, shapes, out);
+    c.run();
+}
+
+}
+
+#endif
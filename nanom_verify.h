@@ -0,0 +1,628 @@
+#ifndef __NANOM_VERIFY_H
+#define __NANOM_VERIFY_H
+
+/*
+ * A static verifier for linked nanom code.
+ *
+ * verify() walks every function of VmCode::image once. It proves that jumps
+ * and calls stay inside the image and that control cannot run off the end of
+ * a function. It also proves that the stack height at each opcode is the
+ * same on every path that reaches it, and that no opcode takes more values
+ * than there are. From the heights and the call graph it then works out the
+ * most stack a run of each function can take. Recursion other than tail
+ * calls leaves that unbounded.
+ *
+ * Functions with a bound go into VmCode::verified, and Piccol::run() runs
+ * them with vm_run_unchecked(): the stack is sized once up front, and there
+ * are no bounds checks on the instruction pointer or on stack growth.
+ *
+ * As in the register backend, only a failure check may follow a call. On the
+ * failure path the height is lost, since the callee may have left anything
+ * on the stack; paths that meet with different heights lose it too. A lost
+ * height only allows the opcodes that reset the frame or fail.
+ */
+
+#include "nanom_opt.h"
+
+
+namespace nanom {
+
+struct Verifier {
+
+    const VmCode& code;
+
+    // A call from one function into another whose frame base is 'offset'
+    // values above the caller's.
+    struct edge_t {
+        size_t callee;
+        size_t offset;
+    };
+
+    struct func_t {
+        label_t label;
+        size_t start;
+        size_t end;
+        bool ok;
+        size_t peak;
+        std::vector<edge_t> edges;
+    };
+
+    std::vector<func_t> funcs;
+    std::unordered_map<size_t, size_t> by_start;
+
+    // The starts of the branches, which CALL_LIGHT enters on their caller's frame.
+    std::unordered_set<size_t> light;
+
+    Verifier(const VmCode& c) : code(c) {
+
+        const auto& lay = code.layout;
+
+        for (size_t i = 0; i < lay.size(); ++i) {
+            func_t f;
+            f.label = lay[i].second;
+            f.start = lay[i].first;
+            f.end = (i + 1 < lay.size() ? lay[i + 1].first : code.image.size());
+            f.ok = false;
+            f.peak = 0;
+
+            by_start[f.start] = funcs.size();
+            funcs.push_back(f);
+        }
+
+        for (size_t ip = 0; ip < code.image.size(); ++ip) {
+            const Opcode& c = code.image[ip];
+
+            if (c.op == CALL_LIGHT_DIRECT) {
+                light.insert(c.call_target());
+
+            } else if (c.op == CALL_LIGHT && ip > 0 && code.image[ip-1].op == PUSH) {
+                const label_t& l = code.label_at(ip);
+                auto i = code.entries.find(label_t(code.image[ip-1].arg.uint, l.fromshape, l.toshape));
+
+                if (i != code.entries.end())
+                    light.insert(i->second);
+            }
+        }
+    }
+
+    // The most stack values a run of each function takes above its frame base,
+    // for the functions where that is bounded.
+    std::unordered_map<label_t, size_t> run() {
+
+        for (auto& f : funcs) {
+            f.ok = function(f);
+        }
+
+        const size_t unbounded = std::numeric_limits<size_t>::max();
+
+        std::vector<size_t> depth(funcs.size());
+
+        for (size_t i = 0; i < funcs.size(); ++i) {
+            depth[i] = (funcs[i].ok ? funcs[i].peak : unbounded);
+        }
+
+        // The longest path through the call graph. Whatever still grows after
+        // as many rounds as there are functions is on a growing cycle.
+
+        auto round = [&](bool mark) {
+            bool changed = false;
+
+            for (size_t i = 0; i < funcs.size(); ++i) {
+
+                if (depth[i] == unbounded)
+                    continue;
+
+                size_t d = depth[i];
+
+                for (const auto& e : funcs[i].edges) {
+                    d = (depth[e.callee] == unbounded ? unbounded :
+                         std::max(d, e.offset + depth[e.callee]));
+                }
+
+                if (d != depth[i]) {
+                    depth[i] = (mark ? unbounded : d);
+                    changed = true;
+                }
+            }
+
+            return changed;
+        };
+
+        bool changed = true;
+
+        for (size_t n = 0; changed && n <= funcs.size(); ++n) {
+            changed = round(false);
+        }
+
+        while (changed) {
+            changed = round(true);
+        }
+
+        std::unordered_map<label_t, size_t> ret;
+
+        for (size_t i = 0; i < funcs.size(); ++i) {
+            if (depth[i] != unbounded) {
+                ret[funcs[i].label] = depth[i];
+            }
+        }
+
+        return ret;
+    }
+
+private:
+
+    struct state_t {
+        Int h;
+        bool pending;
+
+        state_t(Int h_ = -1, bool p = false) : h(h_), pending(p) {}
+
+        bool operator==(const state_t& s) const { return h == s.h && pending == s.pending; }
+        bool operator!=(const state_t& s) const { return !(*this == s); }
+    };
+
+    Int size_of(Sym shape) const {
+        return (code.shapes.has_shape(shape) ? (Int)code.shapes.get(shape).size() : -1);
+    }
+
+    bool function(func_t& f) {
+
+        const Int lost = -1;
+        const auto& img = code.image;
+        size_t n = f.end - f.start;
+
+        Int argsize = size_of(f.label.fromshape);
+        Int retsize = size_of(f.label.toshape);
+
+        if (n == 0 || argsize < 0 || retsize < 0)
+            return false;
+
+        std::vector<bool> target(n, false);
+
+        for (size_t i = 0; i < n; ++i) {
+            const Opcode& c = img[f.start + i];
+
+            if (c.is_jump()) {
+                Int t = (Int)i + c.arg.inte;
+
+                if (t < 0 || t >= (Int)n)
+                    return false;
+
+                target[t] = true;
+            }
+        }
+
+        // The n PUSHes before 'i', as the constant operands of the opcode there.
+        auto pushed = [&](size_t i, size_t k) {
+            if (i < k)
+                return false;
+
+            for (size_t j = i - k; j < i; ++j) {
+                if (img[f.start + j].op != PUSH || (j > i - k && target[j]))
+                    return false;
+            }
+            return !target[i];
+        };
+
+        auto arg = [&](size_t i) { return img[f.start + i].arg; };
+
+        std::vector<bool> seen(n, false);
+        std::vector<state_t> st(n);
+        std::vector<size_t> todo;
+        bool ok = true;
+
+        auto flow = [&](size_t i, const state_t& s) {
+            if (i >= n) {
+                ok = false;
+                return;
+            }
+
+            if (!seen[i]) {
+                seen[i] = true;
+                st[i] = s;
+                todo.push_back(i);
+
+            } else if (st[i] != s) {
+                if (st[i].pending != s.pending) {
+                    ok = false;
+
+                } else if (st[i].h != lost) {
+                    st[i].h = lost;
+                    todo.push_back(i);
+                }
+            }
+        };
+
+        auto peak = [&](Int h) {
+            f.peak = std::max(f.peak, (size_t)h);
+        };
+
+        // A call whose callee's frame starts 'offset' values up.
+        auto edge = [&](size_t entry, Int offset) {
+            auto i = by_start.find(entry);
+
+            if (i == by_start.end() || offset < 0) {
+                ok = false;
+                return;
+            }
+
+            f.edges.push_back(edge_t{i->second, (size_t)offset});
+        };
+
+        auto entry_of = [&](const label_t& l) -> size_t {
+            auto i = code.entries.find(l);
+            return (i == code.entries.end() ? img.size() : i->second);
+        };
+
+        peak(argsize);
+        flow(0, state_t(argsize));
+
+        while (ok && !todo.empty()) {
+            size_t i = todo.back();
+            todo.pop_back();
+
+            const Opcode& c = img[f.start + i];
+            state_t s = st[i];
+            Int x = s.h;
+
+            // Where control goes next: 'y' to the following opcode, unless
+            // 'stop', and 'j' to the jump target of jumps.
+            state_t y(lost);
+            state_t j(lost);
+            bool stop = false;
+
+            if (s.pending && c.op != NOOP && c.op != IF_FAIL && c.op != IF_NOT_FAIL &&
+                c.op != EXIT_OR_POP_FRAMETAIL && c.op != FAIL)
+                return false;
+
+            if (x == lost) {
+                switch (c.op) {
+                case DROP_FRAME:
+                    if (!light.count(f.start))
+                        return false;
+                    break;
+                case NOOP: case JUMP: case IF_FAIL: case IF_NOT_FAIL:
+                    break;
+                case FAIL:
+                    stop = true;
+                    break;
+                case POP_FRAMETAIL:
+                    y.h = argsize;
+                    break;
+                case POP_FRAMETAIL_I:
+                    if (c.arg.inte < 0)
+                        return false;
+
+                    y.h = c.arg.inte;
+                    peak(y.h);
+                    break;
+                default:
+                    return false;
+                }
+
+                if (c.is_jump())
+                    flow(i + c.arg.inte, y);
+
+                if (!stop)
+                    flow(i + 1, y);
+
+                continue;
+            }
+
+            Int d;
+            Int need = 0;
+
+            switch (c.op) {
+            case DROP_FRAME:
+                if (!light.count(f.start))
+                    return false;
+
+                y = s;
+                break;
+
+            case NOOP:
+            case JUMP:
+                y = j = s;
+                break;
+
+            case PUSH:
+                y.h = x + 1;
+                break;
+
+            case POP:
+                need = 1;
+                y.h = x - 1;
+                break;
+
+            case SWAP:
+                need = 2;
+                y.h = x;
+                break;
+
+            case IF:
+            case IF_NOT:
+                need = 1;
+                y.h = j.h = x - 1;
+                break;
+
+            // After a call the failure path has lost its height.
+            case IF_FAIL:
+                y.h = x;
+                j.h = (s.pending ? lost : x);
+                break;
+
+            case IF_NOT_FAIL:
+                y.h = (s.pending ? lost : x);
+                j.h = x;
+                break;
+
+            case EXIT_OR_POP_FRAMETAIL:
+                if (x != retsize)
+                    return false;
+
+                y.h = argsize;
+                break;
+
+            case FAIL:
+                stop = true;
+                break;
+
+            case EXIT:
+                if (x != retsize)
+                    return false;
+
+                stop = true;
+                break;
+
+            case POP_FRAMEHEAD:
+                need = argsize;
+                y.h = x - argsize;
+                break;
+
+            case POP_FRAMEHEAD_EXIT:
+                if (x - argsize != retsize)
+                    return false;
+
+                stop = true;
+                break;
+
+            case POP_FRAMETAIL:
+                y.h = argsize;
+                break;
+
+            case POP_FRAMETAIL_I:
+                if (c.arg.inte < 0)
+                    return false;
+
+                y.h = c.arg.inte;
+                break;
+
+            case CALL:
+            case SYSCALL:
+            case TAILCALL: {
+                if (!pushed(i, 3))
+                    return false;
+
+                label_t l(arg(i-3).uint, arg(i-2).uint, arg(i-1).uint);
+                Int a = size_of(l.fromshape);
+                Int r = size_of(l.toshape);
+                Int base = x - 3 - a;
+
+                if (a < 0 || r < 0)
+                    return false;
+
+                need = 3 + a;
+
+                if (c.op == CALL) {
+                    edge(entry_of(l), base);
+                    y = state_t(base + r, true);
+
+                } else if (c.op == TAILCALL) {
+                    if (base != argsize || r != retsize)
+                        return false;
+
+                    edge(entry_of(l), 0);
+                    stop = true;
+
+                } else {
+                    if (code.callbacks.find(l) == code.callbacks.end())
+                        return false;
+
+                    peak(base + a + r);
+                    y = state_t(base + r, true);
+                }
+                break;
+            }
+
+            case CALL_DIRECT:
+            case TAILCALL_DIRECT: {
+                size_t t = c.call_target();
+
+                if (t >= img.size())
+                    return false;
+
+                Int a = (Int)c.call_argsize();
+                Int r = size_of(code.label_at(t).toshape);
+
+                if (a != size_of(code.label_at(t).fromshape) || r < 0)
+                    return false;
+
+                need = a;
+
+                if (c.op == CALL_DIRECT) {
+                    edge(t, x - a);
+                    y = state_t(x - a + r, true);
+
+                } else {
+                    if (x - a != argsize || r != retsize)
+                        return false;
+
+                    edge(t, 0);
+                    stop = true;
+                }
+                break;
+            }
+
+            case TAILCALL_SELF:
+                if (i + c.arg.inte != 0)
+                    return false;
+
+                if (x != 2 * argsize)
+                    return false;
+
+                edge(f.start, 0);
+                stop = true;
+                break;
+
+            case CALL_LIGHT:
+            case CALL_LIGHT_DIRECT: {
+                size_t t;
+                Int k = 0;
+
+                if (c.op == CALL_LIGHT) {
+                    if (!pushed(i, 1))
+                        return false;
+
+                    k = 1;
+                    t = entry_of(label_t(arg(i-1).uint, f.label.fromshape, f.label.toshape));
+
+                } else {
+                    t = c.call_target();
+                }
+
+                // A branch shares the frame, and the shapes, of its caller.
+                if (t >= img.size() || code.label_at(t).fromshape != f.label.fromshape ||
+                    code.label_at(t).toshape != f.label.toshape)
+                    return false;
+
+                if (x - k != argsize)
+                    return false;
+
+                edge(t, 0);
+                y = state_t(retsize, true);
+                break;
+            }
+
+            case SYSCALL_DIRECT: {
+                if (c.arg.uint >= code.syscalls.size())
+                    return false;
+
+                const label_t& l = code.syscalls[c.arg.uint].label;
+                Int a = size_of(l.fromshape);
+                Int r = size_of(l.toshape);
+
+                if (a < 0 || r < 0)
+                    return false;
+
+                need = a;
+                peak(x + r);
+                y = state_t(x - a + r, true);
+                break;
+            }
+
+            case NEW_STRUCT_I:
+                if (c.arg.inte < 0)
+                    return false;
+
+                y.h = x + c.arg.inte;
+                break;
+
+            case NEW_STRUCT:
+                if (!pushed(i, 1) || arg(i-1).inte < 0)
+                    return false;
+
+                need = 1;
+                y.h = x - 1 + arg(i-1).inte;
+                break;
+
+            case GET_FRAMEHEAD_FIELDS_I:
+            case GET_FRAMEHEAD_FIELDS: {
+                Int k = (c.op == GET_FRAMEHEAD_FIELDS ? 2 : 0);
+
+                if (k > 0 && !pushed(i, 2))
+                    return false;
+
+                Int b = (k > 0 ? arg(i-2).inte : (Int)c.packed_a());
+                Int e = (k > 0 ? arg(i-1).inte : (Int)c.packed_b());
+
+                if (b < 0 || b > e)
+                    return false;
+
+                need = k + e;
+                y.h = x - k + e - b;
+                break;
+            }
+
+            case GET_FIELDS_I:
+            case GET_FIELDS:
+            case SET_FIELDS_I:
+            case SET_FIELDS: {
+                Int k = (c.op == GET_FIELDS || c.op == SET_FIELDS ? 3 : 0);
+
+                if (k > 0 && !pushed(i, 3))
+                    return false;
+
+                Int b = (k > 0 ? arg(i-3).inte : (Int)c.packed_a());
+                Int e = (k > 0 ? arg(i-2).inte : (Int)c.packed_b());
+                Int size = (k > 0 ? arg(i-1).inte : (Int)c.packed_c());
+
+                if (b < 0 || b > e || e > size)
+                    return false;
+
+                if (c.op == GET_FIELDS || c.op == GET_FIELDS_I) {
+                    need = k + size;
+                    y.h = x - k - size + e - b;
+
+                } else {
+                    need = k + size + (e - b);
+                    y.h = x - k - (e - b);
+                }
+                break;
+            }
+
+            case FAIL_UNLESS:
+                need = 1;
+                y.h = x - 1;
+                break;
+
+            default:
+                if (is_fail_unless_compare(c.op)) {
+                    need = 2;
+                    y.h = x - 2;
+
+                } else if (arith_effect(c.op, d)) {
+                    need = (d < 0 ? 2 : 1);
+                    y.h = x + d;
+
+                } else {
+                    return false;
+                }
+                break;
+            }
+
+            if (x < need)
+                return false;
+
+            if (y.h != lost)
+                peak(y.h);
+
+            if (c.is_jump() && c.op != TAILCALL_SELF)
+                flow(i + c.arg.inte, j);
+
+            if (!stop && c.op != JUMP)
+                flow(i + 1, y);
+        }
+
+        return ok;
+    }
+};
+
+// Fills in VmCode::verified; run after every link().
+
+inline void verify(VmCode& code) {
+    code.verified = Verifier(code).run();
+}
+
+}
+
+#endif
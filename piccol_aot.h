@@ -0,0 +1,859 @@
+#ifndef __PICCOL_AOT_H
+#define __PICCOL_AOT_H
+
+/*
+ * Ahead-of-time translation of Piccol programs into C++.
+ *
+ * AotWriter turns the linked image of a loaded program into a C++ source file
+ * (see utils/piccol_aot), with one C++ function per Piccol function. The
+ * generated file defines a loader function which installs the functions, the
+ * shapes and a table of the callbacks they call into an AotModule; the host
+ * then registers its callbacks and calls run() as it would with a Piccol
+ * instance, without the lexer, morpher, emitter and assembler ever running.
+ *
+ * The generated code follows the stack VM exactly: structs are runs of values
+ * on the AotModule's stack arena, failure is a return code, and tail calls
+ * return to a loop in the caller instead of growing the C++ stack.
+ */
+
+#include "nanom.h"
+
+#include <map>
+#include <set>
+#include <sstream>
+#include <iomanip>
+
+
+namespace piccol {
+
+using namespace nanom;
+
+struct AotModule;
+struct aot_ret;
+
+typedef aot_ret (*aot_fn)(AotModule& m, Val*& fb, size_t& fsize);
+
+// How a generated function returned. For AOT_TAIL, 'tail' is the function to
+// continue with in the same frame. AOT_DROPPED means the function dropped its
+// caller's frame, so the caller must return in turn.
+
+enum {
+    AOT_EXIT = 0,
+    AOT_FAIL = 1,
+    AOT_TAIL = 2,
+    AOT_DROPPED = 4
+};
+
+struct aot_ret {
+    aot_fn tail;
+    int kind;
+};
+
+
+struct AotModule {
+
+    Shapes shapes;
+    Stack stack;
+
+    std::unordered_map<label_t, aot_fn> functions;
+    std::unordered_map<label_t, Callback> callbacks;
+
+    // The callbacks the generated code calls, by the index it passes to
+    // syscall(). The shapes are resolved as the loader adds an entry, the
+    // callback when both the entry and the callback are there.
+    struct syscall_t {
+        label_t label;
+        const Callback* cb;
+        const Shape* from;
+        const Shape* to;
+    };
+
+    std::vector<syscall_t> syscalls;
+    std::unordered_map<label_t, size_t> syscallix;
+
+    AotModule(size_t stack_capacity = Stack::DEFAULT_CAPACITY) : stack(stack_capacity) {}
+
+    void register_callback(const std::string& name, const std::string& from, const std::string& to,
+                           Callback cb) {
+
+        label_t l(symtab().get(name), symtab().get(from), symtab().get(to));
+
+        if (callbacks.find(l) != callbacks.end()) {
+            throw std::runtime_error("Callback registered twice: " + l.print());
+        }
+
+        callbacks[l] = cb;
+
+        auto i = syscallix.find(l);
+
+        if (i != syscallix.end()) {
+            syscalls[i->second].cb = &callbacks[l];
+        }
+    }
+
+    void register_callback(const std::string& name, const std::string& from, const std::string& to,
+                           span_callback_t cb) {
+        register_callback(name, from, to, Callback(cb));
+    }
+
+    void register_callback(const std::string& name, const std::string& from, const std::string& to,
+                           callback_t cb) {
+
+        label_t l(symtab().get(name), symtab().get(from), symtab().get(to));
+        register_callback(name, from, to, adapt_callback(l, cb));
+    }
+
+    // A typed callback, see nanom::typed_callback. The shapes are checked
+    // here, so the loader must have run first.
+    template <typename SIG, typename F>
+    void register_callback(const std::string& name, F fn) {
+
+        typedef typed_callback<SIG> tc;
+
+        check_callback_shape(shapes, name, tc::from_shape(), tc::from_types());
+        check_callback_shape(shapes, name, tc::to_shape(), tc::to_types());
+
+        register_callback(name, tc::from_shape(), tc::to_shape(), tc::make(fn));
+    }
+
+    // Used by the generated loaders.
+
+    void add_function(const label_t& l, aot_fn f) {
+
+        if (functions.find(l) != functions.end()) {
+            throw std::runtime_error("Function defined twice: " + l.print());
+        }
+
+        functions[l] = f;
+    }
+
+    struct field_t {
+        Sym name;
+        Type type;
+        Sym shape;
+    };
+
+    void add_shape(Sym name, std::initializer_list<field_t> fields) {
+
+        if (shapes.has_shape(name))
+            return;
+
+        Shape sh;
+
+        for (const auto& f : fields) {
+            sh.add_field(f.name, f.type, f.shape, (f.type == STRUCT ? shapes.get(f.shape).size() : 0));
+        }
+
+        shapes.add(name, sh);
+    }
+
+    // 'ix' is the loader's own table of indices, filled in on the first
+    // call; a loader run on several modules must get the same ones from each.
+    void add_syscalls(std::initializer_list<label_t> labels, size_t* ix, bool& loaded) {
+
+        for (const label_t& l : labels) {
+
+            auto i = syscallix.find(l);
+
+            if (i == syscallix.end()) {
+                auto j = callbacks.find(l);
+
+                i = syscallix.insert(i, std::make_pair(l, syscalls.size()));
+                syscalls.push_back(syscall_t{l, (j == callbacks.end() ? nullptr : &(j->second)),
+                                             &shapes.get(l.fromshape), &shapes.get(l.toshape)});
+            }
+
+            if (loaded && *ix != i->second) {
+                throw std::runtime_error("Loader run on modules with different callbacks: " + l.print());
+            }
+
+            *ix++ = i->second;
+        }
+
+        loaded = true;
+    }
+
+    // Used by the generated code.
+
+    aot_ret settle(aot_ret r, Val*& fb, size_t& fsize) {
+
+        while (r.kind == AOT_TAIL) {
+            r = r.tail(*this, fb, fsize);
+        }
+
+        if (r.kind & AOT_DROPPED) {
+            throw std::runtime_error("Sanity error: function dropped its caller's frame.");
+        }
+
+        return r;
+    }
+
+    bool syscall(Val*& top) {
+        Sym totype = (--top)->uint;
+        Sym fromtype = (--top)->uint;
+        Sym name = (--top)->uint;
+
+        return syscall(top, label_t(name, fromtype, totype));
+    }
+
+    bool syscall(Val*& top, const label_t& l) {
+
+        auto j = callbacks.find(l);
+
+        if (j == callbacks.end()) {
+            throw std::runtime_error("Callback '" + l.print() + "' undefined");
+        }
+
+        return syscall(top, j->second, shapes.get(l.fromshape), shapes.get(l.toshape));
+    }
+
+    bool syscall(Val*& top, size_t ix) {
+
+        const syscall_t& sc = syscalls[ix];
+
+        if (sc.cb == nullptr) {
+            throw std::runtime_error("Callback '" + sc.label.print() + "' undefined");
+        }
+
+        return syscall(top, *sc.cb, *sc.from, *sc.to);
+    }
+
+    bool syscall(Val*& top, const Callback& cb, const Shape& from, const Shape& to) {
+
+        Val* args = top - from.size();
+
+        stack.top = top;
+        Val* out = stack.grow(to.size());
+
+        bool ok = cb(shapes, from, to, ValSpan(args, from.size()), out);
+
+        if (ok) {
+            std::copy(out, out + to.size(), args);
+        }
+
+        top = args + (ok ? to.size() : 0);
+        stack.top = top;
+
+        return ok;
+    }
+
+    // Same contract as Piccol::run().
+
+    bool run(Sym name, Sym s1, Sym s2, const Struct& in, Struct& out) {
+
+        label_t l(name, s1, s2);
+        auto i = functions.find(l);
+
+        if (i == functions.end()) {
+            throw std::runtime_error("Undefined function: " + l.print());
+        }
+
+        size_t framehead = stack.size();
+        stack.insert(stack.end(), in.v.begin(), in.v.end());
+
+        Val* fb = stack.base + framehead;
+        size_t fsize = in.v.size();
+        aot_ret r;
+
+        try {
+            r = settle(i->second(*this, fb, fsize), fb, fsize);
+
+        } catch (...) {
+            stack.resize(framehead);
+            throw;
+        }
+
+        out.v.assign(stack.begin() + framehead, stack.end());
+        stack.resize(framehead);
+
+        return (r.kind == AOT_EXIT);
+    }
+
+    bool run(const std::string& name, const std::string& fr, const std::string& to, Struct& out) {
+        return run(symtab().get(name), symtab().get(fr), symtab().get(to), Struct(), out);
+    }
+
+    bool run(const std::string& name, const std::string& fr, const std::string& to,
+             const Struct& in, Struct& out) {
+        return run(symtab().get(name), symtab().get(fr), symtab().get(to), in, out);
+    }
+};
+
+
+inline void aot_grow(AotModule& m, Val* top, size_t n) {
+    if (n > (size_t)(m.stack.limit - top)) {
+        m.stack.top = top;
+        m.stack.grow(n);
+    }
+}
+
+
+// Writes the C++ translation of every function in a linked VmCode.
+
+struct AotWriter {
+
+    const VmCode& code;
+
+    std::vector<std::string> syms;
+    std::unordered_map<Sym, size_t> symix;
+
+    std::map<size_t, size_t> funcs;
+
+    // Index into the loader's syscall table, by VmCode::syscalls index.
+    std::map<size_t, size_t> callix;
+
+    AotWriter(const VmCode& c) : code(c) {}
+
+    static std::string quote(const std::string& s) {
+        std::ostringstream ret;
+        ret << '"';
+
+        for (unsigned char c : s) {
+            if (c == '"' || c == '\\') {
+                ret << '\\' << c;
+
+            } else if (c < 32 || c > 126) {
+                ret << "\\" << std::oct << std::setw(3) << std::setfill('0') << (int)c << std::dec;
+
+            } else {
+                ret << c;
+            }
+        }
+
+        ret << '"';
+        return ret.str();
+    }
+
+    static std::string hex(UInt v) {
+        std::ostringstream ret;
+        ret << "0x" << std::hex << v << "ULL";
+        return ret.str();
+    }
+
+    std::string sym(Sym s) {
+        auto i = symix.find(s);
+
+        if (i == symix.end()) {
+            i = symix.insert(i, std::make_pair(s, syms.size()));
+            syms.push_back(symtab().get(s));
+        }
+
+        return "S[" + std::to_string(i->second) + "]";
+    }
+
+    std::string fname(size_t entry) const {
+        auto i = funcs.find(entry);
+
+        if (i == funcs.end()) {
+            throw std::runtime_error("Call to a non-function offset " + std::to_string(entry));
+        }
+
+        return "f" + std::to_string(i->second);
+    }
+
+    static const char* binop(op_t op) {
+        switch (op) {
+        case ADD_INT:  return "(Int)(v1.uint + v2.uint)";
+        case SUB_INT:  return "(Int)(v1.uint - v2.uint)";
+        case MUL_INT:  return "(Int)(v1.uint * v2.uint)";
+        case DIV_INT:  return "v1.inte / v2.inte";
+        case MOD_INT:  return "v1.inte % v2.inte";
+        case ADD_UINT: return "v1.uint + v2.uint";
+        case SUB_UINT: return "v1.uint - v2.uint";
+        case MUL_UINT: return "v1.uint * v2.uint";
+        case DIV_UINT: return "v1.uint / v2.uint";
+        case MOD_UINT: return "v1.uint % v2.uint";
+        case ADD_REAL: return "v1.real + v2.real";
+        case SUB_REAL: return "v1.real - v2.real";
+        case MUL_REAL: return "v1.real * v2.real";
+        case DIV_REAL: return "v1.real / v2.real";
+        case BAND:     return "v1.uint & v2.uint";
+        case BOR:      return "v1.uint | v2.uint";
+        case BXOR:     return "v1.uint ^ v2.uint";
+        case BSHL:     return "v1.uint << v2.uint";
+        case BSHR:     return "v1.uint >> v2.uint";
+        case EQ_INT:   return "(Int)(v1.inte == v2.inte)";
+        case LT_INT:   return "(Int)(v1.inte < v2.inte)";
+        case LTE_INT:  return "(Int)(v1.inte <= v2.inte)";
+        case GT_INT:   return "(Int)(v1.inte > v2.inte)";
+        case GTE_INT:  return "(Int)(v1.inte >= v2.inte)";
+        case EQ_UINT:  return "(Int)(v1.uint == v2.uint)";
+        case LT_UINT:  return "(Int)(v1.uint < v2.uint)";
+        case LTE_UINT: return "(Int)(v1.uint <= v2.uint)";
+        case GT_UINT:  return "(Int)(v1.uint > v2.uint)";
+        case GTE_UINT: return "(Int)(v1.uint >= v2.uint)";
+        case EQ_REAL:  return "(Int)(v1.real == v2.real)";
+        case LT_REAL:  return "(Int)(v1.real < v2.real)";
+        case LTE_REAL: return "(Int)(v1.real <= v2.real)";
+        case GT_REAL:  return "(Int)(v1.real > v2.real)";
+        case GTE_REAL: return "(Int)(v1.real >= v2.real)";
+        default:       return nullptr;
+        }
+    }
+
+    static const char* unop(op_t op) {
+        switch (op) {
+        case NEG_INT:      return "(Int)(0 - v.uint)";
+        case NEG_REAL:     return "-v.real";
+        case BNOT:         return "~v.uint";
+        case BOOL_NOT:     return "(UInt)!(v.uint)";
+        case INT_TO_REAL:  return "(Real)v.inte";
+        case REAL_TO_INT:  return "(Int)v.real";
+        case UINT_TO_REAL: return "(Real)v.uint";
+        case REAL_TO_UINT: return "(UInt)v.real";
+        default:           return nullptr;
+        }
+    }
+
+    // True if the opcode at ip + n is 'op', preceded by n numeric PUSHes starting at
+    // 'ip' that nothing jumps into: they are folded into its translation.
+
+    bool const_args(size_t ip, size_t n, op_t op, size_t end, const std::set<size_t>& targets) const {
+        if (ip + n >= end || code.image[ip + n].op != op)
+            return false;
+
+        for (size_t i = ip; i < ip + n; ++i) {
+            if (code.image[i].op != PUSH || code.image[i].sym)
+                return false;
+        }
+
+        for (size_t i = ip + 1; i <= ip + n; ++i) {
+            if (targets.count(i))
+                return false;
+        }
+        return true;
+    }
+
+    // The field opcodes with constant operands.
+
+    static void getframehead(std::ostream& os, UInt b, UInt e) {
+        os << "aot_grow(m, top, " << e - b << "); "
+           << "top = std::copy(fb + " << b << ", fb + " << e << ", top);";
+    }
+
+    static void getfields(std::ostream& os, UInt b, UInt e, UInt size) {
+        if (b != 0) {
+            os << "std::copy(top - " << size - b << ", top - " << size - e
+               << ", top - " << size << "); ";
+        }
+
+        os << "top -= " << size - (e - b) << ";";
+    }
+
+    static void setfields(std::ostream& os, UInt b, UInt e, UInt size) {
+        os << "std::copy(top - " << e - b << ", top, top - " << (e - b) + size - b
+           << "); top -= " << e - b << ";";
+    }
+
+    static void newstruct(std::ostream& os, UInt n) {
+        os << "aot_grow(m, top, " << n << "); top = std::fill_n(top, " << n << ", Val());";
+    }
+
+    static std::string ret(const std::string& kind, bool drops) {
+        return "m.stack.top = top; return aot_ret{nullptr, " + kind +
+            (drops ? " | (dropped ? AOT_DROPPED : 0)" : "") + "};";
+    }
+
+    void function(std::ostream& os, const label_t& l, size_t start, size_t end) {
+
+        const auto& img = code.image;
+
+        std::set<size_t> targets;
+        bool drops = false;
+        bool fails = false;
+
+        for (size_t ip = start; ip < end; ++ip) {
+            const Opcode& c = img[ip];
+
+            if (c.is_jump()) {
+                size_t t = ip + c.arg.inte;
+
+                if (t < start || t >= end)
+                    throw std::runtime_error("Jump out of " + l.print());
+
+                targets.insert(t);
+            }
+
+            if (c.op == DROP_FRAME)
+                drops = true;
+
+            if (c.op == IF_FAIL || c.op == IF_NOT_FAIL || c.op == EXIT_OR_POP_FRAMETAIL)
+                fails = true;
+        }
+
+        os << "\n// " << l.print() << "\n\n"
+           << "aot_ret " << fname(start) << "(AotModule& m, Val*& fb, size_t& fsize) {\n"
+           << "    Val* top = m.stack.top;\n";
+
+        if (fails)
+            os << "    bool fail = false;\n";
+
+        if (drops)
+            os << "    bool dropped = false;\n";
+
+        os << "\n";
+
+        std::string fset = (fails ? "fail = " : "");
+
+        size_t ip = start;
+
+        while (ip < end) {
+
+            const Opcode& c = img[ip];
+
+            if (targets.count(ip)) {
+                os << " L" << ip << ":\n";
+            }
+
+            os << "    ";
+
+            size_t next = ip + 1;
+
+            switch (c.op) {
+            case NOOP:
+                os << ";";
+                break;
+
+            case PUSH:
+                if (const_args(ip, 2, GET_FRAMEHEAD_FIELDS, end, targets)) {
+                    getframehead(os, c.arg.uint, img[ip+1].arg.uint);
+                    next = ip + 3;
+
+                } else if (const_args(ip, 3, GET_FIELDS, end, targets)) {
+                    getfields(os, c.arg.uint, img[ip+1].arg.uint, img[ip+2].arg.uint);
+                    next = ip + 4;
+
+                } else if (const_args(ip, 3, SET_FIELDS, end, targets)) {
+                    setfields(os, c.arg.uint, img[ip+1].arg.uint, img[ip+2].arg.uint);
+                    next = ip + 4;
+
+                } else if (const_args(ip, 1, NEW_STRUCT, end, targets)) {
+                    newstruct(os, c.arg.uint);
+                    next = ip + 2;
+
+                } else {
+                    os << "aot_grow(m, top, 1); (top++)->uint = "
+                       << (c.sym ? sym(c.arg.uint) : hex(c.arg.uint)) << ";";
+                }
+                break;
+
+            case POP:
+                os << "--top;";
+                break;
+
+            case SWAP:
+                os << "std::swap(top[-1], top[-2]);";
+                break;
+
+            case IF:
+                os << "if ((--top)->uint) goto L" << ip + c.arg.inte << ";";
+                break;
+
+            case IF_NOT:
+                os << "if (!(--top)->uint) goto L" << ip + c.arg.inte << ";";
+                break;
+
+            case IF_FAIL:
+                os << "if (fail) goto L" << ip + c.arg.inte << ";";
+                break;
+
+            case IF_NOT_FAIL:
+                os << "if (!fail) goto L" << ip + c.arg.inte << ";";
+                break;
+
+            case JUMP:
+                os << "goto L" << ip + c.arg.inte << ";";
+                break;
+
+            case TAILCALL_SELF:
+                os << "top = std::copy(fb + fsize, top, fb); fb = top - fsize; "
+                   << (fails ? "fail = false; " : "") << "goto L" << ip + c.arg.inte << ";";
+                break;
+
+            case POP_FRAMEHEAD:
+                os << "top = std::copy(fb + fsize, top, fb);";
+                break;
+
+            case POP_FRAMETAIL:
+                os << "top = fb + fsize;";
+                break;
+
+            case POP_FRAMETAIL_I:
+                os << "top = fb + " << c.arg.uint << ";";
+                break;
+
+            case DROP_FRAME:
+                os << "{ if (dropped) throw std::runtime_error(\"Sanity error: frame dropped twice.\"); "
+                   << "dropped = true; }";
+                break;
+
+            case EXIT:
+                os << ret("AOT_EXIT", drops);
+                break;
+
+            case FAIL:
+                os << ret("AOT_FAIL", drops);
+                break;
+
+            case CALL_DIRECT:
+                os << "{ m.stack.top = top; "
+                   << "Val* cfb = top - " << c.call_argsize() << "; size_t cfs = " << c.call_argsize() << "; "
+                   << "aot_ret r = m.settle(" << fname(c.call_target()) << "(m, cfb, cfs), cfb, cfs); "
+                   << "top = m.stack.top; " << fset << "(r.kind == AOT_FAIL); }";
+                break;
+
+            case CALL_LIGHT_DIRECT:
+                os << "{ m.stack.top = top; Val* bfb = fb; size_t bfs = fsize; "
+                   << "aot_ret r = " << fname(c.call_target()) << "(m, bfb, bfs); "
+                   << "if (r.kind & AOT_DROPPED) { fb = bfb; fsize = bfs; r.kind &= ~AOT_DROPPED; "
+                   << (drops ? "if (dropped) r.kind |= AOT_DROPPED; " : "") << "return r; } "
+                   << "r = m.settle(r, bfb, bfs); "
+                   << "top = m.stack.top; " << fset << "(r.kind == AOT_FAIL); }";
+                break;
+
+            case TAILCALL_DIRECT:
+                os << "top = std::copy(fb + fsize, top, fb); "
+                   << "fb = top - " << c.call_argsize() << "; fsize = " << c.call_argsize() << "; "
+                   << "m.stack.top = top; return aot_ret{" << fname(c.call_target()) << ", AOT_TAIL"
+                   << (drops ? " | (dropped ? AOT_DROPPED : 0)" : "") << "};";
+                break;
+
+            case SYSCALL:
+                os << fset << "!m.syscall(top);";
+                break;
+
+            case NEW_STRUCT:
+                os << "{ UInt n = (--top)->uint; aot_grow(m, top, n); top = std::fill_n(top, n, Val()); }";
+                break;
+
+            case SET_FIELDS:
+                os << "{ UInt size = (--top)->uint; UInt e = (--top)->uint; UInt b = (--top)->uint; "
+                   << "std::copy(top - (e - b), top, top - (e - b) - size + b); top -= (e - b); }";
+                break;
+
+            case GET_FIELDS:
+                os << "{ UInt size = (--top)->uint; UInt e = (--top)->uint; UInt b = (--top)->uint; "
+                   << "Val* st = top - size; std::copy(st + b, st + e, st); top = st + (e - b); }";
+                break;
+
+            case GET_FRAMEHEAD_FIELDS:
+                os << "{ UInt e = (--top)->uint; UInt b = (--top)->uint; "
+                   << "aot_grow(m, top, e - b); top = std::copy(fb + b, fb + e, top); }";
+                break;
+
+            case SYSCALL_DIRECT: {
+                auto i = callix.insert(std::make_pair((size_t)c.arg.uint, callix.size())).first;
+                os << fset << "!m.syscall(top, C[" << i->second << "]);";
+                break;
+            }
+
+            case GET_FRAMEHEAD_FIELDS_I:
+                getframehead(os, c.packed_a(), c.packed_b());
+                break;
+
+            case GET_FIELDS_I:
+                getfields(os, c.packed_a(), c.packed_b(), c.packed_c());
+                break;
+
+            case SET_FIELDS_I:
+                setfields(os, c.packed_a(), c.packed_b(), c.packed_c());
+                break;
+
+            case NEW_STRUCT_I:
+                newstruct(os, c.arg.uint);
+                break;
+
+            case ADD_INT_I:
+            case SUB_INT_I:
+            case MUL_INT_I:
+            case DIV_INT_I:
+            case MOD_INT_I:
+                os << "{ Val v2 = (Int)" << hex(c.arg.uint) << "; Val& v1 = top[-1]; v1 = "
+                   << binop((op_t)(ADD_INT + (c.op - ADD_INT_I))) << "; }";
+                break;
+
+            case DIV_INT_POW2:
+            case MOD_INT_POW2:
+                os << "top[-1] = top[-1].inte " << (c.op == DIV_INT_POW2 ? "/" : "%")
+                   << " (Int)" << hex((UInt)1 << c.arg.uint) << ";";
+                break;
+
+            case FAIL_UNLESS:
+                os << "if (!(--top)->uint) { " << ret("AOT_FAIL", drops) << " }";
+                break;
+
+            case POP_FRAMEHEAD_EXIT:
+                os << "top = std::copy(fb + fsize, top, fb); " << ret("AOT_EXIT", drops);
+                break;
+
+            case EXIT_OR_POP_FRAMETAIL:
+                os << "if (!fail) { " << ret("AOT_EXIT", drops) << " } top = fb + fsize;";
+                break;
+
+            default:
+                if (is_fail_unless_compare(c.op)) {
+                    os << "{ top -= 2; Val v1 = top[0]; Val v2 = top[1]; if (!"
+                       << binop(fail_unless_compare(c.op)) << ") { " << ret("AOT_FAIL", drops) << " } }";
+
+                } else if (binop(c.op)) {
+                    os << "{ Val v2 = *--top; Val& v1 = top[-1]; v1 = " << binop(c.op) << "; }";
+
+                } else if (unop(c.op)) {
+                    os << "{ Val& v = top[-1]; v = " << unop(c.op) << "; }";
+
+                } else {
+                    throw std::runtime_error("Cannot translate " + opcodename(c.op) + " in " + l.print());
+                }
+                break;
+            }
+
+            os << "\n";
+            ip = next;
+        }
+
+        os << "    throw std::runtime_error(\"Sanity error: end of function reached.\");\n"
+           << "}\n";
+    }
+
+    // Shapes in an order where each one comes after the shapes of its fields.
+
+    void shape_order(Sym s, std::set<Sym>& seen, std::vector<Sym>& out) const {
+
+        if (seen.count(s))
+            return;
+
+        seen.insert(s);
+
+        for (const auto& f : code.shapes.get(s).sym2field) {
+            if (f.second.type == STRUCT)
+                shape_order(f.second.shape, seen, out);
+        }
+
+        out.push_back(s);
+    }
+
+    static const char* type_name(Type t) {
+        switch (t) {
+        case BOOL:   return "BOOL";
+        case SYMBOL: return "SYMBOL";
+        case INT:    return "INT";
+        case UINT:   return "UINT";
+        case REAL:   return "REAL";
+        case STRUCT: return "STRUCT";
+        default:     return "NONE";
+        }
+    }
+
+    void write(std::ostream& out, const std::string& loader, const std::string& source) {
+
+        const label_t toplevel = VmCode::toplevel_label();
+
+        std::vector< std::pair<size_t, label_t> > fl;
+
+        for (const auto& i : code.layout) {
+            if (i.second == toplevel)
+                continue;
+
+            funcs[i.first] = fl.size();
+            fl.push_back(i);
+        }
+
+        std::ostringstream body;
+
+        for (size_t n = 0; n < fl.size(); ++n) {
+            size_t end = (n + 1 < fl.size() ? fl[n+1].first : code.image.size());
+
+            for (const auto& i : code.layout) {
+                if (i.first > fl[n].first && i.first < end)
+                    end = i.first;
+            }
+
+            function(body, fl[n].second, fl[n].first, end);
+        }
+
+        std::ostringstream init;
+
+        std::vector<Sym> order;
+        std::set<Sym> seen;
+
+        for (const auto& i : code.shapes.shapes) {
+            shape_order(i.first, seen, order);
+        }
+
+        for (Sym s : order) {
+            const Shape& sh = code.shapes.get(s);
+
+            std::vector< std::pair<Sym, Shape::typeinfo> > fields(sh.sym2field.begin(), sh.sym2field.end());
+
+            std::sort(fields.begin(), fields.end(),
+                      [](const std::pair<Sym, Shape::typeinfo>& a, const std::pair<Sym, Shape::typeinfo>& b) {
+                          return std::make_pair(a.second.ix_from, a.second.ix_to) <
+                                 std::make_pair(b.second.ix_from, b.second.ix_to);
+                      });
+
+            init << "    m.add_shape(" << sym(s) << ", {";
+
+            for (size_t n = 0; n < fields.size(); ++n) {
+                const auto& f = fields[n];
+                init << (n ? ", " : " ") << "{" << sym(f.first) << ", " << type_name(f.second.type) << ", "
+                     << (f.second.type == STRUCT ? sym(f.second.shape) : std::string("0")) << "}";
+            }
+
+            init << (fields.empty() ? "" : " ") << "});\n";
+        }
+
+        if (!callix.empty()) {
+            std::vector<size_t> calls(callix.size());
+
+            for (const auto& i : callix) {
+                calls[i.second] = i.first;
+            }
+
+            init << "\n    m.add_syscalls({";
+
+            for (size_t n = 0; n < calls.size(); ++n) {
+                const label_t& l = code.syscalls[calls[n]].label;
+                init << (n ? ",\n                    " : " ") << "label_t(" << sym(l.name) << ", "
+                     << sym(l.fromshape) << ", " << sym(l.toshape) << ")";
+            }
+
+            init << " }, C, loaded);\n";
+        }
+
+        init << "\n";
+
+        for (const auto& i : fl) {
+            init << "    m.add_function(label_t(" << sym(i.second.name) << ", " << sym(i.second.fromshape)
+                 << ", " << sym(i.second.toshape) << "), " << fname(i.first) << ");\n";
+        }
+
+        out << "// Generated by utils/piccol_aot from " << source << "; do not edit.\n\n"
+            << "#include \"piccol_aot.h\"\n\n"
+            << "using namespace piccol;\n\n"
+            << "namespace {\n\n"
+            << "Sym S[" << std::max((size_t)1, syms.size()) << "];\n\n";
+
+        if (!callix.empty()) {
+            out << "size_t C[" << callix.size() << "];\n"
+                << "bool loaded = false;\n\n";
+        }
+
+        for (const auto& i : fl) {
+            out << "aot_ret " << fname(i.first) << "(AotModule& m, Val*& fb, size_t& fsize);\n";
+        }
+
+        out << body.str()
+            << "\n}\n\n"
+            << "void " << loader << "(piccol::AotModule& m) {\n\n";
+
+        for (size_t n = 0; n < syms.size(); ++n) {
+            out << "    S[" << n << "] = metalan::symtab().get(" << quote(syms[n]) << ");\n";
+        }
+
+        out << "\n" << init.str() << "}\n";
+    }
+};
+
+}
+
+#endif
@@ -8,6 +8,8 @@
 #include "metalan.h"
 
 #include "nanom.h"
+#include "nanom_opt.h"
+#include "nanom_verify.h"
 
 
 namespace piccol {
@@ -51,8 +53,14 @@ inline std::string real_to_string(Real i) {
 
 struct PiccolAsm {
 
-    PiccolAsm(Vm& _vm) : vm__(_vm)
+    PiccolAsm(Vm& _vm) : optimize(true), inline_budget(32), vm__(_vm)
         {}
+
+    // Run the bytecode optimizer over the code before linking it.
+    bool optimize;
+
+    // Largest callee, in opcodes, that the optimizer inlines; 0 turns inlining off.
+    size_t inline_budget;
     
 
 private:
@@ -164,9 +172,9 @@ private:
 
         compile_ctx(const label_t& nill, Shapes& oldshapes, VmCode& runtime_code) : 
             nillabel(nill),
-            compiletime_vm(compiletime_code, oldshapes),
+            compiletime_vm(compiletime_code, oldshapes, 4096),
             cmode(false),
-            cmode_code(compiletime_code.codes[nillabel]),
+            cmode_code(compiletime_code.codes[nillabel].edit()),
             code(runtime_code)
             {
                 //compiletime_vm.shapes = oldshapes;
@@ -205,7 +213,9 @@ private:
             op.op = EXIT;
             cmode_code.push_back(op);
 
-            compiletime_vm.frame.emplace_back(nillabel, 0, 0, 0);
+            compiletime_code.link(compiletime_vm.shapes);
+
+            compiletime_vm.frame.emplace_back(0, 0, 0);
 
             vm_run(compiletime_vm, nillabel);
 
@@ -274,7 +284,7 @@ private:
             op.op = PUSH;
             op.arg.uint = ss.back();
 
-            code.codes[label()].push_back(op);
+            code.codes[label()].edit().push_back(op);
         }
 
         void mark_tuple() {
@@ -413,12 +423,12 @@ private:
 
             l.name = symtab().get(symtab().get(l.name) + "$" + uint_to_string(curbranch));
 
-            code.codes[label()].push_back(Opcode(PUSH, (UInt)l.name));
+            code.codes[label()].edit().push_back(Opcode::push_sym(l.name));
 
             Sym nextopcode = next();
 
             // HACK
-            code.codes[label()].push_back(Opcode(opcodecode(symtab().get(nextopcode))));
+            code.codes[label()].edit().push_back(Opcode(opcodecode(symtab().get(nextopcode))));
 
             labelstack.emplace_back(l.name, l.fromshape, l.toshape);
 
@@ -445,14 +455,14 @@ private:
 
             l.toshape = next();
 
-            code.codes[label()].push_back(Opcode(PUSH, (UInt)l.name));
-            code.codes[label()].push_back(Opcode(PUSH, (UInt)l.fromshape));
-            code.codes[label()].push_back(Opcode(PUSH, (UInt)l.toshape));
+            code.codes[label()].edit().push_back(Opcode::push_sym(l.name));
+            code.codes[label()].edit().push_back(Opcode::push_sym(l.fromshape));
+            code.codes[label()].edit().push_back(Opcode::push_sym(l.toshape));
 
             Sym nextopcode = next();
 
             // HACK
-            code.codes[label()].push_back(Opcode(opcodecode(symtab().get(nextopcode))));
+            code.codes[label()].edit().push_back(Opcode(opcodecode(symtab().get(nextopcode))));
 
             labelstack.emplace_back(l.name, l.fromshape, l.toshape);
 
@@ -471,7 +481,7 @@ private:
             op.op = PUSH;
             op.arg.uint = compiletime_vm.shapes.get(ss.back()).size();
 
-            code.codes[label()].push_back(op);
+            code.codes[label()].edit().push_back(op);
         }
 
         void fieldname_deref() {
@@ -501,11 +511,11 @@ private:
             op.op = PUSH;
             op.arg.uint = offrange.first;
 
-            code.codes[label()].push_back(op);
+            code.codes[label()].edit().push_back(op);
 
             op.arg.uint = offrange.second;
 
-            code.codes[label()].push_back(op);
+            code.codes[label()].edit().push_back(op);
         }
 
         void fieldtype_check() {
@@ -612,8 +622,8 @@ private:
 
             shapestack().push_back(newshape);
 
-            code.codes[label()].push_back(Opcode(PUSH, (UInt)fieldt.ix_from));
-            code.codes[label()].push_back(Opcode(PUSH, (UInt)fieldt.ix_to));
+            code.codes[label()].edit().push_back(Opcode(PUSH, (UInt)fieldt.ix_from));
+            code.codes[label()].edit().push_back(Opcode(PUSH, (UInt)fieldt.ix_to));
         }
 
         void get_all_fields() {
@@ -623,8 +633,8 @@ private:
 
             shapestack().push_back(framehead);
 
-            code.codes[label()].push_back(Opcode(PUSH, (UInt)0));
-            code.codes[label()].push_back(Opcode(PUSH, (UInt)sh.size()));
+            code.codes[label()].edit().push_back(Opcode(PUSH, (UInt)0));
+            code.codes[label()].edit().push_back(Opcode(PUSH, (UInt)sh.size()));
         }
 
 
@@ -659,9 +669,9 @@ private:
             ss.pop_back();
             ss.push_back(newshape);
 
-            code.codes[label()].push_back(Opcode(PUSH, (UInt)fieldt.ix_from));
-            code.codes[label()].push_back(Opcode(PUSH, (UInt)fieldt.ix_to));
-            code.codes[label()].push_back(Opcode(PUSH, (UInt)sh.size()));
+            code.codes[label()].edit().push_back(Opcode(PUSH, (UInt)fieldt.ix_from));
+            code.codes[label()].edit().push_back(Opcode(PUSH, (UInt)fieldt.ix_to));
+            code.codes[label()].edit().push_back(Opcode(PUSH, (UInt)sh.size()));
         }
 
 
@@ -678,15 +688,14 @@ private:
         
             label_t l(name, fromshape, toshape);
 
-            code.codes[label()].push_back(Opcode(PUSH, (UInt)name));
-            code.codes[label()].push_back(Opcode(PUSH, (UInt)fromshape));
-            code.codes[label()].push_back(Opcode(PUSH, (UInt)toshape));
-
             if (code.codes.find(l) != code.codes.end()) {
-                code.codes[label()].push_back(Opcode(tailcall ? TAILCALL : CALL));
+                code.codes[label()].edit().push_back(Opcode::push_sym(name));
+                code.codes[label()].edit().push_back(Opcode::push_sym(fromshape));
+                code.codes[label()].edit().push_back(Opcode::push_sym(toshape));
+                code.codes[label()].edit().push_back(Opcode(tailcall ? TAILCALL : CALL));
 
             } else if (code.callbacks.find(l) != code.callbacks.end()) {
-                code.codes[label()].push_back(Opcode(SYSCALL));
+                code.codes[label()].edit().push_back(Opcode(SYSCALL_DIRECT, (UInt)code.syscall_index(l)));
 
             } else {
             
@@ -711,13 +720,13 @@ private:
             // Too lazy yet to implement a proper multi-opcode feature.
             if (i->second.first.op == IF) {
 
-                code.codes[label()].push_back(Opcode(IF, (Int)2));
-                code.codes[label()].push_back(Opcode(FAIL));
+                code.codes[label()].edit().push_back(Opcode(IF, (Int)2));
+                code.codes[label()].edit().push_back(Opcode(FAIL));
 
             } else {
 
                 if (i->second.first.op != NOOP) {
-                    code.codes[label()].push_back(i->second.first);
+                    code.codes[label()].edit().push_back(i->second.first);
                 }
             }
 
@@ -883,7 +892,7 @@ private:
                 }
 
 
-                auto& c = code.codes[label(false)];
+                auto& c = code.codes[label(false)].edit();
 
                 Opcode op;
 
@@ -922,6 +931,7 @@ private:
 
                     } else if (arg_type == "Sym") {
                         op.arg = p_i->sym;
+                        op.sym = true;
 
                     } else if (arg_type == "Int" || arg_type == "Bool") {
                         op.arg = string_to_int(metalan::symtab().get(p_i->sym));
@@ -938,7 +948,7 @@ private:
 
                     ++p_i;
 
-                } else if (op.op == IF || op.op == IF_NOT || op.op == IF_FAIL || op.op == IF_NOT_FAIL) {
+                } else if (op.is_jump()) {
 
                     if (p_i == p_e) {
                         throw std::runtime_error("End of input while looking for opcode argument");
@@ -948,13 +958,60 @@ private:
                     ++p_i;
                 }
             
-                c.push_back(op);
+                c.push_back(immediate_form(c, op));
 
                 if (cmode) {
                     cmode_code.push_back(op);
                 }
             }
         }
+
+        // The field opcodes take their offsets and sizes as immediates, in
+        // place of the constant PUSHes emitted just before them.
+
+        Opcode immediate_form(VmCode::code_t& c, const Opcode& op) {
+
+            size_t n;
+            op_t o;
+
+            switch (op.op) {
+            case GET_FRAMEHEAD_FIELDS: n = 2; o = GET_FRAMEHEAD_FIELDS_I; break;
+            case GET_FIELDS:           n = 3; o = GET_FIELDS_I; break;
+            case SET_FIELDS:           n = 3; o = SET_FIELDS_I; break;
+            case NEW_STRUCT:           n = 1; o = NEW_STRUCT_I; break;
+            default:
+                return op;
+            }
+
+            if (c.size() < n)
+                return op;
+
+            const Opcode* a = &c[c.size() - n];
+
+            for (size_t i = 0; i < n; ++i) {
+                if (a[i].op != PUSH || a[i].sym)
+                    return op;
+            }
+
+            Opcode ret;
+
+            if (o == NEW_STRUCT_I) {
+                ret = Opcode(o, a[0].arg);
+
+            } else {
+                UInt b = a[0].arg.uint;
+                UInt e = a[1].arg.uint;
+                UInt size = (n == 3 ? a[2].arg.uint : 0);
+
+                if (b > e || !Opcode::packable(b, e, size))
+                    return op;
+
+                ret = Opcode::packed(o, b, e, size);
+            }
+
+            c.resize(c.size() - n);
+            return ret;
+        }
     };
 
 
@@ -965,6 +1022,13 @@ public:
 
         compile_ctx ctx(VmCode::toplevel_label(), vm__.shapes, vm__.code);
 
+        // Parsing only adds functions and appends to bodies, e.g. the toplevel's.
+        std::unordered_map<label_t, size_t> before;
+
+        for (const auto& i : vm__.code.codes) {
+            before[i.first] = i.second.get().size();
+        }
+
         try {
             ctx.parse(prog);
 
@@ -974,9 +1038,35 @@ public:
                                ": " + e.what());
             throw std::runtime_error(msg);
         }
+
+        // Only the code added here; code cannot call functions defined after
+        // it, so the others stay as they were optimized.
+        if (optimize) {
+            std::unordered_set<label_t> defined;
+
+            for (const auto& i : vm__.code.codes) {
+                auto j = before.find(i.first);
+
+                if (j == before.end() || j->second != i.second.get().size()) {
+                    defined.insert(i.first);
+                }
+            }
+
+            nanom::optimize(vm__.code, defined, inline_budget);
+        }
+
+        vm__.code.link(vm__.shapes);
+        nanom::verify(vm__.code);
     }
 
-    std::string print() {
+    // With 'compact' set, disassembles the compact encoding of the linked code
+    // instead of listing the functions as assembled.
+
+    std::string print(bool compact = false) {
+
+        if (compact) {
+            return compact_print(vm__.code);
+        }
 
         metalan::Symlist tmp;
 
@@ -987,14 +1077,32 @@ public:
             tmp.syms.push_back(metalan::Symcell(metalan::Symcell::VAR, i.first.fromshape));
             tmp.syms.push_back(metalan::Symcell(metalan::Symcell::VAR, i.first.toshape));
 
-            for (const auto& j : i.second) {
+            for (const auto& j : i.second.get()) {
 
                 tmp.syms.push_back(metalan::Symcell(metalan::Symcell::QATOM, 
                                                     opcodename(j.op)));
 
-                if (j.op == PUSH || j.op == IF || j.op == IF_NOT || j.op == IF_FAIL || j.op == IF_NOT_FAIL) {
+                if (j.op == PUSH || j.is_jump()) {
 
                     tmp.syms.push_back(metalan::Symcell(metalan::Symcell::QATOM, j.arg.uint));
+
+                } else if (j.op == SYSCALL_DIRECT) {
+
+                    const label_t& l = vm__.code.syscalls[j.arg.uint].label;
+                    tmp.syms.push_back(metalan::Symcell(metalan::Symcell::QATOM, l.name));
+                    tmp.syms.push_back(metalan::Symcell(metalan::Symcell::QATOM, l.fromshape));
+                    tmp.syms.push_back(metalan::Symcell(metalan::Symcell::QATOM, l.toshape));
+
+                } else if (j.is_packed()) {
+
+                    tmp.syms.push_back(metalan::Symcell(metalan::Symcell::QATOM, std::to_string(j.packed_a())));
+                    tmp.syms.push_back(metalan::Symcell(metalan::Symcell::QATOM, std::to_string(j.packed_b())));
+                    tmp.syms.push_back(metalan::Symcell(metalan::Symcell::QATOM, std::to_string(j.packed_c())));
+
+                } else if (j.op == NEW_STRUCT_I || j.op == DIV_INT_POW2 || j.op == MOD_INT_POW2 ||
+                           j.op == POP_FRAMETAIL_I) {
+
+                    tmp.syms.push_back(metalan::Symcell(metalan::Symcell::QATOM, std::to_string(j.arg.uint)));
                 }
             }
         }
@@ -1003,6 +1111,13 @@ public:
     }
 
 
+    // The linked code annotated with the execution counts from a profiled run.
+
+    std::string print(const VmProfile& prof) {
+        return profile_print(vm__.code, prof);
+    }
+
+
     void parse(const std::string& pr) {
 
         metalan::Symlist prog;
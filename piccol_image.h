@@ -0,0 +1,484 @@
+#ifndef __PICCOL_IMAGE_H
+#define __PICCOL_IMAGE_H
+
+/*
+ * Compiled images of Piccol programs, for Piccol::use_image_cache().
+ *
+ * An image holds what Piccol::load() leaves behind: the function bodies of
+ * VmCode::codes as assembled and optimized, the Shapes, and the macros. The
+ * symbols these refer to are stored as strings and remapped into the
+ * symbol table of the loading process.
+ *
+ * The file is a header followed by flat arrays, each 8-byte aligned, and is
+ * read through mmap. The opcodes are copied out as they are; only symbol
+ * operands and callback indices get patched.
+ *
+ * Images are keyed by an FNV-1a hash (ImageKey) of everything a load depends
+ * on; a file that does not match its key or its own sizes, or that refers to
+ * opcodes, symbols or callbacks it does not have, is ignored.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cinttypes>
+#include <unordered_set>
+
+#include "nanom.h"
+#include "metalan.h"
+
+
+namespace piccol {
+
+using namespace nanom;
+
+struct ImageKey {
+
+    uint64_t h;
+
+    ImageKey(uint64_t seed = 14695981039346656037ULL) : h(seed) {}
+
+    ImageKey& add(const void* p, size_t n) {
+        const unsigned char* c = (const unsigned char*)p;
+
+        for (size_t i = 0; i < n; ++i) {
+            h = (h ^ c[i]) * 1099511628211ULL;
+        }
+        return *this;
+    }
+
+    ImageKey& add(uint64_t v) {
+        return add(&v, sizeof(v));
+    }
+
+    // Length-prefixed, so that consecutive strings cannot run into each other.
+    ImageKey& add(const std::string& s) {
+        add((uint64_t)s.size());
+        return add(s.data(), s.size());
+    }
+
+    std::string hex() const {
+        char buff[32];
+        ::snprintf(buff, 31, "%016" PRIx64, h);
+        return buff;
+    }
+};
+
+
+struct Image {
+
+    // Bump on any change to the format below or to the meaning of the opcodes.
+    static const uint32_t VERSION = 1;
+
+    std::unordered_map< label_t, Cow<VmCode::code_t> > codes;
+    Shapes shapes;
+    std::unordered_map< Sym, std::shared_ptr<const metalan::Symlist> > macros;
+
+    // The callbacks that SYSCALL_DIRECT operands in 'codes' index.
+    std::vector<label_t> syscalls;
+
+private:
+
+    struct header_t {
+        char magic[8];
+        uint32_t version;
+        uint32_t opcode_size;
+        uint64_t key;
+        uint64_t nsyms;
+        uint64_t strbytes;
+        uint64_t nfuncs;
+        uint64_t nops;
+        uint64_t nsyscalls;
+        uint64_t nshapes;
+        uint64_t nfields;
+        uint64_t ntypes;
+        uint64_t nmacros;
+        uint64_t ncells;
+    };
+
+    struct label_rec { uint32_t name, from, to; };
+    struct func_rec { label_rec label; uint32_t nops; };
+    struct shape_rec { uint32_t name, nfields, size; };
+    struct field_rec { uint32_t sym, type, shape, size; };
+    struct macro_rec { uint32_t name, ncells; };
+    struct cell_rec { uint32_t type, sym; };
+
+    // File offsets of the arrays that follow the header.
+    struct layout_t {
+        size_t strs, chars, funcs, ops, syscalls, shapes, fields, types, macros, cells, size;
+
+        static size_t align(size_t n) { return (n + 7) & ~(size_t)7; }
+
+        layout_t(const header_t& h) {
+            strs     = align(sizeof(header_t));
+            chars    = strs + (h.nsyms + 1) * sizeof(uint32_t);
+            funcs    = align(chars + h.strbytes);
+            ops      = align(funcs + h.nfuncs * sizeof(func_rec));
+            syscalls = ops + h.nops * sizeof(Opcode);
+            shapes   = align(syscalls + h.nsyscalls * sizeof(label_rec));
+            fields   = align(shapes + h.nshapes * sizeof(shape_rec));
+            types    = align(fields + h.nfields * sizeof(field_rec));
+            macros   = align(types + h.ntypes * sizeof(uint32_t));
+            cells    = align(macros + h.nmacros * sizeof(macro_rec));
+            size     = align(cells + h.ncells * sizeof(cell_rec));
+        }
+    };
+
+    static void magic(char* m) {
+        std::memcpy(m, "PICCIMG", 8);
+    }
+
+public:
+
+    // Writes the code, shapes and macros under 'key'. The file appears under
+    // its final name only once complete; returns false if it could not be written.
+
+    static bool write(const std::string& path, uint64_t key, const VmCode& code,
+                      const std::unordered_map< Sym, std::shared_ptr<const metalan::Symlist> >& macros) {
+
+        std::unordered_map<Sym, uint32_t> ids;
+        std::vector<Sym> syms;
+
+        auto id = [&](Sym s) {
+            auto i = ids.find(s);
+
+            if (i != ids.end())
+                return i->second;
+
+            uint32_t n = syms.size();
+            ids[s] = n;
+            syms.push_back(s);
+            return n;
+        };
+
+        auto label = [&](const label_t& l) {
+            return label_rec{ id(l.name), id(l.fromshape), id(l.toshape) };
+        };
+
+        // Symbol 0 is no symbol at all, and keeps id 0.
+        id(0);
+
+        header_t h;
+        std::memset(&h, 0, sizeof(h));
+        magic(h.magic);
+        h.version = VERSION;
+        h.opcode_size = sizeof(Opcode);
+        h.key = key;
+        h.nfuncs = code.codes.size();
+        h.nsyscalls = code.syscalls.size();
+        h.nshapes = code.shapes.shapes.size();
+        h.nmacros = macros.size();
+
+        std::vector<func_rec> funcs;
+        std::vector<Opcode> ops;
+
+        for (const auto& f : code.codes) {
+            const VmCode::code_t& body = f.second;
+
+            funcs.push_back(func_rec{ label(f.first), (uint32_t)body.size() });
+
+            for (Opcode c : body) {
+                if (c.sym) {
+                    c.arg.uint = id(c.arg.uint);
+                }
+                ops.push_back(c);
+            }
+        }
+
+        std::vector<label_rec> syscalls;
+
+        for (const auto& sc : code.syscalls) {
+            syscalls.push_back(label(sc.label));
+        }
+
+        std::vector<shape_rec> shapes;
+        std::vector<field_rec> fields;
+        std::vector<uint32_t> types;
+
+        for (const auto& s : code.shapes.shapes) {
+            const Shape& sh = s.second;
+
+            shapes.push_back(shape_rec{ id(s.first), (uint32_t)sh.n2field.size(), (uint32_t)sh.size() });
+
+            // n2field does not keep the names; find each in sym2field by its range.
+            std::unordered_set<Sym> named;
+
+            for (const auto& ti : sh.n2field) {
+                Sym fname = 0;
+
+                for (const auto& i : sh.sym2field) {
+                    if (i.second.ix_from == ti.ix_from && i.second.ix_to == ti.ix_to &&
+                        named.insert(i.first).second) {
+                        fname = i.first;
+                        break;
+                    }
+                }
+
+                fields.push_back(field_rec{ id(fname), (uint32_t)ti.type, id(ti.shape),
+                                            (uint32_t)(ti.ix_to - ti.ix_from) });
+            }
+
+            for (size_t j = 0; j < sh.size(); ++j) {
+                types.push_back(j < sh.serialized.size() ? sh.serialized[j] : NONE);
+            }
+        }
+
+        std::vector<macro_rec> macs;
+        std::vector<cell_rec> cells;
+
+        for (const auto& m : macros) {
+            macs.push_back(macro_rec{ id(m.first), (uint32_t)m.second->syms.size() });
+
+            for (const auto& c : m.second->syms) {
+                cells.push_back(cell_rec{ (uint32_t)c.type, id(c.sym) });
+            }
+        }
+
+        std::vector<uint32_t> strs;
+        std::string chars;
+
+        for (Sym s : syms) {
+            strs.push_back(chars.size());
+            chars += symtab().get(s);
+        }
+        strs.push_back(chars.size());
+
+        h.nsyms = syms.size();
+        h.strbytes = chars.size();
+        h.nops = ops.size();
+        h.nfields = fields.size();
+        h.ntypes = types.size();
+        h.ncells = cells.size();
+
+        layout_t lay(h);
+        std::vector<char> buf(lay.size, 0);
+
+        auto put = [&](size_t at, const void* p, size_t n) {
+            if (n > 0) std::memcpy(&buf[at], p, n);
+        };
+
+        put(0, &h, sizeof(h));
+        put(lay.strs, strs.data(), strs.size() * sizeof(uint32_t));
+        put(lay.chars, chars.data(), chars.size());
+        put(lay.funcs, funcs.data(), funcs.size() * sizeof(func_rec));
+        put(lay.ops, ops.data(), ops.size() * sizeof(Opcode));
+        put(lay.syscalls, syscalls.data(), syscalls.size() * sizeof(label_rec));
+        put(lay.shapes, shapes.data(), shapes.size() * sizeof(shape_rec));
+        put(lay.fields, fields.data(), fields.size() * sizeof(field_rec));
+        put(lay.types, types.data(), types.size() * sizeof(uint32_t));
+        put(lay.macros, macs.data(), macs.size() * sizeof(macro_rec));
+        put(lay.cells, cells.data(), cells.size() * sizeof(cell_rec));
+
+        std::string tmp = path + ".tmp" + std::to_string(::getpid());
+
+        FILE* f = ::fopen(tmp.c_str(), "wb");
+
+        if (!f)
+            return false;
+
+        bool ok = (::fwrite(buf.data(), 1, buf.size(), f) == buf.size());
+        ok = (::fclose(f) == 0 && ok);
+
+        if (!ok || ::rename(tmp.c_str(), path.c_str()) != 0) {
+            ::unlink(tmp.c_str());
+            return false;
+        }
+
+        return true;
+    }
+
+    // Maps the image at 'path' and reads it in; false if there is none, or it
+    // was written for another key, format or build.
+
+    bool read(const std::string& path, uint64_t key) {
+
+        int fd = ::open(path.c_str(), O_RDONLY);
+
+        if (fd < 0)
+            return false;
+
+        struct stat st;
+        void* m = MAP_FAILED;
+
+        if (::fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(header_t)) {
+            m = ::mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+
+        ::close(fd);
+
+        if (m == MAP_FAILED)
+            return false;
+
+        bool ok;
+
+        try {
+            ok = read((const char*)m, st.st_size, key);
+
+        } catch (std::exception& e) {
+            ok = false;
+        }
+
+        ::munmap(m, st.st_size);
+
+        if (!ok) {
+            codes.clear();
+            shapes.reset();
+            macros.clear();
+            syscalls.clear();
+        }
+
+        return ok;
+    }
+
+private:
+
+    bool read(const char* base, size_t size, uint64_t key) {
+
+        header_t h;
+        std::memcpy(&h, base, sizeof(h));
+
+        char m[8];
+        magic(m);
+
+        if (std::memcmp(h.magic, m, 8) != 0 || h.version != VERSION ||
+            h.opcode_size != sizeof(Opcode) || h.key != key)
+            return false;
+
+        // Every count is bounded by the file size, so the layout cannot overflow.
+        const uint64_t counts[] = { h.nsyms, h.strbytes, h.nfuncs, h.nops, h.nsyscalls, h.nshapes,
+                                    h.nfields, h.ntypes, h.nmacros, h.ncells };
+
+        for (uint64_t n : counts) {
+            if (n > size)
+                return false;
+        }
+
+        layout_t lay(h);
+
+        if (lay.size != size)
+            return false;
+
+        auto at = [&](size_t off) { return base + off; };
+
+        const uint32_t* strs = (const uint32_t*)at(lay.strs);
+        const char* chars = at(lay.chars);
+
+        std::vector<Sym> remap;
+        remap.reserve(h.nsyms);
+
+        for (size_t i = 0; i < h.nsyms; ++i) {
+            if (strs[i] > strs[i+1] || strs[i+1] > h.strbytes)
+                return false;
+
+            remap.push_back(i == 0 ? 0 : symtab().get(std::string(chars + strs[i], chars + strs[i+1])));
+        }
+
+        auto sym = [&](uint64_t n) {
+            if (n >= remap.size())
+                throw std::runtime_error("Symbol out of range in image");
+
+            return remap[n];
+        };
+
+        auto label = [&](const label_rec& l) {
+            return label_t(sym(l.name), sym(l.from), sym(l.to));
+        };
+
+        const label_rec* sc = (const label_rec*)at(lay.syscalls);
+
+        for (size_t i = 0; i < h.nsyscalls; ++i) {
+            syscalls.push_back(label(sc[i]));
+        }
+
+        const func_rec* funcs = (const func_rec*)at(lay.funcs);
+        const Opcode* ops = (const Opcode*)at(lay.ops);
+        size_t nops = 0;
+
+        for (size_t i = 0; i < h.nfuncs; ++i) {
+
+            if (funcs[i].nops > h.nops - nops)
+                return false;
+
+            VmCode::code_t& c = codes[label(funcs[i].label)].edit();
+            c.assign(ops + nops, ops + nops + funcs[i].nops);
+            nops += funcs[i].nops;
+
+            for (auto& o : c) {
+
+                // Direct calls are made by VmCode::link(), after loading.
+                if ((size_t)o.op >= OPCODE_COUNT || o.op == CALL_DIRECT || o.op == TAILCALL_DIRECT ||
+                    o.op == CALL_LIGHT_DIRECT)
+                    return false;
+
+                if (o.sym) {
+                    o.arg.uint = sym(o.arg.uint);
+
+                } else if (o.op == SYSCALL_DIRECT && o.arg.uint >= syscalls.size()) {
+                    return false;
+                }
+            }
+        }
+
+        const shape_rec* shs = (const shape_rec*)at(lay.shapes);
+        const field_rec* fields = (const field_rec*)at(lay.fields);
+        const uint32_t* types = (const uint32_t*)at(lay.types);
+        size_t nfields = 0;
+        size_t ntypes = 0;
+
+        for (size_t i = 0; i < h.nshapes; ++i) {
+
+            if (shs[i].nfields > h.nfields - nfields || shs[i].size > h.ntypes - ntypes)
+                return false;
+
+            Shape& sh = shapes.shapes[sym(shs[i].name)].edit();
+
+            for (size_t j = 0; j < shs[i].nfields; ++j) {
+                const field_rec& f = fields[nfields++];
+
+                if (f.type > STRUCT)
+                    return false;
+
+                sh.add_field(sym(f.sym), (Type)f.type, sym(f.shape), f.size);
+            }
+
+            if (sh.size() != shs[i].size)
+                return false;
+
+            for (size_t j = 0; j < shs[i].size; ++j) {
+                sh.serialized.push_back((Type)types[ntypes++]);
+            }
+        }
+
+        const macro_rec* macs = (const macro_rec*)at(lay.macros);
+        const cell_rec* cells = (const cell_rec*)at(lay.cells);
+        size_t ncells = 0;
+
+        for (size_t i = 0; i < h.nmacros; ++i) {
+
+            if (macs[i].ncells > h.ncells - ncells)
+                return false;
+
+            std::shared_ptr<metalan::Symlist> ml = std::make_shared<metalan::Symlist>();
+            macros[sym(macs[i].name)] = ml;
+
+            for (size_t j = 0; j < macs[i].ncells; ++j) {
+                const cell_rec& c = cells[ncells++];
+
+                if (c.type > metalan::Symcell::NEGATE)
+                    return false;
+
+                ml->syms.push_back(metalan::Symcell((metalan::Symcell::type_t)c.type, sym(c.sym)));
+            }
+        }
+
+        return (nops == h.nops && nfields == h.nfields && ntypes == h.ntypes && ncells == h.ncells);
+    }
+};
+
+}
+
+
+#endif
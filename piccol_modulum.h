@@ -24,9 +24,10 @@ struct PiccolF : public Piccol {
 
     PiccolF(const PiccolF& p) : Piccol(static_cast<const Piccol&>(p)), appdir(p.appdir) {}
 
-    PiccolF(PiccolF&& p) : Piccol(static_cast<const Piccol&&>(p)), appdir(p.appdir) {}
+    PiccolF(PiccolF&& p) : Piccol(static_cast<Piccol&&>(p)), appdir(std::move(p.appdir)) {}
 
-    PiccolF(const std::string& sysdir, const std::string& ad, bool _verbose = false) : 
+    PiccolF(const std::string& sysdir, const std::string& ad, bool _verbose = false,
+            const std::string& cachedir = "") : 
         Piccol(piccol::load_file(sysdir + "macrolan.metal"),
                piccol::load_file(sysdir + "piccol_lex.metal"),
                piccol::load_file(sysdir + "piccol_morph.metal"),
@@ -35,6 +36,7 @@ struct PiccolF : public Piccol {
                _verbose),
         appdir(ad)
         {
+            use_image_cache(cachedir);
             Piccol::init();
         }
 
@@ -82,12 +84,16 @@ struct Modules {
 
     bool verbose;
 
+    // Where the module VMs cache their compiled images; empty for no cache.
+    std::string cachedir;
+
     Modules(const std::string& sd, 
             const std::string& ad,
             const std::string& loader, 
-            bool _verbose = false) : sysdir(sd), appdir(ad), verbose(_verbose) {
+            bool _verbose = false,
+            const std::string& cd = "") : sysdir(sd), appdir(ad), verbose(_verbose), cachedir(cd) {
 
-        PiccolF p(sysdir, appdir, verbose);
+        PiccolF p(sysdir, appdir, verbose, cachedir);
 
         p.register_callback("module", "[ Sym Sym ]", "Void", 
                             std::bind(&Modules::_cb_module, this, _1, _2, _3, _4, _5));
@@ -183,7 +189,7 @@ struct Modules {
         }
 
         // Load common code.
-        PiccolF comvm(sysdir, appdir, verbose);
+        PiccolF comvm(sysdir, appdir, verbose, cachedir);
 
         for (const auto& cb : callbacks) {
             comvm.code.register_callback(cb.first, cb.second);
@@ -0,0 +1,316 @@
+#ifndef __PICCOL_POOL_H
+#define __PICCOL_POOL_H
+
+/*
+ * A fixed set of worker threads running calls into one loaded Piccol program.
+ *
+ * Each worker has its own PiccolThread (stack, JIT, callback timings) on the
+ * frozen code of the Piccol, and its own queue of jobs. A job goes to the queue
+ * of the worker that submitted it, or round-robin when submitted from outside
+ * the pool. Workers run their own queue in order and steal from the far end of
+ * the others' queues when it runs dry, so one long call holds up only its own
+ * worker.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <thread>
+
+#include "piccol_vm.h"
+
+
+namespace piccol {
+
+struct PiccolPool {
+
+    // The outcome of a call: what Piccol::run returns, and its result struct.
+    struct result_t {
+        bool ok;
+        nanom::Struct out;
+
+        result_t() : ok(false) {}
+    };
+
+    // Completion callback: called on the worker thread with the exception of
+    // the run if it threw, else null. Must not throw.
+    typedef std::function<void(std::exception_ptr, result_t&)> done_t;
+
+    struct job_t {
+        nanom::label_t label;
+        nanom::Struct in;
+        done_t done;
+    };
+
+    struct worker_stats_t {
+        uint64_t jobs;
+        uint64_t steals;
+        uint64_t busy_ns;
+
+        // Share of the time since the pool started spent running jobs.
+        double utilization;
+    };
+
+private:
+
+    typedef std::chrono::steady_clock clock_type;
+
+    struct worker_t {
+        PiccolPool& pool;
+        size_t ix;
+
+        PiccolThread pt;
+
+        std::mutex m;
+        std::deque<job_t> jobs;
+
+        std::atomic<uint64_t> ran;
+        std::atomic<uint64_t> stolen;
+        std::atomic<uint64_t> busy_ns;
+
+        std::thread th;
+
+        worker_t(PiccolPool& p, size_t i, Piccol& piccol, size_t stack_capacity) :
+            pool(p), ix(i), pt(piccol, stack_capacity), ran(0), stolen(0), busy_ns(0) {}
+    };
+
+    std::vector< std::unique_ptr<worker_t> > workers;
+
+    // Jobs in the queues, and jobs not done yet. 'queued' can dip below zero
+    // while a job is taken before its submitter has counted it.
+    std::atomic<long> queued;
+    std::atomic<long> unfinished;
+    std::atomic<size_t> next;
+
+    std::mutex m;
+    std::condition_variable work;
+    std::condition_variable idle;
+    bool stopping;
+
+    clock_type::time_point started;
+
+    static worker_t*& current() {
+        static thread_local worker_t* w = nullptr;
+        return w;
+    }
+
+    bool take(worker_t& w, job_t& j) {
+        std::lock_guard<std::mutex> l(w.m);
+
+        if (w.jobs.empty())
+            return false;
+
+        j = std::move(w.jobs.front());
+        w.jobs.pop_front();
+        return true;
+    }
+
+    bool steal(worker_t& w, job_t& j) {
+
+        for (size_t i = 1; i < workers.size(); ++i) {
+
+            worker_t& v = *workers[(w.ix + i) % workers.size()];
+            std::lock_guard<std::mutex> l(v.m);
+
+            if (!v.jobs.empty()) {
+                j = std::move(v.jobs.back());
+                v.jobs.pop_back();
+                ++w.stolen;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void run_job(worker_t& w, job_t& j) {
+
+        result_t r;
+        std::exception_ptr e;
+
+        auto b = clock_type::now();
+
+        try {
+            r.ok = w.pt.run(j.label, j.in, r.out);
+
+        } catch (...) {
+            e = std::current_exception();
+        }
+
+        w.busy_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(clock_type::now() - b).count();
+        ++w.ran;
+
+        j.done(e, r);
+    }
+
+    void loop(worker_t& w) {
+
+        current() = &w;
+
+        while (1) {
+            job_t j;
+
+            if (take(w, j) || steal(w, j)) {
+                --queued;
+                run_job(w, j);
+
+                if (--unfinished == 0) {
+                    std::lock_guard<std::mutex> l(m);
+                    idle.notify_all();
+                }
+
+                continue;
+            }
+
+            std::unique_lock<std::mutex> l(m);
+            work.wait(l, [this]() { return stopping || queued > 0; });
+
+            if (stopping && queued <= 0)
+                return;
+        }
+    }
+
+public:
+
+    // Freezes the code of 'p', which must outlive the pool. 'nworkers' is the
+    // number of hardware threads if 0; the stack of each worker holds
+    // 'stack_capacity' values, as many as that of 'p' if 0.
+
+    PiccolPool(Piccol& p, size_t nworkers = 0, size_t stack_capacity = 0) :
+        queued(0), unfinished(0), next(0), stopping(false), started(clock_type::now()) {
+
+        if (nworkers == 0) {
+            nworkers = std::max(1u, std::thread::hardware_concurrency());
+        }
+
+        p.freeze();
+
+        for (size_t i = 0; i < nworkers; ++i) {
+            workers.emplace_back(new worker_t(*this, i, p, stack_capacity));
+        }
+
+        for (auto& w : workers) {
+            worker_t* wp = w.get();
+            w->th = std::thread([this, wp]() { loop(*wp); });
+        }
+    }
+
+    PiccolPool(const PiccolPool&) = delete;
+
+    // Runs the jobs still queued, then stops the workers.
+    ~PiccolPool() {
+        {
+            std::lock_guard<std::mutex> l(m);
+            stopping = true;
+        }
+
+        work.notify_all();
+
+        for (auto& w : workers) {
+            w->th.join();
+        }
+    }
+
+    void submit(const nanom::label_t& label, const nanom::Struct& in, done_t done) {
+
+        worker_t* w = current();
+
+        if (w == nullptr || &(w->pool) != this) {
+            w = workers[next++ % workers.size()].get();
+        }
+
+        ++unfinished;
+
+        {
+            std::lock_guard<std::mutex> l(w->m);
+            w->jobs.push_back(job_t{label, in, std::move(done)});
+        }
+
+        ++queued;
+
+        {
+            std::lock_guard<std::mutex> l(m);
+            work.notify_one();
+        }
+    }
+
+    std::future<result_t> submit(const nanom::label_t& label, const nanom::Struct& in) {
+
+        std::shared_ptr< std::promise<result_t> > p = std::make_shared< std::promise<result_t> >();
+
+        submit(label, in, [p](std::exception_ptr e, result_t& r) {
+                if (e) {
+                    p->set_exception(e);
+                } else {
+                    p->set_value(std::move(r));
+                }
+            });
+
+        return p->get_future();
+    }
+
+    // The same arguments as Piccol::run.
+
+    std::future<result_t> submit(metalan::Sym name, metalan::Sym s1, metalan::Sym s2, const nanom::Struct& in) {
+        return submit(nanom::label_t(name, s1, s2), in);
+    }
+
+    std::future<result_t> submit(const std::string& name, const std::string& fr, const std::string& to,
+                                 const nanom::Struct& in) {
+
+        return submit(metalan::symtab().get(name), metalan::symtab().get(fr), metalan::symtab().get(to), in);
+    }
+
+    // Blocks until every job submitted so far is done.
+    void wait() {
+        std::unique_lock<std::mutex> l(m);
+        idle.wait(l, [this]() { return unfinished == 0; });
+    }
+
+    size_t size() const {
+        return workers.size();
+    }
+
+    // Jobs submitted and not yet picked up by a worker.
+    size_t queue_depth() const {
+        long n = queued;
+        return (n > 0 ? n : 0);
+    }
+
+    std::vector<worker_stats_t> stats() const {
+
+        double elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(clock_type::now() - started).count();
+
+        std::vector<worker_stats_t> ret;
+
+        for (const auto& w : workers) {
+            worker_stats_t s;
+            s.jobs = w->ran;
+            s.steals = w->stolen;
+            s.busy_ns = w->busy_ns;
+            s.utilization = (elapsed > 0 ? s.busy_ns / elapsed : 0.0);
+            ret.push_back(s);
+        }
+
+        return ret;
+    }
+
+    // The callback timings of all workers together. Only when idle, see wait().
+    nanom::Timings timings() const {
+
+        nanom::Timings ret;
+
+        for (const auto& w : workers) {
+            ret.merge(w->pt.timings);
+        }
+
+        return ret;
+    }
+};
+
+}
+
+#endif
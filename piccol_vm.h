@@ -21,6 +21,9 @@ struct bm {
 #include <initializer_list>
 
 #include "piccol_asm.h"
+#include "piccol_image.h"
+#include "nanom_reg.h"
+#include "nanom_jit.h"
 
 #include "metalan_prime.h"
 #include "metalan_doppel.h"
@@ -49,38 +52,139 @@ inline std::string load_file(const std::string& fname) {
     return ret;
 }
 
+// Runs function 'label' on 'vm', with its argument struct on the stack from
+// 'framehead' up, and moves the result into 'out'. With 'trace' or 'profile'
+// set the run goes through that hook instead of the unchecked fast path.
+
+inline bool vm_call(nanom::Vm& vm, const nanom::label_t& label, nanom::Struct& out, size_t framehead,
+                    nanom::VmTraceSink* trace = nullptr, nanom::VmProfile* profile = nullptr) {
+
+    size_t entry = vm.code.entry(label);
+
+    size_t nframes = vm.frame.size();
+    vm.frame.emplace_back(0, framehead, vm.stack.size() - framehead);
+
+    vm.failbit = false;
+
+    try {
+        if (trace) {
+            nanom::vm_run_at(vm, entry, *trace);
+        } else if (profile) {
+            nanom::vm_run_at(vm, entry, *profile);
+        } else {
+            auto v = vm.code.verified.find(label);
+            size_t need = (v == vm.code.verified.end() ? 0 : framehead + v->second);
+
+            // The outermost run may resize the arena to fit.
+            if (need > vm.stack.capacity() && nframes == 0) {
+                vm.stack.set_capacity(need);
+            }
+
+            if (need > 0 && need <= vm.stack.capacity()) {
+                nanom::vm_run_unchecked(vm, entry);
+            } else {
+                nanom::vm_run_at(vm, entry);
+            }
+        }
+
+    } catch (...) {
+        // Leave the stack arena as it was, ready for the next run.
+        vm.frame.resize(nframes);
+        vm.stack.resize(framehead);
+        throw;
+    }
+
+    out.v.assign(vm.stack.begin() + framehead, vm.stack.end());
+    vm.stack.erase(vm.stack.begin() + framehead, vm.stack.end());
+
+    return !(vm.failbit);
+}
+
+
 struct Piccol {
 
+    // STACK_BACKEND is the reference stack VM; REGISTER_BACKEND runs code translated
+    // to nanom_reg.h's register IR. CHECK_BACKEND runs every call on both and throws
+    // if they disagree -- callbacks with side effects will see each call twice.
+
+    enum backend_t {
+        STACK_BACKEND,
+        REGISTER_BACKEND,
+        CHECK_BACKEND
+    };
+
     nanom::VmCode code;
     nanom::Vm vm;
     PiccolAsm as;
+
+    // Native code for hot functions of the stack backend; see use_jit().
+    nanom::Jit jit;
+
+    backend_t backend;
+    nanom::RegCode regcode;
+    nanom::RegVm regvm;
+    bool regcode_stale;
     macrolan::Macrolan macro;
 
-    std::string macro_code;
-    std::string lexer_code;
-    std::string morpher_code;
-    std::string emiter_code;
-    std::string prelude_code;
+    // The grammars and the prelude, which copies share.
+    typedef std::shared_ptr<const std::string> source_t;
+
+    source_t macro_code;
+    source_t lexer_code;
+    source_t morpher_code;
+    source_t emiter_code;
+    source_t prelude_code;
 
     bool verbose;
 
-    Piccol(const Piccol& p) : code(p.code), vm(code), as(vm),
+    // Where the trace goes when 'verbose' is set; std::cout if null.
+    nanom::VmTraceSink* tracer;
+
+    // When set (and 'verbose' is not), the stack backend counts executed
+    // opcodes here; see PiccolAsm::print(const VmProfile&).
+    nanom::VmProfile* profile;
+
+    // Directory of compiled images, see use_image_cache(); empty for none.
+    std::string image_cache;
+
+    // The key of the state loaded so far: the grammars and every load() since.
+    uint64_t image_key;
+
+    Piccol(const Piccol& p) : code(p.code), vm(code, p.vm.stack.capacity()), as(vm),
+                              backend(p.backend), regvm(regcode, code.shapes, &code.timings, p.regvm.stack_size),
+                              regcode_stale(true),
                               macro(p.macro),
                               macro_code(p.macro_code),
                               lexer_code(p.lexer_code),
                               morpher_code(p.morpher_code),
                               emiter_code(p.emiter_code),
                               prelude_code(p.prelude_code),
-                              verbose(p.verbose) {}
+                              verbose(p.verbose), tracer(p.tracer), profile(p.profile),
+                              image_cache(p.image_cache), image_key(p.image_key) {
 
-    Piccol(Piccol&& p) : code(p.code), vm(code), as(vm),
-                         macro(p.macro),
-                         macro_code(p.macro_code),
-                         lexer_code(p.lexer_code),
-                         morpher_code(p.morpher_code),
-                         emiter_code(p.emiter_code),
-                         prelude_code(p.prelude_code),
-                         verbose(p.verbose) {}
+        use_jit(p.vm.jit != nullptr);
+        use_compact(p.vm.compact);
+        use_optimizer(p.as.optimize);
+        as.inline_budget = p.as.inline_budget;
+    }
+
+    Piccol(Piccol&& p) : code(std::move(p.code)), vm(code, p.vm.stack.capacity()), as(vm),
+                         backend(p.backend), regvm(regcode, code.shapes, &code.timings, p.regvm.stack_size),
+                         regcode_stale(true),
+                         macro(std::move(p.macro)),
+                         macro_code(std::move(p.macro_code)),
+                         lexer_code(std::move(p.lexer_code)),
+                         morpher_code(std::move(p.morpher_code)),
+                         emiter_code(std::move(p.emiter_code)),
+                         prelude_code(std::move(p.prelude_code)),
+                         verbose(p.verbose), tracer(p.tracer), profile(p.profile),
+                         image_cache(std::move(p.image_cache)), image_key(p.image_key) {
+
+        use_jit(p.vm.jit != nullptr);
+        use_compact(p.vm.compact);
+        use_optimizer(p.as.optimize);
+        as.inline_budget = p.as.inline_budget;
+    }
 
     Piccol(std::string&& macrolan_,
            std::string&& lexer_, 
@@ -88,19 +192,22 @@ struct Piccol {
            std::string&& emiter_,
            std::string&& prelude_, 
            bool _verbose = false) : 
-        vm(code), as(vm), macro(macrolan_),
-        macro_code(macrolan_),
-        lexer_code(lexer_),
-        morpher_code(morpher_),
-        emiter_code(emiter_),
-        prelude_code(prelude_),
-        verbose(_verbose)
-        {}
-
-    ~Piccol() {
-        for (const auto& l : code.timings.timings) {
-            std::cout << l.first.print() << " : " << (double)l.second/1e6 << std::endl;
-        }
+        vm(code), as(vm),
+        backend(STACK_BACKEND), regvm(regcode, code.shapes, &code.timings), regcode_stale(true),
+        macro(macrolan_),
+        macro_code(std::make_shared<const std::string>(std::move(macrolan_))),
+        lexer_code(std::make_shared<const std::string>(std::move(lexer_))),
+        morpher_code(std::make_shared<const std::string>(std::move(morpher_))),
+        emiter_code(std::make_shared<const std::string>(std::move(emiter_))),
+        prelude_code(std::make_shared<const std::string>(std::move(prelude_))),
+        verbose(_verbose),
+        tracer(nullptr),
+        profile(nullptr)
+    {
+        use_jit(true);
+
+        image_key = ImageKey().add((uint64_t)Image::VERSION)
+            .add(*macro_code).add(*lexer_code).add(*morpher_code).add(*emiter_code).h;
     }
 
     void register_callback(const std::string& name, const std::string& from, const std::string& to,
@@ -109,14 +216,162 @@ struct Piccol {
                                               metalan::symtab().get(from), 
                                               metalan::symtab().get(to)), 
                                cb);
+        regcode_stale = true;
+    }
+
+    // The same with the zero-copy ABI, see nanom::span_callback_t.
+    void register_callback(const std::string& name, const std::string& from, const std::string& to,
+                           nanom::span_callback_t cb) {
+        code.register_callback(nanom::label_t(metalan::symtab().get(name),
+                                              metalan::symtab().get(from),
+                                              metalan::symtab().get(to)),
+                               cb);
+        regcode_stale = true;
+    }
+
+    // A typed callback, e.g. register_callback<nanom::Int(nanom::Int,nanom::Int)>("random", fn);
+    // see nanom::typed_callback. Throws if its shapes are not defined or do not match.
+    template <typename SIG, typename F>
+    void register_callback(const std::string& name, F fn) {
+
+        typedef nanom::typed_callback<SIG> tc;
+
+        nanom::check_callback_shape(code.shapes, name, tc::from_shape(), tc::from_types());
+        nanom::check_callback_shape(code.shapes, name, tc::to_shape(), tc::to_types());
+
+        code.register_callback(nanom::label_t(metalan::symtab().get(name),
+                                              metalan::symtab().get(tc::from_shape()),
+                                              metalan::symtab().get(tc::to_shape())),
+                               tc::make(fn));
+        regcode_stale = true;
     }
 
     void init() {
-        load(prelude_code);
+        load(*prelude_code);
+    }
+
+    // Turns the JIT on or off for the stack backend; it is on by default where
+    // supported. Native code is kept, so turning it back on is cheap.
+
+    void use_jit(bool on) {
+        vm.jit = (on && nanom::Jit::available() ? &jit : nullptr);
+    }
+
+    // Runs the stack backend from the compact encoding of the code instead of
+    // the 16-byte opcodes. This bypasses the JIT.
+
+    void use_compact(bool on) {
+        vm.compact = on;
+    }
+
+    // Turns the bytecode optimizer (nanom_opt.h) on or off for code loaded from
+    // now on; it is on by default.
+
+    void use_optimizer(bool on) {
+        as.optimize = on;
+    }
+
+    // Branches and lambdas up to 'budget' opcodes get inlined by the optimizer;
+    // 0 turns inlining off.
+
+    void set_inline_budget(size_t budget) {
+        as.inline_budget = budget;
+    }
+
+    // The most values the stack of a run can hold, on either backend;
+    // nanom::Stack::DEFAULT_CAPACITY unless set here. Running past it throws.
+    // Copies and PiccolThreads take it over. Not while running.
+
+    void set_stack_capacity(size_t cap) {
+        vm.stack.set_capacity(cap);
+        regvm.stack_size = cap;
+        regvm.regs.clear();
+    }
+
+    // Keeps the compiled image of every load() in 'dir', and takes it from
+    // there instead of compiling when the same program is loaded again.
+
+    void use_image_cache(const std::string& dir) {
+        image_cache = dir;
+    }
+
+    // Makes the loaded code read-only, so that PiccolThreads can run it
+    // concurrently. Loading more code or registering callbacks throws after this.
+
+    void freeze() {
+        code.freeze();
     }
 
     void load(const std::string& inp_) {
 
+        if (code.frozen) {
+            throw std::runtime_error("Cannot load into a frozen Piccol");
+        }
+
+        // Besides the source and the state loaded so far, the code depends on
+        // the optimizer settings and on which calls are callbacks.
+
+        ImageKey key(image_key);
+        key.add(inp_).add((uint64_t)as.optimize).add((uint64_t)as.inline_budget);
+
+        std::vector<std::string> cbs;
+
+        for (const auto& cb : code.callbacks) {
+            cbs.push_back(cb.first.print());
+        }
+
+        std::sort(cbs.begin(), cbs.end());
+
+        for (const auto& cb : cbs) {
+            key.add(cb);
+        }
+
+        std::string path = (image_cache.empty() ? "" : image_cache + "/" + key.hex() + ".pimg");
+
+        if (path.empty() || !load_image(path, key.h)) {
+
+            compile(inp_);
+
+            if (!path.empty()) {
+                Image::write(path, key.h, code, macro.macros);
+            }
+        }
+
+        image_key = key.h;
+
+        vm.reset();
+        jit.reset();
+        regcode_stale = true;
+    }
+
+    bool load_image(const std::string& path, uint64_t key) {
+
+        Image img;
+
+        if (!img.read(path, key))
+            return false;
+
+        bm _b("linking image");
+
+        for (auto& f : img.codes) {
+            for (auto& c : f.second.edit()) {
+                if (c.op == nanom::SYSCALL_DIRECT) {
+                    c.arg.uint = code.syscall_index(img.syscalls[c.arg.uint]);
+                }
+            }
+        }
+
+        code.codes.swap(img.codes);
+        code.shapes.shapes.swap(img.shapes.shapes);
+        macro.macros.swap(img.macros);
+
+        code.link(code.shapes);
+        nanom::verify(code);
+        return true;
+    }
+
+    void compile(const std::string& inp_) {
+
         std::string inp;
 
         try {
@@ -130,13 +385,13 @@ struct Piccol {
         metalan::MetalanDoppel doppel;
 
         metalan::Symlist lexer;
-        lexer.parse(lexer_code);
+        lexer.parse(*lexer_code);
 
         metalan::Symlist morpher;
-        morpher.parse(morpher_code);
+        morpher.parse(*morpher_code);
 
         metalan::Symlist emiter;
-        emiter.parse(emiter_code);
+        emiter.parse(*emiter_code);
 
         metalan::Symlist stage1;
 
@@ -191,13 +446,18 @@ struct Piccol {
 
         //std::cout << "-----------------" << std::endl;
         //std::cout << as.print() << std::endl;
-
-        vm.reset();
     }
 
     bool run(metalan::Sym name, metalan::Sym s1, metalan::Sym s2, 
              const nanom::Struct& in, nanom::Struct& out) {
 
+        if (backend == REGISTER_BACKEND) {
+            return run_register(nanom::label_t(name, s1, s2), in, out);
+
+        } else if (backend == CHECK_BACKEND) {
+            return run_checked(nanom::label_t(name, s1, s2), in, out);
+        }
+
         size_t stack_size = vm.stack.size();
         vm.stack.insert(vm.stack.end(), in.v.begin(), in.v.end());
 
@@ -207,27 +467,13 @@ struct Piccol {
     bool run(metalan::Sym name, metalan::Sym s1, metalan::Sym s2, nanom::Struct& out, size_t framehead) {
         //bm _b("running");
 
-        nanom::label_t l(name, s1, s2);
-
-        if (vm.code.codes.find(l) == vm.code.codes.end()) {
-            throw std::runtime_error("Undefined function: " + l.print());
-        }
-
-        vm.frame.emplace_back(l, 0, framehead, vm.stack.size() - framehead);
-
-        vm.failbit = false;
-        nanom::vm_run(vm, l, 0, verbose);
-
-        out.v.assign(vm.stack.begin() + framehead, vm.stack.end());
-        vm.stack.erase(vm.stack.begin() + framehead, vm.stack.end());
-
-        bool ret = !(vm.failbit);
-        return ret;
+        return vm_call(vm, nanom::label_t(name, s1, s2), out, framehead,
+                       (verbose ? (tracer ? tracer : &nanom::vm_trace_stdout()) : nullptr), profile);
     }
 
     bool run(const std::string& name, const std::string& fr, const std::string& to, nanom::Struct& out) {
         return run(metalan::symtab().get(name), metalan::symtab().get(fr), metalan::symtab().get(to),
-                   out, vm.stack.size());
+                   nanom::Struct(), out);
     }
 
     bool run(const std::string& name, const std::string& fr, const std::string& to, 
@@ -237,6 +483,51 @@ struct Piccol {
                    in, out);
     }
 
+    // Translates the loaded code for the register backend, if not done already.
+    // Throws if some function cannot be translated.
+
+    const nanom::RegCode& compile_registers() {
+
+        if (regcode_stale) {
+            nanom::reg_compile(code, code.shapes, regcode);
+            regcode_stale = false;
+        }
+
+        if (!regcode.ok()) {
+            throw std::runtime_error("Register backend unavailable: " + regcode.error);
+        }
+
+        return regcode;
+    }
+
+    bool run_register(const nanom::label_t& l, const nanom::Struct& in, nanom::Struct& out) {
+        compile_registers();
+        return regvm.run(l, in, out);
+    }
+
+    bool run_checked(const nanom::label_t& l, const nanom::Struct& in, nanom::Struct& out) {
+
+        nanom::Struct regout;
+        bool regret = run_register(l, in, regout);
+
+        size_t stack_size = vm.stack.size();
+        vm.stack.insert(vm.stack.end(), in.v.begin(), in.v.end());
+
+        bool ret = run(l.name, l.fromshape, l.toshape, out, stack_size);
+
+        if (ret != regret) {
+            throw std::runtime_error("Backend mismatch in " + l.print() + ": stack VM " +
+                                     (ret ? "succeeded" : "failed") + ", register VM " +
+                                     (regret ? "succeeded" : "failed"));
+        }
+
+        if (ret && !std::equal_to<nanom::Struct>()(out, regout)) {
+            throw std::runtime_error("Backend mismatch in " + l.print() + ": results differ");
+        }
+
+        return ret;
+    }
+
     const nanom::Shape& get_type(const std::string& shape) {
         return code.shapes.get(shape);
     }
@@ -280,6 +571,50 @@ struct Piccol {
 
 };
 
+
+// A lightweight runner for the code of a frozen Piccol, one per thread: its
+// own stack, JIT and callback timings, sharing everything else. Only runs the
+// stack backend. The Piccol must outlive it and must not be run itself while
+// threads are running. The stack holds 'stack_capacity' values, or as many as
+// the Piccol's if 0.
+
+struct PiccolThread {
+
+    nanom::Vm vm;
+    nanom::Jit jit;
+    nanom::Timings timings;
+
+    PiccolThread(Piccol& p, size_t stack_capacity = 0) :
+        vm(p.code, (stack_capacity > 0 ? stack_capacity : p.vm.stack.capacity())) {
+
+        if (!p.code.frozen) {
+            throw std::runtime_error("PiccolThread needs frozen code, see Piccol::freeze()");
+        }
+
+        vm.set_timings(&timings);
+        vm.jit = (p.vm.jit != nullptr ? &jit : nullptr);
+        vm.compact = p.vm.compact;
+    }
+
+    PiccolThread(const PiccolThread&) = delete;
+
+    bool run(const nanom::label_t& l, const nanom::Struct& in, nanom::Struct& out) {
+
+        size_t stack_size = vm.stack.size();
+        vm.stack.insert(vm.stack.end(), in.v.begin(), in.v.end());
+
+        return vm_call(vm, l, out, stack_size);
+    }
+
+    bool run(const std::string& name, const std::string& fr, const std::string& to,
+             const nanom::Struct& in, nanom::Struct& out) {
+
+        return run(nanom::label_t(metalan::symtab().get(name), metalan::symtab().get(fr),
+                                  metalan::symtab().get(to)),
+                   in, out);
+    }
+};
+
 }
 
 #endif
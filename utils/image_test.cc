@@ -0,0 +1,160 @@
+#include <iostream>
+#include <fstream>
+#include <cstddef>
+#include <cstdlib>
+
+#include "piccol_vm.h"
+
+#include "sequencers.h"
+
+// Corrupts the cached image of a program in ways that its key and size checks
+// do not catch. Image::read must reject each one, and loading the program
+// again must compile it instead and run as before.
+
+piccol::Piccol make(const std::string& cache) {
+
+    piccol::Piccol l(piccol::load_file("macrolan.metal"),
+                     piccol::load_file("piccol_lex.metal"),
+                     piccol::load_file("piccol_morph.metal"),
+                     piccol::load_file("piccol_emit.metal"),
+                     piccol::load_file("prelude.piccol"));
+
+    l.use_image_cache(cache);
+    l.init();
+
+    piccol::register_print_sequencer(l);
+
+    return l;
+}
+
+std::string slurp(const std::string& path) {
+
+    std::ifstream f(path);
+
+    if (!f)
+        throw std::runtime_error("Could not open '" + path + "'");
+
+    return std::string(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+}
+
+void spit(const std::string& path, const std::string& data) {
+
+    std::ofstream f(path, std::ios::binary | std::ios::trunc);
+    f << data;
+
+    if (!f)
+        throw std::runtime_error("Could not write '" + path + "'");
+}
+
+// Writes 'code' as the image of 'key' with 'c' patched into the first opcode
+// 'match' accepts; false if there is none.
+
+template <typename F>
+bool write_patched(const std::string& path, uint64_t key, const piccol::Piccol& l, F match, nanom::Opcode c) {
+
+    nanom::VmCode code(l.code);
+
+    for (auto& f : code.codes) {
+        for (auto& o : f.second.edit()) {
+            if (match(o)) {
+                o = c;
+                return piccol::Image::write(path, key, code, l.macro.macros);
+            }
+        }
+    }
+
+    return false;
+}
+
+int main(int argc, char** argv) {
+
+    if (argc != 5) {
+        std::cerr << "Usage: " << argv[0] << " <cache dir> <file> <funname> <funrettype>" << std::endl;
+        return 1;
+    }
+
+    std::string dir(argv[1]);
+    std::string inp = slurp(argv[2]);
+
+    piccol::Piccol l = make(dir);
+    l.load(inp);
+
+    nanom::Struct want;
+    bool want_ok = l.run(argv[3], "Void", argv[4], want);
+
+    piccol::ImageKey key(l.image_key);
+    std::string path = dir + "/" + key.hex() + ".pimg";
+    std::string good = slurp(path);
+
+    int failed = 0;
+
+    auto expect = [&](const std::string& what, bool ok) {
+        std::cout << what << ": " << (ok ? "ok" : "FAILED") << std::endl;
+
+        if (!ok)
+            ++failed;
+    };
+
+    auto rejected = [&]() {
+        piccol::Image img;
+        return !img.read(path, key.h);
+    };
+
+    {
+        piccol::Image img;
+        expect("image as written", img.read(path, key.h));
+    }
+
+    auto any = [](const nanom::Opcode&) { return true; };
+
+    expect("opcode out of range",
+           write_patched(path, key.h, l, any, nanom::Opcode((nanom::op_t)nanom::OPCODE_COUNT)) && rejected());
+
+    expect("call to an unlinked offset",
+           write_patched(path, key.h, l, any, nanom::Opcode::direct(nanom::CALL_DIRECT, 1 << 30, 0)) && rejected());
+
+    auto syscall = [](const nanom::Opcode& o) { return o.op == nanom::SYSCALL_DIRECT; };
+
+    expect("callback out of range",
+           write_patched(path, key.h, l, syscall, nanom::Opcode(nanom::SYSCALL_DIRECT, (nanom::UInt)1 << 30)) &&
+           rejected());
+
+    // A number operand nothing else has, turned into a symbol index.
+    const nanom::UInt marker = 0x5A5A5A5A5A5A5A5AULL;
+
+    if (write_patched(path, key.h, l, any, nanom::Opcode(nanom::PUSH, marker))) {
+
+        std::string data = slurp(path);
+        size_t at = data.find(std::string((const char*)&marker, sizeof(marker)));
+
+        if (at != std::string::npos) {
+            data[at - offsetof(nanom::Opcode, arg) + offsetof(nanom::Opcode, sym)] = 1;
+            spit(path, data);
+        }
+
+        expect("symbol out of range", at != std::string::npos && rejected());
+
+    } else {
+        expect("symbol out of range", false);
+    }
+
+    // The last corrupted image is in the cache; the load must not take it.
+
+    piccol::Piccol l2 = make(dir);
+    l2.load(inp);
+
+    nanom::Struct out;
+    bool ok = l2.run(argv[3], "Void", argv[4], out);
+
+    bool same = (ok == want_ok && out.v.size() == want.v.size());
+
+    for (size_t i = 0; same && i < out.v.size(); ++i) {
+        same = (out.v[i].uint == want.v[i].uint);
+    }
+
+    expect("load past a corrupted image", same);
+
+    spit(path, good);
+
+    return (failed ? 1 : 0);
+}
@@ -84,12 +84,12 @@ bool do_unirand(const nanom::Shapes& shapes, const nanom::Shape& shape, const na
 
 int main(int argc, char** argv) {
 
-    if (argc != 6) {
-        std::cerr << "Usage: " << argv[0] << " <sysdir> <appdir> <modspec> <funname> <funrettype>" << std::endl;
+    if (argc != 6 && argc != 7) {
+        std::cerr << "Usage: " << argv[0] << " <sysdir> <appdir> <modspec> <funname> <funrettype> [cachedir]" << std::endl;
         return 1;
     }
 
-    piccol::Modules mod(argv[1], argv[2], argv[3]); 
+    piccol::Modules mod(argv[1], argv[2], argv[3], false, (argc == 7 ? argv[6] : "")); 
 
     mod.register_callback("print", "Int", "Void", do_cout_int);
     mod.register_callback("print", "Sym", "Void", do_cout_sym);
@@ -0,0 +1,74 @@
+
+#include <iostream>
+#include <fstream>
+
+#include "piccol_vm.h"
+#include "piccol_aot.h"
+
+#include "sequencers.h"
+
+
+bool declared_only(const nanom::Shapes& shapes, const nanom::Shape& shape, const nanom::Shape& shapeto,
+                   const nanom::Struct& struc, nanom::Struct& ret) {
+    throw std::runtime_error("Callback declared with -c called at compile time.");
+}
+
+int main(int argc, char** argv) {
+
+    if (argc < 3) {
+        std::cerr << "Usage: " << argv[0] << " <file> <output.cc> [<loader name>] [-c <name> <from> <to>]..."
+                  << std::endl
+                  << "  The print sequencer is always available; declare any other callbacks" << std::endl
+                  << "  the program calls with -c. The host registers them on its AotModule." << std::endl;
+        return 1;
+    }
+
+    std::ifstream ifile(argv[1]);
+
+    if (!ifile)
+        throw std::runtime_error("Could not open '" + std::string(argv[1]) + "'");
+
+    std::string inp;
+    inp.assign(std::istreambuf_iterator<char>(ifile),
+               std::istreambuf_iterator<char>());
+
+    piccol::Piccol l(piccol::load_file("macrolan.metal"),
+                     piccol::load_file("piccol_lex.metal"),
+                     piccol::load_file("piccol_morph.metal"),
+                     piccol::load_file("piccol_emit.metal"),
+                     piccol::load_file("prelude.piccol"));
+
+    l.init();
+
+    piccol::register_print_sequencer(l);
+
+    std::string loader = "piccol_aot_load";
+    int i = 3;
+
+    if (i < argc && std::string(argv[i]) != "-c") {
+        loader = argv[i];
+        ++i;
+    }
+
+    while (i < argc) {
+        if (std::string(argv[i]) != "-c" || i + 3 >= argc) {
+            std::cerr << "Expected -c <name> <from> <to>" << std::endl;
+            return 1;
+        }
+
+        l.register_callback(argv[i+1], argv[i+2], argv[i+3], declared_only);
+        i += 4;
+    }
+
+    l.load(inp);
+
+    std::ofstream ofile(argv[2]);
+
+    if (!ofile)
+        throw std::runtime_error("Could not open '" + std::string(argv[2]) + "'");
+
+    piccol::AotWriter w(l.code);
+    w.write(ofile, loader, argv[1]);
+
+    return 0;
+}
@@ -0,0 +1,70 @@
+#include <iostream>
+
+#include "piccol_aot.h"
+
+#include "sequencers.h"
+
+// Runs a program translated by utils/piccol_aot with the loader name
+// 'piccol_aot_load', printing the result as utils/piccol_test does.
+
+void piccol_aot_load(piccol::AotModule& m);
+
+void print_(const nanom::Shapes& shapes, const nanom::Shape& shape, const nanom::Struct& struc) {
+
+    std::cout << "{" << std::endl;
+    for (const auto& i : shape.sym2field) {
+
+        std::cout << metalan::symtab().get(i.first) << "=";
+
+        switch (i.second.type) {
+        case nanom::BOOL:
+        case nanom::INT:
+            std::cout << struc.get_field(i.second.ix_from).inte;
+            break;
+        case nanom::UINT:
+            std::cout << struc.get_field(i.second.ix_from).uint;
+            break;
+        case nanom::REAL:
+            std::cout << struc.get_field(i.second.ix_from).real;
+            break;
+        case nanom::SYMBOL:
+            std::cout << metalan::symtab().get(struc.get_field(i.second.ix_from).uint);
+            break;
+        case nanom::STRUCT:
+            print_(shapes, shapes.get(i.second.shape), struc.substruct(i.second.ix_from, i.second.ix_to));
+            break;
+        case nanom::NONE:
+            std::cout << "<fail>";
+            break;
+        }
+
+        std::cout << std::endl;
+    }
+    std::cout << "}" << std::endl;
+}
+
+int main(int argc, char** argv) {
+
+    if (argc != 3) {
+        std::cerr << "Usage: " << argv[0] << " <funname> <funrettype>" << std::endl;
+        return 1;
+    }
+
+    piccol::AotModule m;
+
+    piccol_aot_load(m);
+
+    piccol::register_print_sequencer(m);
+
+    nanom::Struct out;
+
+    bool ret = m.run(argv[1], "Void", argv[2], out);
+
+    if (!ret) {
+        std::cout << "fail." << std::endl;
+    } else {
+        print_(m.shapes, m.shapes.get(argv[2]), out);
+    }
+
+    return 0;
+}
@@ -0,0 +1,204 @@
+
+#include <chrono>
+#include <iostream>
+#include <thread>
+
+#include "piccol_vm.h"
+#include "piccol_pool.h"
+
+#include "sequencers.h"
+
+
+int main(int argc, char** argv) {
+
+    if (argc < 4) {
+        std::cerr << "Usage: " << argv[0] << " <file> <runs> [stack|nojit|compact|noopt|noinline|register|check|threads|pool] <funname>:<funrettype>..." << std::endl;
+        return 1;
+    }
+
+    std::ifstream ifile(argv[1]);
+
+    if (!ifile)
+        throw std::runtime_error("Could not open '" + std::string(argv[1]) + "'");
+
+    std::string inp;
+    inp.assign(std::istreambuf_iterator<char>(ifile),
+               std::istreambuf_iterator<char>());
+
+    size_t runs = ::strtoul(argv[2], NULL, 10);
+
+    piccol::Piccol l(piccol::load_file("macrolan.metal"),
+                     piccol::load_file("piccol_lex.metal"),
+                     piccol::load_file("piccol_morph.metal"),
+                     piccol::load_file("piccol_emit.metal"),
+                     piccol::load_file("prelude.piccol"));
+
+    if (std::string(argv[3]) == "noopt") {
+        l.use_optimizer(false);
+    }
+
+    if (std::string(argv[3]) == "noinline") {
+        l.set_inline_budget(0);
+    }
+
+    l.init();
+
+    piccol::register_print_sequencer(l);
+
+    l.load(inp);
+
+    int firstfun = 3;
+    std::string backend = "stack";
+
+    if (std::string(argv[3]).find(':') == std::string::npos) {
+        backend = argv[3];
+        firstfun = 4;
+
+        if (backend == "register") {
+            l.backend = piccol::Piccol::REGISTER_BACKEND;
+        } else if (backend == "check") {
+            l.backend = piccol::Piccol::CHECK_BACKEND;
+        } else if (backend == "nojit") {
+            l.use_jit(false);
+        } else if (backend == "compact") {
+            l.use_compact(true);
+        } else if (backend == "threads" || backend == "pool") {
+            l.freeze();
+        } else if (backend == "noopt" || backend == "noinline") {
+            // Set before loading, above.
+        } else if (backend != "stack") {
+            std::cerr << "Unknown backend: " << backend << std::endl;
+            return 1;
+        }
+    }
+
+#ifdef NANOM_THREADED_DISPATCH
+    std::cout << "dispatch: threaded, backend: " << backend;
+#else
+    std::cout << "dispatch: switch, backend: " << backend;
+#endif
+    std::cout << ", jit: " << (l.vm.jit ? "on" : "off")
+              << ", code: " << l.code.image.size() << " opcodes, "
+              << l.code.image.size() * sizeof(nanom::Opcode) << " bytes, "
+              << l.code.compact.size() << " bytes compact" << std::endl;
+
+    for (int i = firstfun; i < argc; ++i) {
+
+        std::string fun(argv[i]);
+        size_t colon = fun.find(':');
+
+        if (colon == std::string::npos) {
+            std::cerr << "Expected <funname>:<funrettype>, got '" << fun << "'" << std::endl;
+            return 1;
+        }
+
+        std::string name = fun.substr(0, colon);
+        std::string rettype = fun.substr(colon + 1);
+
+        nanom::Struct out;
+        bool ret = true;
+
+        if (backend == "threads") {
+
+            // Every thread does 'runs' runs on the shared code; all of them
+            // must come up with what a plain run does.
+
+            size_t nthreads = std::max(2u, std::thread::hardware_concurrency());
+            std::vector<nanom::Struct> outs(nthreads);
+            std::vector<char> rets(nthreads);
+            std::vector<std::thread> threads;
+
+            ret = l.run(name, "Void", rettype, out);
+
+            auto b = std::chrono::steady_clock::now();
+
+            for (size_t t = 0; t < nthreads; ++t) {
+                threads.emplace_back([&,t]() {
+                        piccol::PiccolThread pt(l);
+
+                        for (size_t n = 0; n < runs; ++n) {
+                            rets[t] = pt.run(name, "Void", rettype, nanom::Struct(), outs[t]);
+                        }
+                    });
+            }
+
+            for (auto& t : threads) {
+                t.join();
+            }
+
+            auto e = std::chrono::steady_clock::now();
+            double secs = std::chrono::duration<double>(e - b).count();
+
+            for (size_t t = 0; t < nthreads; ++t) {
+                if ((bool)rets[t] != ret || !std::equal_to<nanom::Struct>()(outs[t], out)) {
+                    ret = false;
+                }
+            }
+
+            std::cout << name << " Void->" << rettype << ": "
+                      << (ret ? "ok" : "fail") << ", "
+                      << nthreads << " threads x " << runs << " runs, " << secs << " s, "
+                      << (secs / (runs * nthreads)) * 1e3 << " ms/run" << std::endl;
+            continue;
+        }
+
+        if (backend == "pool") {
+
+            ret = l.run(name, "Void", rettype, out);
+
+            piccol::PiccolPool pool(l);
+            std::vector< std::future<piccol::PiccolPool::result_t> > futs;
+
+            auto b = std::chrono::steady_clock::now();
+
+            for (size_t n = 0; n < runs; ++n) {
+                futs.push_back(pool.submit(name, "Void", rettype, nanom::Struct()));
+            }
+
+            size_t depth = pool.queue_depth();
+
+            for (auto& f : futs) {
+                piccol::PiccolPool::result_t r = f.get();
+
+                if (r.ok != ret || !std::equal_to<nanom::Struct>()(r.out, out)) {
+                    ret = false;
+                }
+            }
+
+            auto e = std::chrono::steady_clock::now();
+            double secs = std::chrono::duration<double>(e - b).count();
+
+            std::cout << name << " Void->" << rettype << ": "
+                      << (ret ? "ok" : "fail") << ", "
+                      << pool.size() << " workers, " << runs << " runs, " << secs << " s, "
+                      << (secs / runs) * 1e3 << " ms/run, queue depth " << depth << " after submit" << std::endl;
+
+            for (const auto& w : pool.stats()) {
+                std::cout << "  worker: " << w.jobs << " jobs, " << w.steals << " stolen, "
+                          << w.utilization * 100 << "% busy" << std::endl;
+            }
+
+            continue;
+        }
+
+        l.vm.stack.reset_high_water();
+
+        auto b = std::chrono::steady_clock::now();
+
+        for (size_t n = 0; n < runs; ++n) {
+            ret = l.run(name, "Void", rettype, out);
+        }
+
+        auto e = std::chrono::steady_clock::now();
+        double secs = std::chrono::duration<double>(e - b).count();
+
+        std::cout << name << " Void->" << rettype << ": "
+                  << (ret ? "ok" : "fail") << ", "
+                  << runs << " runs, " << secs << " s, "
+                  << (secs / runs) * 1e3 << " ms/run, stack high-water "
+                  << l.vm.stack.high_water() << " values, "
+                  << l.jit.functions << " functions jitted" << std::endl;
+    }
+
+    return 0;
+}
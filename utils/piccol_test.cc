@@ -54,20 +54,18 @@ struct _rnd {
     }
 };
 
-bool do_unirand(const nanom::Shapes& shapes, const nanom::Shape& shape, const nanom::Shape& shapeto,
-                const nanom::Struct& struc, nanom::Struct& ret) {
+nanom::Int do_unirand(nanom::Int a, nanom::Int b) {
     static _rnd r;
-    std::uniform_int_distribution<nanom::Int> dist(struc.v[0].inte, struc.v[1].inte);
-    ret.v.push_back(dist(r.gen));
-    return true;
+    std::uniform_int_distribution<nanom::Int> dist(a, b);
+    return dist(r.gen);
 }
 
 int main(int argc, char** argv) {
 
     std::string inp;
 
-    if (argc != 4) {
-        std::cerr << "Usage: " << argv[0] << " <file> <funname> <funrettype>" << std::endl;
+    if (argc != 4 && argc != 5) {
+        std::cerr << "Usage: " << argv[0] << " <file> <funname> <funrettype> [stack|nojit|jit|compact|noopt|noinline|cache|register|check|trace|profile|timings|capacity=N][,...]" << std::endl;
         return 1;
     }
 
@@ -87,20 +85,81 @@ int main(int argc, char** argv) {
                    std::istreambuf_iterator<char>());
     }
 
+    // Several modes can be given, separated by commas.
+    std::vector<std::string> modes;
+
+    if (argc == 5) {
+        std::string m(argv[4]);
+        size_t b = 0;
+
+        while (b <= m.size()) {
+            size_t e = std::min(m.find(',', b), m.size());
+            modes.push_back(m.substr(b, e - b));
+            b = e + 1;
+        }
+    }
+
+    auto has_mode = [&](const std::string& m) {
+        return std::find(modes.begin(), modes.end(), m) != modes.end();
+    };
+
     piccol::Piccol l(piccol::load_file("macrolan.metal"),
                      piccol::load_file("piccol_lex.metal"),
                      piccol::load_file("piccol_morph.metal"),
                      piccol::load_file("piccol_emit.metal"),
                      piccol::load_file("prelude.piccol"));
 
+    if (has_mode("noopt")) {
+        l.use_optimizer(false);
+    }
+
+    if (has_mode("noinline")) {
+        l.set_inline_budget(0);
+    }
+
+    if (has_mode("cache")) {
+        l.use_image_cache("/tmp");
+    }
+
     l.init();
 
     piccol::register_print_sequencer(l);
 
-    l.register_callback("random", "[ Int Int ]", "Int", do_unirand);
+    l.register_callback<nanom::Int(nanom::Int,nanom::Int)>("random", do_unirand);
     
     l.load(inp);
 
+    nanom::VmProfile prof;
+    bool timings = false;
+
+    for (const std::string& b : modes) {
+
+        if (b == "register") {
+            l.backend = piccol::Piccol::REGISTER_BACKEND;
+        } else if (b == "check") {
+            l.backend = piccol::Piccol::CHECK_BACKEND;
+        } else if (b == "nojit") {
+            l.use_jit(false);
+        } else if (b == "jit") {
+            l.jit.threshold = 1;
+        } else if (b == "compact") {
+            l.use_compact(true);
+        } else if (b.compare(0, 9, "capacity=") == 0) {
+            l.set_stack_capacity(::strtoul(b.c_str() + 9, NULL, 10));
+        } else if (b == "noopt" || b == "noinline" || b == "cache") {
+            // Set before loading, above.
+        } else if (b == "trace") {
+            l.verbose = true;
+        } else if (b == "profile") {
+            l.profile = &prof;
+        } else if (b == "timings") {
+            timings = true;
+        } else if (b != "stack") {
+            std::cerr << "Unknown backend: " << b << std::endl;
+            return 1;
+        }
+    }
+
     nanom::Struct out;
 
     bool ret = l.run(argv[2], "Void", argv[3], out);
@@ -111,5 +170,13 @@ int main(int argc, char** argv) {
         print_(l.vm.shapes, l.vm.shapes.get(argv[3]), out);
     }
 
+    if (l.profile) {
+        std::cout << l.as.print(prof);
+    }
+
+    if (timings) {
+        std::cout << l.code.timings.print();
+    }
+
     return 0;
 }